@@ -35,6 +35,7 @@
 #include <assert.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 
 
 //const char *code = "var a = 5; if (a==5) a=4; else a=3;";
@@ -51,9 +52,9 @@ void js_dump(CScriptVar *v, void *userdata) {
     js->root->trace(">  ");
 }
 
-// Read whole script file into memory and execute
-void execute_script(CTinyJS *js, const char *path) {
-  FILE *fp = fopen(path, "r");
+// Read whole file into memory
+std::string read_file(const char *path) {
+  FILE *fp = fopen(path, "rb");
   if (!fp)
     throw new CScriptException("cannot open file: " + std::string(path));
   size_t size = 0, cap = 1024, num;
@@ -66,9 +67,30 @@ void execute_script(CTinyJS *js, const char *path) {
     }
   }
   fclose(fp);
-  buf[size] = 0;
-  js->execute(buf);
+  std::string data(buf, size);
   free(buf);
+  return data;
+}
+
+// Read whole script file (which may have been precompiled) into memory and execute
+void execute_script(CTinyJS *js, const char *path) {
+  std::string data = read_file(path);
+  if (CTinyJS::isPrecompiled(data))
+    js->executePrecompiled(data);
+  else
+    js->execute(data);
+}
+
+// Precompile a script file, so that it can be run without lexing it again
+void precompile_script(CTinyJS *js, const char *path, const char *outPath) {
+  std::string data = js->precompile(read_file(path));
+  FILE *fp = fopen(outPath, "wb");
+  if (!fp)
+    throw new CScriptException("cannot write file: " + std::string(outPath));
+  bool written = fwrite(data.data(), 1, data.size(), fp)==data.size();
+  // buffered data is only written when we close, so that can fail too
+  if (fclose(fp)!=0 || !written)
+    throw new CScriptException("cannot write file: " + std::string(outPath));
 }
 
 int main(int argc, char **argv)
@@ -83,8 +105,26 @@ int main(int argc, char **argv)
   /* Execute out bit of code - we could call 'evaluate' here if
      we wanted something returned */
   try {
-    if (argc >= 2) {
-      for (int i = 1; i < argc; i++) execute_script(js, argv[i]);
+    /* '-save-snapshot file' writes everything the scripts created to file once they have run,
+       and '-load-snapshot file' starts from what was written, rather than running them again */
+    int first = 1;
+    const char *saveSnapshot = 0;
+    /* '-precompile out in' writes a version of the script in that runs without being lexed again */
+    if (argc == 4 && !strcmp(argv[1], "-precompile")) {
+      precompile_script(js, argv[3], argv[2]);
+      delete js;
+      return 0;
+    }
+    if (argc >= 3 && !strcmp(argv[1], "-save-snapshot")) {
+      saveSnapshot = argv[2];
+      first = 3;
+    } else if (argc >= 3 && !strcmp(argv[1], "-load-snapshot")) {
+      js->loadSnapshot(argv[2]);
+      first = 3;
+    }
+    if (argc > first || saveSnapshot) {
+      for (int i = first; i < argc; i++) execute_script(js, argv[i]);
+      if (saveSnapshot) js->saveSnapshot(saveSnapshot);
       delete js;
       return 0;
     }
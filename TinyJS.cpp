@@ -103,6 +103,37 @@
                    Fixed postfix increment operator
    Version 0.32 :  Fixed Math.randInt on 32 bit PCs, where it was broken
    Version 0.33 :  Fixed Memory leak + brokenness on === comparison
+   Version 0.34 :  Function bodies reference the (shared) source they were parsed from
+                     rather than copying it, so cloning objects with methods is cheap
+                   true/false/null/undefined and small integers are shared constants
+                   Shift operators no longer modify their left hand side
+                   mathsOp dispatches on the kinds of both values through a table of kernels
+                   Integer results that overflow 32 bits become doubles
+                   +=, -=, ++ and -- modify numbers and strings in-place if nothing else references them
+                   Cache the results of findInParentClasses
+                   Added intrinsic native functions, which are called without a scope (used for Math)
+                   Math.PI and Math.E are now properties rather than functions
+                   Added optional optimiser (setOptimise) that folds constants and removes dead branches
+                   Added optional compiler (setCompileThreshold) for hot functions that only use numbers
+                   For loops like 'for (...; i<n; i++)' test and step the counter without parsing
+                   Added break, continue and do...while
+                   Added switch - the cases of each switch are found once, so we can jump straight to the right one
+                   Loops are no longer limited to TINYJS_LOOP_MAX_ITERATIONS - added setFuelLimit and setTimeLimit,
+                     which throw CScriptLimitException
+                   Added setMemoryLimit, getMemoryUsed and getMemoryPeak - memory used by scripts is counted per CTinyJS
+                   Separate CTinyJS instances can be used on different threads at once (see run_tests -threads)
+                   Added CTinyJS::clone (and a copy constructor) to copy an engine with its functions and variables
+                   Added saveSnapshot/loadSnapshot to write all variables to a file and read them back
+                   Added precompile/executePrecompiled, which store the tokens of code so it needn't be lexed again
+                   Added addNatives/addIntrinsics, which add tables of functions without parsing descriptions
+                   Functions from addNatives/addIntrinsics/addConstants aren't created until they're first looked up
+                   Added freezeBuiltins, so copies of a CTinyJS share its built-in objects until they change them
+                   Added markBaseline and resetToBaseline, to undo what scripts have changed since a point
+                   Added CTinyJSPool (TinyJS_Pool.h), which runs jobs on worker threads with their own engines
+                   Added CScriptChannel and CScriptVar::serialize, to send copies of values between engines
+                   Added Array.parallelMap and parallelForEach (CTinyJSPool::addTo), which run a function on worker engines
+                   Added CScriptTask, which runs code that can wait for native functions to give their results later
+                   Added callFunction, to call a function many times without parsing a call to it each time
 
     NOTE:
           Constructing an array with an initial length 'Array(5)' doesn't work
@@ -134,6 +165,48 @@
 #include <sstream>
 #include <cstdlib>
 #include <stdio.h>
+#include <limits.h>
+#include <stdint.h>
+#include <math.h>
+#include <map>
+#include <set>
+#include <algorithm>
+
+// what CScriptTask uses to run code on a stack of its own
+#ifdef _WIN32
+#ifndef WIN32_LEAN_AND_MEAN
+#define WIN32_LEAN_AND_MEAN
+#endif
+#ifndef NOMINMAX
+#define NOMINMAX
+#endif
+#include <windows.h>
+#else
+#include <ucontext.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#endif
+// sanitizers have to be told when a CScriptTask switches stacks
+#if defined(__SANITIZE_ADDRESS__)
+#define TINYJS_ASAN_FIBERS
+#elif defined(__has_feature)
+#if __has_feature(address_sanitizer)
+#define TINYJS_ASAN_FIBERS
+#endif
+#endif
+#if defined(__SANITIZE_THREAD__)
+#define TINYJS_TSAN_FIBERS
+#elif defined(__has_feature)
+#if __has_feature(thread_sanitizer)
+#define TINYJS_TSAN_FIBERS
+#endif
+#endif
+#ifdef TINYJS_ASAN_FIBERS
+#include <sanitizer/common_interface_defs.h>
+#endif
+#ifdef TINYJS_TSAN_FIBERS
+#include <sanitizer/tsan_interface.h>
+#endif
 
 using namespace std;
 
@@ -158,8 +231,9 @@ using namespace std;
 
 #if DEBUG_MEMORY
 
-vector<CScriptVar*> allocatedVars;
-vector<CScriptVarLink*> allocatedLinks;
+// each thread reports what its own CTinyJS instances leaked
+thread_local vector<CScriptVar*> allocatedVars;
+thread_local vector<CScriptVarLink*> allocatedLinks;
 
 void mark_allocated(CScriptVar *v) {
     allocatedVars.push_back(v);
@@ -290,19 +364,258 @@ CScriptException::CScriptException(const string &exceptionText) {
     text = exceptionText;
 }
 
+// ----------------------------------------------------------------------------------- CSCRIPTLIMITS
+
+CScriptLimits::CScriptLimits() {
+    fuelLimit = 0;
+    timeLimit = 0;
+    fuelUsed = 0;
+    memory = 0;
+    nextCheck = LLONG_MAX;
+}
+
+void CScriptLimits::start() {
+    fuelUsed = 0;
+    deadline = std::chrono::steady_clock::now() + std::chrono::milliseconds(timeLimit);
+    setNextCheck();
+}
+
+void CScriptLimits::check() {
+    if (memory && memory->isExceeded()) {
+      ostringstream msg;
+      msg << "Memory limit of " << memory->limit << " bytes exceeded";
+      throw new CScriptLimitException(msg.str());
+    }
+    if (fuelLimit && fuelUsed > fuelLimit) {
+      ostringstream msg;
+      msg << "Fuel limit of " << fuelLimit << " exceeded";
+      throw new CScriptLimitException(msg.str());
+    }
+    if (timeLimit && std::chrono::steady_clock::now() >= deadline) {
+      ostringstream msg;
+      msg << "Time limit of " << timeLimit << "ms exceeded";
+      throw new CScriptLimitException(msg.str());
+    }
+    setNextCheck();
+}
+
+void CScriptLimits::setNextCheck() {
+    nextCheck = fuelLimit ? fuelLimit+1 : LLONG_MAX;
+    // reading the clock is slow, so only do it every so often
+    if (timeLimit && fuelUsed+TINYJS_TIME_CHECK_INTERVAL < nextCheck)
+      nextCheck = fuelUsed+TINYJS_TIME_CHECK_INTERVAL;
+    // if a previous script left us over the memory limit, stop straight away
+    if (memory && memory->isExceeded())
+      checkSoon();
+}
+
+// ----------------------------------------------------------------------------------- CSCRIPTMEMORY
+
+thread_local CScriptMemory *CScriptMemory::current = 0;
+
+CScriptMemory::CScriptMemory() {
+    used = 0;
+    peak = 0;
+    limit = 0;
+    limits = 0;
+    baseline = 0;
+    engine = 0;
+    classEpoch = 0;
+    refs = 0;
+}
+
+CScriptMemory *CScriptMemory::ref() {
+    refs++;
+    return this;
+}
+
+void CScriptMemory::unref() {
+    if ((--refs)==0)
+      delete this;
+}
+
+CScriptMemory *CScriptMemory::charge(size_t bytes) {
+    if (!current) return 0;
+    current->allocate(bytes);
+    return current->ref();
+}
+
+void CScriptMemory::exceeded() {
+    /* We can't throw from the middle of an allocation, so instead make the
+     * limits throw at the next loop iteration or function call */
+    if (limits) limits->checkSoon();
+}
+
+// ----------------------------------------------------------------------------------- CSCRIPTFROZENVARS
+
+CScriptFrozenVars::CScriptFrozenVars() : refs(0) {
+}
+
+CScriptFrozenVars::~CScriptFrozenVars() {
+    // constants ignore unref, so their links can go in any order - but all before the variables themselves
+    for (size_t i=0;i<vars.size();i++)
+      vars[i]->removeAllChildren();
+    for (size_t i=0;i<vars.size();i++)
+      delete vars[i];
+}
+
+CScriptFrozenVars *CScriptFrozenVars::ref() {
+    refs++;
+    return this;
+}
+
+void CScriptFrozenVars::unref() {
+    if ((--refs)==0)
+      delete this;
+}
+
+// ----------------------------------------------------------------------------------- CSCRIPTBASELINE
+
+CScriptBaseline::~CScriptBaseline() {
+    // the links must forget they were saved before anything is freed
+    vector<CScriptVar*> linkVars;
+    for (unordered_map<CScriptVarLink*, pair<CScriptVar*, string> >::iterator it = links.begin(); it!=links.end(); it++) {
+      it->first->baselineSaved = false;
+      linkVars.push_back(it->second.first);
+    }
+    links.clear();
+    for (size_t i=0;i<linkVars.size();i++)
+      linkVars[i]->unref();
+    for (size_t i=0;i<vars.size();i++) {
+      vars[i].second->unref();
+      vars[i].first->unref();
+    }
+}
+
+void CScriptBaseline::saveVar(CScriptVar *var) {
+    CScriptVar *saved = new CScriptVar();
+    saved->copySimpleData(var);
+    saved->copyCallbacks(var);
+    // links that have changed since the baseline saved what they were
+    for (CScriptVarLink *child = var->firstChild; child; child = child->nextSibling) {
+      if (child->baselineSaved) {
+        pair<CScriptVar*, string> &was = links[child];
+        saved->addChild(was.second, was.first);
+      } else if (child->baseline)
+        saved->addChild(child->name, child->var);
+    }
+    // as in clone, only set the flags once it has its children
+    saved->flags = var->flags;
+    vars.push_back(pair<CScriptVar*, CScriptVar*>(var->ref(), saved->ref()));
+}
+
+void CScriptBaseline::saveLink(CScriptVarLink *link) {
+    links[link] = pair<CScriptVar*, string>(link->var->ref(), link->name);
+    link->baselineSaved = true;
+}
+
+void CScriptBaseline::forgetLink(CScriptVarLink *link) {
+    unordered_map<CScriptVarLink*, pair<CScriptVar*, string> >::iterator it = links.find(link);
+    if (it == links.end()) return;
+    CScriptVar *var = it->second.first;
+    links.erase(it); // before unref, which could free links that are in here too
+    var->unref();
+}
+
+void CScriptBaseline::restore() {
+    /* Put back the variables first. Their links are all replaced, so links that were saved and are
+     * still there after this are in variables that haven't changed */
+    vector<pair<CScriptVar*, CScriptVar*> > savedVars;
+    savedVars.swap(vars);
+    for (size_t i=0;i<savedVars.size();i++) {
+      CScriptVar *var = savedVars[i].first;
+      CScriptVar *saved = savedVars[i].second;
+      var->removeAllChildren();
+      var->copySimpleData(saved);
+      var->copyCallbacks(saved);
+      for (CScriptVarLink *child = saved->firstChild; child; child = child->nextSibling)
+        var->addChild(child->name, child->var)->baseline = true;
+      var->flags = saved->flags;
+    }
+    // nothing is unreferenced until everything is back, so nothing in the baseline is freed
+    vector<CScriptVar*> replaced;
+    for (unordered_map<CScriptVarLink*, pair<CScriptVar*, string> >::iterator it = links.begin(); it!=links.end(); it++) {
+      CScriptVarLink *link = it->first;
+      link->var->classChanged();
+      replaced.push_back(link->var);
+      link->var = it->second.first; // it has the reference we held
+      if (link->memory) link->memory->free(link->name.capacity());
+      link->name = it->second.second;
+      if (link->memory) link->memory->allocate(link->name.capacity());
+      link->baselineSaved = false;
+      link->baseline = true;
+    }
+    links.clear();
+    for (size_t i=0;i<replaced.size();i++)
+      replaced[i]->unref();
+    for (size_t i=0;i<savedVars.size();i++) {
+      savedVars[i].second->unref();
+      savedVars[i].first->unref();
+    }
+}
+
+// ----------------------------------------------------------------------------------- CSCRIPTSOURCE
+
+CScriptSource::CScriptSource(const string &code) : code(code) {
+    refs = 0;
+    memory = CScriptMemory::charge(sizeof(CScriptSource)+this->code.capacity());
+}
+
+CScriptSource::~CScriptSource() {
+    CScriptMemory::release(memory, sizeof(CScriptSource)+code.capacity()+getPrecompiledSize());
+}
+
+void CScriptSource::setPrecompiled(vector<CScriptPrecompiledToken> &tokens, vector<string> &strings, vector<int> &newlines) {
+    ASSERT(!isPrecompiled());
+    this->tokens.swap(tokens);
+    this->strings.swap(strings);
+    this->newlines.swap(newlines);
+    if (memory) memory->allocate(getPrecompiledSize());
+}
+
+size_t CScriptSource::getPrecompiledSize() {
+    size_t size = tokens.capacity()*sizeof(CScriptPrecompiledToken) +
+                  strings.capacity()*sizeof(string) +
+                  newlines.capacity()*sizeof(int);
+    for (size_t i=0;i<strings.size();i++)
+      size += strings[i].capacity();
+    return size;
+}
+
+CScriptSource *CScriptSource::ref() {
+    refs++;
+    return this;
+}
+
+void CScriptSource::unref() {
+    if ((--refs)==0)
+      delete this;
+}
+
 // ----------------------------------------------------------------------------------- CSCRIPTLEX
 
 CScriptLex::CScriptLex(const string &input) {
-    data = _strdup(input.c_str());
-    dataOwned = true;
+    source = (new CScriptSource(input))->ref();
+    memory = CScriptMemory::charge(sizeof(CScriptLex));
+    data = source->getData();
     dataStart = 0;
-    dataEnd = strlen(data);
+    dataEnd = source->getLength();
     reset();
 }
 
 CScriptLex::CScriptLex(CScriptLex *owner, int startChar, int endChar) {
-    data = owner->data;
-    dataOwned = false;
+    source = owner->source->ref();
+    memory = CScriptMemory::charge(sizeof(CScriptLex));
+    data = source->getData();
+    dataStart = startChar;
+    dataEnd = endChar;
+    reset();
+}
+
+CScriptLex::CScriptLex(CScriptSource *source, int startChar, int endChar) {
+    this->source = source->ref();
+    memory = CScriptMemory::charge(sizeof(CScriptLex));
+    data = source->getData();
     dataStart = startChar;
     dataEnd = endChar;
     reset();
@@ -310,17 +623,33 @@ CScriptLex::CScriptLex(CScriptLex *owner, int startChar, int endChar) {
 
 CScriptLex::~CScriptLex(void)
 {
-    if (dataOwned)
-        free((void*)data);
+    source->unref();
+    CScriptMemory::release(memory, sizeof(CScriptLex));
 }
 
 void CScriptLex::reset() {
-    dataPos = dataStart;
+    seek(dataStart);
+}
+
+void CScriptLex::seek(int position) {
+    dataPos = position;
     tokenStart = 0;
     tokenEnd = 0;
     tokenLastEnd = 0;
     tk = 0;
     tkStr = "";
+    if (source->isPrecompiled()) {
+      // find the first token at or after position
+      int lo = 0, hi = (int)source->tokens.size();
+      while (lo<hi) {
+        int mid = (lo+hi)/2;
+        if (source->tokens[mid].start < position) lo = mid+1; else hi = mid;
+      }
+      // past the end, we still want the final LEX_EOF
+      tokenIndex = lo<(int)source->tokens.size() ? lo : (int)source->tokens.size()-1;
+      getNextPrecompiledToken();
+      return;
+    }
     getNextCh();
     getNextCh();
     getNextToken();
@@ -384,6 +713,9 @@ string CScriptLex::getTokenStr(int token) {
         case LEX_R_NULL : return "null";
         case LEX_R_UNDEFINED : return "undefined";
         case LEX_R_NEW : return "new";
+        case LEX_R_SWITCH : return "switch";
+        case LEX_R_CASE : return "case";
+        case LEX_R_DEFAULT : return "default";
     }
 
     ostringstream msg;
@@ -401,6 +733,10 @@ void CScriptLex::getNextCh() {
 }
 
 void CScriptLex::getNextToken() {
+    if (source->isPrecompiled()) {
+      getNextPrecompiledToken();
+      return;
+    }
     tk = LEX_EOF;
     tkStr.clear();
     while (currCh && isWhitespace(currCh)) getNextCh();
@@ -443,6 +779,9 @@ void CScriptLex::getNextToken() {
         else if (tkStr=="null") tk = LEX_R_NULL;
         else if (tkStr=="undefined") tk = LEX_R_UNDEFINED;
         else if (tkStr=="new") tk = LEX_R_NEW;
+        else if (tkStr=="switch") tk = LEX_R_SWITCH;
+        else if (tkStr=="case") tk = LEX_R_CASE;
+        else if (tkStr=="default") tk = LEX_R_DEFAULT;
     } else if (isNumeric(currCh)) { // Numbers
         bool isHex = false;
         if (currCh=='0') { tkStr += currCh; getNextCh(); }
@@ -603,33 +942,58 @@ void CScriptLex::getNextToken() {
     tokenEnd = dataPos-3;
 }
 
-string CScriptLex::getSubString(int lastPosition) {
-    int lastCharIdx = tokenLastEnd+1;
-    if (lastCharIdx < dataEnd) {
-        /* save a memory alloc by using our data array to create the
-           substring */
-        char old = data[lastCharIdx];
-        data[lastCharIdx] = 0;
-        std::string value = &data[lastPosition];
-        data[lastCharIdx] = old;
-        return value;
+void CScriptLex::getNextPrecompiledToken() {
+    /* This sets everything just as getNextToken would have done, so
+     * positions (and sub-lexers) work the same as for normal code */
+    tokenLastEnd = tokenEnd;
+    const CScriptPrecompiledToken &token = source->tokens[tokenIndex];
+    if (token.tk!=LEX_EOF && token.end < dataEnd) {
+      tk = token.tk;
+      if (token.str<0) tkStr.clear();
+      else tkStr = source->strings[token.str];
+      tokenStart = token.start;
+      tokenEnd = token.end;
+      tokenIndex++;
     } else {
-        return std::string(&data[lastPosition]);
+      // the end of our part of the source
+      tk = LEX_EOF;
+      tkStr.clear();
+      tokenStart = token.tk==LEX_EOF ? token.start : dataEnd;
+      tokenEnd = token.tk==LEX_EOF ? token.end : dataEnd-1;
     }
 }
 
-
-CScriptLex *CScriptLex::getSubLex(int lastPosition) {
+int CScriptLex::getSubEnd() {
     int lastCharIdx = tokenLastEnd+1;
     if (lastCharIdx < dataEnd)
-        return new CScriptLex(this, lastPosition, lastCharIdx);
+        return lastCharIdx;
     else
-        return new CScriptLex(this, lastPosition, dataEnd );
+        return dataEnd;
+}
+
+string CScriptLex::getSubString(int lastPosition) {
+    return std::string(&data[lastPosition], getSubEnd()-lastPosition);
+}
+
+
+CScriptLex *CScriptLex::getSubLex(int lastPosition) {
+    return new CScriptLex(this, lastPosition, getSubEnd());
 }
 
 string CScriptLex::getPosition(int pos) {
     if (pos<0) pos=tokenLastEnd;
     int line = 1,col = 1;
+    if (source->isPrecompiled()) {
+      // find the newlines before pos (that we can see) in the line table rather than counting them
+      int lineEnd = pos<dataEnd ? pos : dataEnd;
+      const vector<int> &newlines = source->newlines;
+      int n = (int)(lower_bound(newlines.begin(), newlines.end(), lineEnd) - newlines.begin());
+      line = 1+n;
+      col = n ? pos-1-newlines[n-1] : pos+1;
+      char buf[256];
+      sprintf_s(buf, 256, "(line: %d, col: %d)", line, col);
+      return buf;
+    }
     for (int i=0;i<pos;i++) {
         char ch;
         if (i < dataEnd)
@@ -658,6 +1022,9 @@ CScriptVarLink::CScriptVarLink(CScriptVar *var, const std::string &name) {
     this->prevSibling = 0;
     this->var = var->ref();
     this->owned = false;
+    this->baseline = false;
+    this->baselineSaved = false;
+    this->memory = CScriptMemory::charge(sizeof(CScriptVarLink)+this->name.capacity());
 }
 
 CScriptVarLink::CScriptVarLink(const CScriptVarLink &link) {
@@ -670,17 +1037,25 @@ CScriptVarLink::CScriptVarLink(const CScriptVarLink &link) {
     this->prevSibling = 0;
     this->var = link.var->ref();
     this->owned = false;
+    this->baseline = false;
+    this->baselineSaved = false;
+    this->memory = CScriptMemory::charge(sizeof(CScriptVarLink)+this->name.capacity());
 }
 
 CScriptVarLink::~CScriptVarLink() {
 #if DEBUG_MEMORY
     mark_deallocated(this);
 #endif
+    if (baselineSaved && memory && memory->baseline) memory->baseline->forgetLink(this);
     var->unref();
+    CScriptMemory::release(memory, sizeof(CScriptVarLink)+name.capacity());
 }
 
 void CScriptVarLink::replaceWith(CScriptVar *newVar) {
+    changing();
     CScriptVar *oldVar = var;
+    // if this was a 'prototype' link, objects that used it now have a different class
+    oldVar->classChanged();
     var = newVar->ref();
     oldVar->unref();
 }
@@ -689,16 +1064,29 @@ void CScriptVarLink::replaceWith(CScriptVarLink *newVar) {
     if (newVar)
       replaceWith(newVar->var);
     else
-      replaceWith(new CScriptVar());
+      replaceWith(CScriptVar::constUndefined());
+}
+
+void CScriptVarLink::makeWritable() {
+    if (var->isConstant())
+      replaceWith(var->writableCopy());
 }
 
 int CScriptVarLink::getIntName() {
     return atoi(name.c_str());
 }
 void CScriptVarLink::setIntName(int n) {
+    changing();
     char sIdx[64];
     sprintf_s(sIdx, sizeof(sIdx), "%d", n);
+    if (memory) memory->free(name.capacity());
     name = sIdx;
+    if (memory) memory->allocate(name.capacity());
+}
+
+void CScriptVarLink::saveBaseline() {
+    baseline = false;
+    if (memory && memory->baseline) memory->baseline->saveLink(this);
 }
 
 // ----------------------------------------------------------------------------------- CSCRIPTVAR
@@ -720,6 +1108,7 @@ CScriptVar::CScriptVar(const string &str) {
     init();
     flags = SCRIPTVAR_STRING;
     data = str;
+    chargeData();
 }
 
 
@@ -731,11 +1120,18 @@ CScriptVar::CScriptVar(const string &varData, int varFlags) {
     init();
     flags = varFlags;
     if (varFlags & SCRIPTVAR_INTEGER) {
-      intData = strtol(varData.c_str(),0,0);
+      long long val = strtoll(varData.c_str(),0,0);
+      // too big for maths on ints, so a double - just like an int that overflows
+      if (val<INT_MIN || val>INT_MAX) {
+        flags = (varFlags & ~SCRIPTVAR_INTEGER) | SCRIPTVAR_DOUBLE;
+        doubleData = (double)val;
+      } else
+        intData = (int)val;
     } else if (varFlags & SCRIPTVAR_DOUBLE) {
       doubleData = strtod(varData.c_str(),0);
     } else
       data = varData;
+    chargeData();
 }
 
 CScriptVar::CScriptVar(double val) {
@@ -760,7 +1156,96 @@ CScriptVar::~CScriptVar(void) {
 #if DEBUG_MEMORY
     mark_deallocated(this);
 #endif
+    // another class could be allocated at our address, so make sure cached lookups go
+    classChanged();
+    // nothing can reference us any more, so there's nothing to put back
+    flags &= ~SCRIPTVAR_BASELINE;
     removeAllChildren();
+    if (sourceData) sourceData->unref();
+    delete compiled;
+    CScriptMemory::release(memory, sizeof(CScriptVar)+chargedData);
+}
+
+CScriptVar *CScriptVar::constUndefined() {
+    static CScriptVar *value = (new CScriptVar())->makeConstant();
+    return value;
+}
+
+CScriptVar *CScriptVar::constNull() {
+    static CScriptVar *value = (new CScriptVar(TINYJS_BLANK_DATA, SCRIPTVAR_NULL))->makeConstant();
+    return value;
+}
+
+CScriptVar *CScriptVar::constPending() {
+    static CScriptVar *value = (new CScriptVar())->makeConstant();
+    return value;
+}
+
+CScriptVar *CScriptVar::constInt(int val) {
+    struct SmallInts {
+      CScriptVar *values[TINYJS_SMALL_INT_MAX+1-TINYJS_SMALL_INT_MIN];
+      SmallInts() {
+        for (int i=TINYJS_SMALL_INT_MIN;i<=TINYJS_SMALL_INT_MAX;i++)
+          values[i-TINYJS_SMALL_INT_MIN] = (new CScriptVar(i))->makeConstant();
+      }
+    };
+    static SmallInts smallInts;
+    if (val<TINYJS_SMALL_INT_MIN || val>TINYJS_SMALL_INT_MAX)
+      return new CScriptVar(val);
+    return smallInts.values[val-TINYJS_SMALL_INT_MIN];
+}
+
+CScriptVar *CScriptVar::makeConstant() {
+#if DEBUG_MEMORY
+    mark_deallocated(this); // constants live forever, so don't report them
+#endif
+    data = getString(); // from now on getString just returns data
+    flags |= SCRIPTVAR_CONSTANT;
+    refs = 1;
+    // constants are shared by everything, so aren't charged to whatever created them
+    CScriptMemory::release(memory, sizeof(CScriptVar)+chargedData);
+    memory = 0;
+    chargedData = 0;
+    return this;
+}
+
+void CScriptVar::freeze(std::vector<CScriptVar*> &frozen) {
+    if (isConstant()) return;
+    makeConstant();
+    flags |= SCRIPTVAR_FROZEN;
+    frozen.push_back(this);
+    for (CScriptVarLink *child = firstChild; child; child = child->nextSibling) {
+#if DEBUG_MEMORY
+      mark_deallocated(child);
+#endif
+      CScriptMemory::release(child->memory, sizeof(CScriptVarLink)+child->name.capacity());
+      child->memory = 0;
+      child->var->freeze(frozen);
+    }
+}
+
+CScriptVar *CScriptVar::writableCopy() {
+    CScriptVar *copy = new CScriptVar();
+    copy->copySimpleData(this);
+    copy->copyCallbacks(this);
+    copy->flags = flags & ~(SCRIPTVAR_CONSTANT | SCRIPTVAR_FROZEN | SCRIPTVAR_CLASS);
+    for (CScriptVarLink *child = firstChild; child; child = child->nextSibling)
+      copy->addChild(child->name, child->var);
+    // as in clone, only say it's a class once it has its children
+    copy->flags |= flags & SCRIPTVAR_CLASS;
+    return copy;
+}
+
+void CScriptVar::saveBaseline() {
+    if (memory && memory->baseline) memory->baseline->saveVar(this);
+    flags &= ~SCRIPTVAR_BASELINE;
+}
+
+void CScriptVar::copyCallbacks(CScriptVar *val) {
+    jsCallback = val->jsCallback;
+    jsCallbackUserData = val->jsCallbackUserData;
+    jsIntrinsic = val->jsIntrinsic;
+    intrinsicArgs = val->intrinsicArgs;
 }
 
 void CScriptVar::init() {
@@ -769,10 +1254,28 @@ void CScriptVar::init() {
     flags = 0;
     jsCallback = 0;
     jsCallbackUserData = 0;
+    jsIntrinsic = 0;
+    intrinsicArgs = 0;
+    callCount = 0;
+    compiled = 0;
     data = TINYJS_BLANK_DATA;
+    sourceData = 0;
+    sourceStart = 0;
+    sourceEnd = 0;
     intData = 0;
     doubleData = 0;
     userCustomData = nullptr;
+    chargedData = 0;
+    memory = CScriptMemory::charge(sizeof(CScriptVar));
+}
+
+void CScriptVar::chargeData() {
+    size_t capacity = data.capacity();
+    if (memory && capacity!=chargedData) {
+      memory->free(chargedData);
+      memory->allocate(capacity);
+    }
+    chargedData = capacity;
 }
 
 CScriptVar *CScriptVar::getReturnVar() {
@@ -815,8 +1318,10 @@ CScriptVarLink *CScriptVar::findChildOrCreateByPath(const std::string &path) {
 }
 
 CScriptVarLink *CScriptVar::addChild(const std::string &childName, CScriptVar *child) {
+  changing();
+  classChanged();
   if (isUndefined()) {
-    flags = SCRIPTVAR_OBJECT;
+    flags = (flags&~SCRIPTVAR_VARTYPEMASK) | SCRIPTVAR_OBJECT;
   }
     // if no child supplied, create one
     if (!child)
@@ -863,6 +1368,8 @@ void CScriptVar::removeChild(CScriptVar *child) {
 
 void CScriptVar::removeLink(CScriptVarLink *link) {
     if (!link) return;
+    changing();
+    classChanged();
     if (link->nextSibling)
       link->nextSibling->prevSibling = link->prevSibling;
     if (link->prevSibling)
@@ -875,6 +1382,10 @@ void CScriptVar::removeLink(CScriptVarLink *link) {
 }
 
 void CScriptVar::removeAllChildren() {
+    if (firstChild) {
+      changing();
+      classChanged();
+    }
     CScriptVarLink *c = firstChild;
     while (c) {
         CScriptVarLink *t = c->nextSibling;
@@ -890,7 +1401,7 @@ CScriptVar *CScriptVar::getArrayIndex(int idx) {
     sprintf_s(sIdx, sizeof(sIdx), "%d", idx);
     CScriptVarLink *link = findChild(sIdx);
     if (link) return link->var;
-    else return new CScriptVar(TINYJS_BLANK_DATA, SCRIPTVAR_NULL); // undefined
+    else return constNull(); // undefined
 }
 
 void CScriptVar::setArrayIndex(int idx, CScriptVar *value) {
@@ -954,8 +1465,10 @@ double CScriptVar::getDouble() {
 const string &CScriptVar::getString() {
     /* Because we can't return a string that is generated on demand.
      * I should really just use char* :) */
-    static string s_null = "null";
-    static string s_undefined = "undefined";
+    static const string s_null = "null";
+    static const string s_undefined = "undefined";
+    // constants may be shared between threads, so makeConstant set their string up front
+    if (isConstant()) return data;
     if (isInt()) {
       char buffer[32];
       sprintf_s(buffer, sizeof(buffer), "%ld", intData);
@@ -970,57 +1483,223 @@ const string &CScriptVar::getString() {
     }
     if (isNull()) return s_null;
     if (isUndefined()) return s_undefined;
+    // function bodies are only copied out of the shared source when asked for
+    if (sourceData && data.empty()) {
+      data.assign(sourceData->getData()+sourceStart, sourceEnd-sourceStart);
+      chargeData();
+    }
     // are we just a string here?
     return data;
 }
 
 void CScriptVar::setInt(int val) {
+    changing();
     flags = (flags&~SCRIPTVAR_VARTYPEMASK) | SCRIPTVAR_INTEGER;
     intData = val;
     doubleData = 0;
     data = TINYJS_BLANK_DATA;
+    setFunctionSource(0, 0, 0);
 }
 
 void CScriptVar::setDouble(double val) {
+    changing();
     flags = (flags&~SCRIPTVAR_VARTYPEMASK) | SCRIPTVAR_DOUBLE;
     doubleData = val;
     intData = 0;
     data = TINYJS_BLANK_DATA;
+    setFunctionSource(0, 0, 0);
 }
 
 void CScriptVar::setString(const string &str) {
+    changing();
     // name sure it's not still a number or integer
     flags = (flags&~SCRIPTVAR_VARTYPEMASK) | SCRIPTVAR_STRING;
     data = str;
     intData = 0;
     doubleData = 0;
+    setFunctionSource(0, 0, 0);
+    chargeData();
 }
 
 void CScriptVar::setUndefined() {
+    changing();
     // name sure it's not still a number or integer
     flags = (flags&~SCRIPTVAR_VARTYPEMASK) | SCRIPTVAR_UNDEFINED;
     data = TINYJS_BLANK_DATA;
     intData = 0;
     doubleData = 0;
     removeAllChildren();
+    setFunctionSource(0, 0, 0);
 }
 
 void CScriptVar::setArray() {
+    changing();
     // name sure it's not still a number or integer
     flags = (flags&~SCRIPTVAR_VARTYPEMASK) | SCRIPTVAR_ARRAY;
     data = TINYJS_BLANK_DATA;
     intData = 0;
     doubleData = 0;
     removeAllChildren();
+    setFunctionSource(0, 0, 0);
 }
 
 bool CScriptVar::equals(CScriptVar *v) {
     CScriptVar *resV = mathsOp(v, LEX_EQUAL);
     bool res = resV->getBool();
-    delete resV;
+    if (!resV->getRefs()) delete resV;
     return res;
 }
 
+/* mathsOp works out what kind of values it has been given, and then calls the
+ * kernel for that pair of kinds from MATHSOP_KERNELS. Null and undefined act as
+ * 0 when combined with numbers, so all of those are done by CScriptNumber. */
+enum MATHSOP_KIND {
+    MATHSOP_UNDEFINED,
+    MATHSOP_INT, // integer or null
+    MATHSOP_DOUBLE,
+    MATHSOP_STRING,
+    MATHSOP_ARRAY,
+    MATHSOP_OBJECT,
+    MATHSOP_OTHER, // functions, which we compare as strings
+
+    MATHSOP_KINDS
+};
+
+static int getMathsOpKind(CScriptVar *v) {
+    if (v->isUndefined()) return MATHSOP_UNDEFINED;
+    if (v->isDouble()) return MATHSOP_DOUBLE;
+    if (v->isInt() || v->isNull()) return MATHSOP_INT;
+    if (v->isArray()) return MATHSOP_ARRAY;
+    if (v->isObject()) return MATHSOP_OBJECT;
+    if (v->isString()) return MATHSOP_STRING;
+    return MATHSOP_OTHER;
+}
+
+/// Return an int result, or a double if it doesn't fit in 32 bits
+static CScriptNumber numberIntResult(long long val) {
+    if (val<INT_MIN || val>INT_MAX) return CScriptNumber::makeDouble((double)val);
+    return CScriptNumber::makeInt((int)val);
+}
+
+static CScriptNumber numberOpDoubles(double da, double db, int op) {
+    switch (op) {
+        case '+': return CScriptNumber::makeDouble(da+db);
+        case '-': return CScriptNumber::makeDouble(da-db);
+        case '*': return CScriptNumber::makeDouble(da*db);
+        case '/': return CScriptNumber::makeDouble(da/db);
+        case LEX_EQUAL:     return CScriptNumber::makeInt(da==db);
+        case LEX_NEQUAL:    return CScriptNumber::makeInt(da!=db);
+        case '<':     return CScriptNumber::makeInt(da<db);
+        case LEX_LEQUAL:    return CScriptNumber::makeInt(da<=db);
+        case '>':     return CScriptNumber::makeInt(da>db);
+        case LEX_GEQUAL:    return CScriptNumber::makeInt(da>=db);
+        default: throw new CScriptException("Operation "+CScriptLex::getTokenStr(op)+" not supported on the Double datatype");
+    }
+}
+
+static CScriptNumber numberOpInts(long long da, long long db, int op) {
+    switch (op) {
+        case '+': return numberIntResult(da+db);
+        case '-': return numberIntResult(da-db);
+        case '*': return numberIntResult(da*db);
+        case '/': if (db==0) return numberOpDoubles((double)da, (double)db, op);
+                  return numberIntResult(da/db);
+        case '&': return CScriptNumber::makeInt((int)(da&db));
+        case '|': return CScriptNumber::makeInt((int)(da|db));
+        case '^': return CScriptNumber::makeInt((int)(da^db));
+        case '%': if (db==0) return CScriptNumber::makeDouble(fmod((double)da, (double)db));
+                  return CScriptNumber::makeInt((int)(da%db));
+        case LEX_EQUAL:     return CScriptNumber::makeInt(da==db);
+        case LEX_NEQUAL:    return CScriptNumber::makeInt(da!=db);
+        case '<':     return CScriptNumber::makeInt(da<db);
+        case LEX_LEQUAL:    return CScriptNumber::makeInt(da<=db);
+        case '>':     return CScriptNumber::makeInt(da>db);
+        case LEX_GEQUAL:    return CScriptNumber::makeInt(da>=db);
+        default: throw new CScriptException("Operation "+CScriptLex::getTokenStr(op)+" not supported on the Int datatype");
+    }
+}
+
+CScriptNumber CScriptNumber::mathsOp(const CScriptNumber &b, int op) const {
+    if (op == LEX_TYPEEQUAL || op == LEX_NTYPEEQUAL) {
+      bool eql = type==b.type && mathsOp(b, LEX_EQUAL).getBool();
+      return makeInt(op == LEX_TYPEEQUAL ? eql : !eql);
+    }
+    if (type==SCRIPTVAR_UNDEFINED && b.type==SCRIPTVAR_UNDEFINED) {
+      if (op == LEX_EQUAL) return makeInt(1);
+      else if (op == LEX_NEQUAL) return makeInt(0);
+      else return CScriptNumber();
+    }
+    // undefined acts as 0, and we only use doubles if one side is a double
+    if (type!=SCRIPTVAR_DOUBLE && b.type!=SCRIPTVAR_DOUBLE)
+      return numberOpInts(getInt(), b.getInt(), op);
+    return numberOpDoubles(getDouble(), b.getDouble(), op);
+}
+
+CScriptNumber CScriptNumber::fromVar(CScriptVar *v) {
+    if (v->isUndefined()) return CScriptNumber();
+    if (v->isDouble()) return makeDouble(v->getDouble());
+    return makeInt(v->getInt()); // int or null
+}
+
+CScriptVar *CScriptNumber::toVar() const {
+    if (type==SCRIPTVAR_INTEGER) return CScriptVar::constInt(intData);
+    if (type==SCRIPTVAR_DOUBLE) return new CScriptVar(doubleData);
+    return CScriptVar::constUndefined();
+}
+
+static CScriptVar *mathsOpNumbers(CScriptVar *a, CScriptVar *b, int op) {
+    return CScriptNumber::fromVar(a).mathsOp(CScriptNumber::fromVar(b), op).toVar();
+}
+
+static CScriptVar *mathsOpArray(CScriptVar *a, CScriptVar *b, int op) {
+    /* Just check pointers */
+    switch (op) {
+        case LEX_EQUAL: return CScriptVar::constBool(a==b);
+        case LEX_NEQUAL: return CScriptVar::constBool(a!=b);
+        default: throw new CScriptException("Operation "+CScriptLex::getTokenStr(op)+" not supported on the Array datatype");
+    }
+}
+
+static CScriptVar *mathsOpObject(CScriptVar *a, CScriptVar *b, int op) {
+    /* Just check pointers */
+    switch (op) {
+        case LEX_EQUAL: return CScriptVar::constBool(a==b);
+        case LEX_NEQUAL: return CScriptVar::constBool(a!=b);
+        default: throw new CScriptException("Operation "+CScriptLex::getTokenStr(op)+" not supported on the Object datatype");
+    }
+}
+
+static CScriptVar *mathsOpString(CScriptVar *a, CScriptVar *b, int op) {
+    /* getString returns a reference to each var's own data (or a static
+     * string), so there's no need to copy either side to compare them */
+    const string &da = a->getString();
+    const string &db = b->getString();
+    switch (op) {
+        case '+':           return new CScriptVar(da+db, SCRIPTVAR_STRING);
+        case LEX_EQUAL:     return CScriptVar::constBool(da==db);
+        case LEX_NEQUAL:    return CScriptVar::constBool(da!=db);
+        case '<':     return CScriptVar::constBool(da<db);
+        case LEX_LEQUAL:    return CScriptVar::constBool(da<=db);
+        case '>':     return CScriptVar::constBool(da>db);
+        case LEX_GEQUAL:    return CScriptVar::constBool(da>=db);
+        default: throw new CScriptException("Operation "+CScriptLex::getTokenStr(op)+" not supported on the string datatype");
+    }
+}
+
+typedef CScriptVar *(*MathsOpKernel)(CScriptVar *a, CScriptVar *b, int op);
+
+/// The kernel to use for each pair of kinds, indexed by [kind of a][kind of b]
+static const MathsOpKernel MATHSOP_KERNELS[MATHSOP_KINDS][MATHSOP_KINDS] = {
+    /*               UNDEFINED                  INT                 DOUBLE               STRING         ARRAY          OBJECT         OTHER */
+    /* UNDEFINED */ { mathsOpNumbers,            mathsOpNumbers,     mathsOpNumbers,      mathsOpString, mathsOpString, mathsOpString, mathsOpString },
+    /* INT       */ { mathsOpNumbers,            mathsOpNumbers,     mathsOpNumbers,      mathsOpString, mathsOpString, mathsOpString, mathsOpString },
+    /* DOUBLE    */ { mathsOpNumbers,            mathsOpNumbers,     mathsOpNumbers,      mathsOpString, mathsOpString, mathsOpString, mathsOpString },
+    /* STRING    */ { mathsOpString,             mathsOpString,      mathsOpString,       mathsOpString, mathsOpString, mathsOpString, mathsOpString },
+    /* ARRAY     */ { mathsOpArray,              mathsOpArray,       mathsOpArray,        mathsOpArray,  mathsOpArray,  mathsOpArray,  mathsOpArray },
+    /* OBJECT    */ { mathsOpObject,             mathsOpObject,      mathsOpObject,       mathsOpObject, mathsOpObject, mathsOpObject, mathsOpObject },
+    /* OTHER     */ { mathsOpString,             mathsOpString,      mathsOpString,       mathsOpString, mathsOpString, mathsOpString, mathsOpString },
+};
+
 CScriptVar *CScriptVar::mathsOp(CScriptVar *b, int op) {
     CScriptVar *a = this;
     // Type equality check
@@ -1033,93 +1712,46 @@ CScriptVar *CScriptVar::mathsOp(CScriptVar *b, int op) {
         if (!contents->getBool()) eql = false;
         if (!contents->refs) delete contents;
       }
-                 ;
       if (op == LEX_TYPEEQUAL)
-        return new CScriptVar(eql);
+        return constBool(eql);
       else
-        return new CScriptVar(!eql);
+        return constBool(!eql);
     }
     // do maths...
-    if (a->isUndefined() && b->isUndefined()) {
-      if (op == LEX_EQUAL) return new CScriptVar(true);
-      else if (op == LEX_NEQUAL) return new CScriptVar(false);
-      else return new CScriptVar(); // undefined
-    } else if ((a->isNumeric() || a->isUndefined()) &&
-               (b->isNumeric() || b->isUndefined())) {
-        if (!a->isDouble() && !b->isDouble()) {
-            // use ints
-            int da = a->getInt();
-            int db = b->getInt();
-            switch (op) {
-                case '+': return new CScriptVar(da+db);
-                case '-': return new CScriptVar(da-db);
-                case '*': return new CScriptVar(da*db);
-                case '/': return new CScriptVar(da/db);
-                case '&': return new CScriptVar(da&db);
-                case '|': return new CScriptVar(da|db);
-                case '^': return new CScriptVar(da^db);
-                case '%': return new CScriptVar(da%db);
-                case LEX_EQUAL:     return new CScriptVar(da==db);
-                case LEX_NEQUAL:    return new CScriptVar(da!=db);
-                case '<':     return new CScriptVar(da<db);
-                case LEX_LEQUAL:    return new CScriptVar(da<=db);
-                case '>':     return new CScriptVar(da>db);
-                case LEX_GEQUAL:    return new CScriptVar(da>=db);
-                default: throw new CScriptException("Operation "+CScriptLex::getTokenStr(op)+" not supported on the Int datatype");
-            }
-        } else {
-            // use doubles
-            double da = a->getDouble();
-            double db = b->getDouble();
-            switch (op) {
-                case '+': return new CScriptVar(da+db);
-                case '-': return new CScriptVar(da-db);
-                case '*': return new CScriptVar(da*db);
-                case '/': return new CScriptVar(da/db);
-                case LEX_EQUAL:     return new CScriptVar(da==db);
-                case LEX_NEQUAL:    return new CScriptVar(da!=db);
-                case '<':     return new CScriptVar(da<db);
-                case LEX_LEQUAL:    return new CScriptVar(da<=db);
-                case '>':     return new CScriptVar(da>db);
-                case LEX_GEQUAL:    return new CScriptVar(da>=db);
-                default: throw new CScriptException("Operation "+CScriptLex::getTokenStr(op)+" not supported on the Double datatype");
-            }
-        }
-    } else if (a->isArray()) {
-      /* Just check pointers */
-      switch (op) {
-           case LEX_EQUAL: return new CScriptVar(a==b);
-           case LEX_NEQUAL: return new CScriptVar(a!=b);
-           default: throw new CScriptException("Operation "+CScriptLex::getTokenStr(op)+" not supported on the Array datatype");
-      }
-    } else if (a->isObject()) {
-          /* Just check pointers */
-          switch (op) {
-               case LEX_EQUAL: return new CScriptVar(a==b);
-               case LEX_NEQUAL: return new CScriptVar(a!=b);
-               default: throw new CScriptException("Operation "+CScriptLex::getTokenStr(op)+" not supported on the Object datatype");
-          }
-    } else {
-       string da = a->getString();
-       string db = b->getString();
-       // use strings
-       switch (op) {
-           case '+':           return new CScriptVar(da+db, SCRIPTVAR_STRING);
-           case LEX_EQUAL:     return new CScriptVar(da==db);
-           case LEX_NEQUAL:    return new CScriptVar(da!=db);
-           case '<':     return new CScriptVar(da<db);
-           case LEX_LEQUAL:    return new CScriptVar(da<=db);
-           case '>':     return new CScriptVar(da>db);
-           case LEX_GEQUAL:    return new CScriptVar(da>=db);
-           default: throw new CScriptException("Operation "+CScriptLex::getTokenStr(op)+" not supported on the string datatype");
-       }
+    return MATHSOP_KERNELS[getMathsOpKind(a)][getMathsOpKind(b)](a, b, op);
+}
+
+bool CScriptVar::mathsOpInPlace(CScriptVar *b, int op) {
+    // if anything else references us, it would see the change
+    if (refs!=1 || isConstant() || !isBasic() || (op!='+' && op!='-')) return false;
+    int ka = getMathsOpKind(this);
+    int kb = getMathsOpKind(b);
+    if (ka==MATHSOP_STRING) {
+      if (op!='+') return false;
+      changing();
+      // std::string grows its capacity geometrically, so repeated appends are linear
+      data.append(b->getString());
+      chargeData();
+      return true;
     }
-    ASSERT(0);
-    return 0;
+    if ((ka==MATHSOP_INT || ka==MATHSOP_DOUBLE) &&
+        (kb==MATHSOP_INT || kb==MATHSOP_UNDEFINED || kb==MATHSOP_DOUBLE)) {
+      CScriptNumber result = CScriptNumber::fromVar(this).mathsOp(CScriptNumber::fromVar(b), op);
+      if (result.type==SCRIPTVAR_INTEGER) setInt(result.intData);
+      else setDouble(result.doubleData);
+      return true;
+    }
+    return false;
 }
 
 void CScriptVar::copySimpleData(CScriptVar *val) {
-    data = val->data;
+    changing();
+    // functions just share the source, rather than copying their body
+    setFunctionSource(val->sourceData, val->sourceStart, val->sourceEnd);
+    if (!val->sourceData) {
+      data = val->data;
+      chargeData();
+    }
     intData = val->intData;
     doubleData = val->doubleData;
     userCustomData = val->userCustomData;
@@ -1169,6 +1801,37 @@ CScriptVar *CScriptVar::deepCopy() {
     return newVar;
 }
 
+CScriptVar *CScriptVar::clone(CScriptCloner &cloner) {
+    if (isConstant()) return this;
+    // we're added to cloner.vars before our children, so loops just reference the copy
+    CScriptVar *&copy = cloner.vars[this];
+    if (copy) return copy;
+    copy = new CScriptVar();
+    if (sourceData) {
+      CScriptSource *&source = cloner.sources[sourceData];
+      if (!source) source = new CScriptSource(string(sourceData->getData(), sourceData->getLength()));
+      copy->setFunctionSource(source, sourceStart, sourceEnd);
+    } else
+      copy->data = data;
+    copy->chargeData();
+    copy->intData = intData;
+    copy->doubleData = doubleData;
+    copy->userCustomData = userCustomData;
+    copy->jsCallback = jsCallback;
+    copy->jsCallbackUserData = jsCallbackUserData==cloner.oldUserData ? cloner.newUserData : jsCallbackUserData;
+    copy->jsIntrinsic = jsIntrinsic;
+    copy->intrinsicArgs = intrinsicArgs;
+    // no need to invalidate method caches while a class is being built, so only say it's a class after
+    copy->flags = flags & ~SCRIPTVAR_CLASS;
+    CScriptVarLink *child = firstChild;
+    while (child) {
+      copy->addChild(child->name, child->var->clone(cloner));
+      child = child->nextSibling;
+    }
+    copy->flags = flags & ~SCRIPTVAR_BASELINE;
+    return copy;
+}
+
 void CScriptVar::trace(string indentStr, const string &name) {
     TRACE("%s'%s' = '%s' %s\n",
         indentStr.c_str(),
@@ -1258,16 +1921,47 @@ void CScriptVar::getJSON(ostringstream &destination, const string linePrefix) {
 
 
 void CScriptVar::setCallback(JSCallback callback, void *userdata) {
+    changing();
     jsCallback = callback;
     jsCallbackUserData = userdata;
 }
 
+void CScriptVar::setIntrinsic(JSIntrinsic intrinsic, int argCount) {
+    changing();
+    jsIntrinsic = intrinsic;
+    intrinsicArgs = argCount;
+}
+
+void CScriptVar::setFunctionSource(CScriptSource *source, int start, int end) {
+    changing();
+    if (source) source->ref();
+    if (sourceData) sourceData->unref();
+    if (compiled) {
+      // the code has changed
+      delete compiled;
+      compiled = 0;
+    }
+    callCount = 0;
+    sourceData = source;
+    sourceStart = start;
+    sourceEnd = end;
+    if (source) data = TINYJS_BLANK_DATA;
+}
+
+CScriptLex *CScriptVar::getFunctionLex() {
+    if (sourceData)
+      return new CScriptLex(sourceData, sourceStart, sourceEnd);
+    return new CScriptLex(getString());
+}
+
 CScriptVar *CScriptVar::ref() {
-    refs++;
+    // constants are shared (maybe between threads) so their count is never touched
+    if (!isConstant()) refs++;
     return this;
 }
 
 void CScriptVar::unref() {
+    if (isConstant()) return;
     if (refs<=0) printf("OMFG, we have unreffed too far!\n");
     if ((--refs)==0) {
       delete this;
@@ -1279,6 +1973,7 @@ int CScriptVar::getRefs() {
 }
 
 void CScriptVar::setUserCustomData(void *p) {
+  changing();
   userCustomData = p;
 }
 
@@ -1287,78 +1982,795 @@ void *CScriptVar::getUserCustomData() {
 }
 
 
-// ----------------------------------------------------------------------------------- CSCRIPT
-
-CTinyJS::CTinyJS() {
+// ----------------------------------------------------------------------------------- CSCRIPTCOMPILEDFUNCTION
+
+/* Each node of the tree does what the matching part of CTinyJS::statement..factor
+ * would do, so running the tree gives exactly the same results as interpreting. */
+enum COMPILED_NODE {
+    // expressions
+    CN_NUMBER,
+    CN_LOCAL,
+    CN_OP,       ///< a op b, using CScriptNumber::mathsOp
+    CN_NOT,
+    CN_NEGATE,
+    CN_ANDAND,
+    CN_OROR,
+    CN_TERNARY,
+    CN_ASSIGN,   ///< local = a
+    CN_OPASSIGN, ///< local op= a
+    CN_POSTFIX,  ///< local++ or local--
+    // statements
+    CN_EXPRESSION,
+    CN_BLOCK,
+    CN_IF,
+    CN_WHILE,
+    CN_FOR,
+    CN_RETURN,
+};
+
+struct CScriptCompiledNode {
+    int kind; ///< COMPILED_NODE
+    int op;
+    int slot; ///< index of the local variable
+    CScriptNumber value;
+    CScriptCompiledNode *a, *b, *c, *d;
+    std::vector<CScriptCompiledNode*> statements;
+};
+
+/// Thrown while compiling when we find something that we can't compile
+struct CScriptNotCompilable {};
+
+CScriptCompiledFunction::CScriptCompiledFunction(CScriptVar *function) {
+    body = 0;
+    parameterCount = 0;
+    CScriptVarLink *v = function->firstChild;
+    while (v) {
+      declared.push_back(addLocal(v->name));
+      parameterCount++;
+      v = v->nextSibling;
+    }
+    l = function->getFunctionLex();
+    try {
+      CScriptCompiledNode *b = compileStatement();
+      if (b->kind==CN_BLOCK && l->tk==LEX_EOF) body = b;
+    } catch (CScriptNotCompilable) {
+    } catch (CScriptException *e) {
+      // the interpreter will report this when it is run
+      delete e;
+    }
+    delete l;
     l = 0;
-    root = (new CScriptVar(TINYJS_BLANK_DATA, SCRIPTVAR_OBJECT))->ref();
-    // Add built-in classes
-    stringClass = (new CScriptVar(TINYJS_BLANK_DATA, SCRIPTVAR_OBJECT))->ref();
-    arrayClass = (new CScriptVar(TINYJS_BLANK_DATA, SCRIPTVAR_OBJECT))->ref();
-    objectClass = (new CScriptVar(TINYJS_BLANK_DATA, SCRIPTVAR_OBJECT))->ref();
-    root->addChild("String", stringClass);
-    root->addChild("Array", arrayClass);
-    root->addChild("Object", objectClass);
+    declared.clear();
 }
 
-CTinyJS::~CTinyJS() {
-    ASSERT(!l);
-    scopes.clear();
-    stringClass->unref();
-    arrayClass->unref();
-    objectClass->unref();
-    root->unref();
+CScriptCompiledFunction::~CScriptCompiledFunction() {
+    for (size_t i=0;i<nodes.size();i++)
+      delete nodes[i];
+}
 
-#if DEBUG_MEMORY
-    show_allocated();
-#endif
+CScriptVar *CScriptCompiledFunction::call(CScriptVar **args, CScriptLimits *limits) {
+    this->limits = limits;
+    locals.assign(localNames.size(), CScriptNumber());
+    for (int i=0;i<parameterCount;i++)
+      locals[i] = CScriptNumber::fromVar(args[i]);
+    result = CScriptNumber();
+    exec(body);
+    return result.toVar();
 }
 
-void CTinyJS::trace() {
-    root->trace();
+bool CScriptCompiledFunction::canCallWith(CScriptVar *arg) {
+    return arg->isUndefined() || arg->isInt() || arg->isDouble();
 }
 
-void CTinyJS::execute(const string &code) {
-    CScriptLex *oldLex = l;
-    vector<CScriptVar*> oldScopes = scopes;
-    l = new CScriptLex(code);
-#ifdef TINYJS_CALL_STACK
-    call_stack.clear();
-#endif
-    scopes.clear();
-    scopes.push_back(root);
-    try {
-        bool execute = true;
-        while (l->tk) statement(execute);
-    } catch (CScriptException *e) {
-        ostringstream msg;
-        msg << "Error " << e->text;
-#ifdef TINYJS_CALL_STACK
-        for (int i=(int)call_stack.size()-1;i>=0;i--)
-          msg << "\n" << i << ": " << call_stack.at(i);
-#endif
-        msg << " at " << l->getPosition();
-        delete l;
-        l = oldLex;
+int CScriptCompiledFunction::addLocal(const std::string &name) {
+    for (size_t i=0;i<localNames.size();i++)
+      if (localNames[i]==name) return (int)i;
+    localNames.push_back(name);
+    return (int)localNames.size()-1;
+}
+
+int CScriptCompiledFunction::findDeclaredLocal(const std::string &name) {
+    for (size_t i=0;i<declared.size();i++)
+      if (localNames[declared[i]]==name) return declared[i];
+    // the interpreter would look in the caller's scopes or root for this
+    throw CScriptNotCompilable();
+}
+
+CScriptCompiledNode *CScriptCompiledFunction::newNode(int kind, CScriptCompiledNode *a, CScriptCompiledNode *b) {
+    CScriptCompiledNode *n = new CScriptCompiledNode();
+    nodes.push_back(n);
+    n->kind = kind;
+    n->op = 0;
+    n->slot = 0;
+    n->a = a;
+    n->b = b;
+    n->c = 0;
+    n->d = 0;
+    return n;
+}
+
+CScriptCompiledNode *CScriptCompiledFunction::compileConditional() {
+    // 'var's in here might not be run, so they can't be used after it
+    size_t declaredCount = declared.size();
+    CScriptCompiledNode *n = compileStatement();
+    declared.resize(declaredCount);
+    return n;
+}
+
+CScriptCompiledNode *CScriptCompiledFunction::compileStatement() {
+    if (l->tk==LEX_ID || l->tk==LEX_INT || l->tk==LEX_FLOAT || l->tk=='-') {
+      CScriptCompiledNode *n = newNode(CN_EXPRESSION, compileBase());
+      l->match(';');
+      return n;
+    } else if (l->tk=='{') {
+      CScriptCompiledNode *n = newNode(CN_BLOCK);
+      l->match('{');
+      while (l->tk && l->tk!='}')
+        n->statements.push_back(compileStatement());
+      l->match('}');
+      return n;
+    } else if (l->tk==';') {
+      l->match(';');
+      return newNode(CN_BLOCK);
+    } else if (l->tk==LEX_R_VAR) {
+      CScriptCompiledNode *n = newNode(CN_BLOCK);
+      l->match(LEX_R_VAR);
+      while (l->tk != ';') {
+        int slot = addLocal(l->tkStr);
+        // the variable exists before its initialiser is run
+        declared.push_back(slot);
+        l->match(LEX_ID);
+        if (l->tk == '=') {
+          l->match('=');
+          CScriptCompiledNode *assign = newNode(CN_ASSIGN, compileBase());
+          assign->slot = slot;
+          n->statements.push_back(newNode(CN_EXPRESSION, assign));
+        }
+        if (l->tk != ';')
+          l->match(',');
+      }
+      l->match(';');
+      return n;
+    } else if (l->tk==LEX_R_IF) {
+      l->match(LEX_R_IF);
+      l->match('(');
+      CScriptCompiledNode *n = newNode(CN_IF, compileBase());
+      l->match(')');
+      n->b = compileConditional();
+      if (l->tk==LEX_R_ELSE) {
+        l->match(LEX_R_ELSE);
+        n->c = compileConditional();
+      }
+      return n;
+    } else if (l->tk==LEX_R_WHILE) {
+      l->match(LEX_R_WHILE);
+      l->match('(');
+      CScriptCompiledNode *n = newNode(CN_WHILE, compileBase());
+      l->match(')');
+      n->b = compileConditional();
+      return n;
+    } else if (l->tk==LEX_R_FOR) {
+      l->match(LEX_R_FOR);
+      l->match('(');
+      CScriptCompiledNode *n = newNode(CN_FOR, compileStatement());
+      n->b = compileBase();
+      l->match(';');
+      n->c = compileBase();
+      l->match(')');
+      n->d = compileConditional();
+      return n;
+    } else if (l->tk==LEX_R_RETURN) {
+      l->match(LEX_R_RETURN);
+      CScriptCompiledNode *n = newNode(CN_RETURN);
+      if (l->tk != ';')
+        n->a = compileBase();
+      l->match(';');
+      return n;
+    }
+    throw CScriptNotCompilable();
+}
+
+CScriptCompiledNode *CScriptCompiledFunction::compileFactor() {
+    if (l->tk=='(') {
+      l->match('(');
+      CScriptCompiledNode *n = compileBase();
+      l->match(')');
+      return n;
+    }
+    CScriptCompiledNode *n = newNode(CN_NUMBER);
+    if (l->tk==LEX_R_TRUE || l->tk==LEX_R_FALSE) {
+      n->value = CScriptNumber::makeInt(l->tk==LEX_R_TRUE);
+    } else if (l->tk==LEX_R_UNDEFINED) {
+      n->value = CScriptNumber();
+    } else if (l->tk==LEX_INT) {
+      long val = strtol(l->tkStr.c_str(),0,0);
+      if (val<INT_MIN || val>INT_MAX) throw CScriptNotCompilable();
+      n->value = CScriptNumber::makeInt((int)val);
+    } else if (l->tk==LEX_FLOAT) {
+      n->value = CScriptNumber::makeDouble(strtod(l->tkStr.c_str(),0));
+    } else if (l->tk==LEX_ID) {
+      n->kind = CN_LOCAL;
+      n->slot = findDeclaredLocal(l->tkStr);
+    } else
+      throw CScriptNotCompilable();
+    l->match(l->tk);
+    // function calls, members and array accesses
+    if (l->tk=='(' || l->tk=='.' || l->tk=='[') throw CScriptNotCompilable();
+    return n;
+}
+
+CScriptCompiledNode *CScriptCompiledFunction::compileUnary() {
+    if (l->tk=='!') {
+      l->match('!');
+      return newNode(CN_NOT, compileFactor());
+    }
+    return compileFactor();
+}
+
+CScriptCompiledNode *CScriptCompiledFunction::compileTerm() {
+    CScriptCompiledNode *a = compileUnary();
+    while (l->tk=='*' || l->tk=='/' || l->tk=='%') {
+      int op = l->tk;
+      l->match(l->tk);
+      a = newNode(CN_OP, a, compileUnary());
+      a->op = op;
+    }
+    return a;
+}
+
+CScriptCompiledNode *CScriptCompiledFunction::compileExpression() {
+    bool negate = false;
+    if (l->tk=='-') {
+      l->match('-');
+      negate = true;
+    }
+    CScriptCompiledNode *a = compileTerm();
+    if (negate) a = newNode(CN_NEGATE, a);
+    while (l->tk=='+' || l->tk=='-' ||
+           l->tk==LEX_PLUSPLUS || l->tk==LEX_MINUSMINUS) {
+      int op = l->tk;
+      l->match(l->tk);
+      if (op==LEX_PLUSPLUS || op==LEX_MINUSMINUS) {
+        // the interpreter would modify a temporary value
+        if (a->kind!=CN_LOCAL) throw CScriptNotCompilable();
+        int slot = a->slot;
+        a = newNode(CN_POSTFIX);
+        a->slot = slot;
+        a->op = op==LEX_PLUSPLUS ? '+' : '-';
+      } else {
+        a = newNode(CN_OP, a, compileTerm());
+        a->op = op;
+      }
+    }
+    return a;
+}
+
+CScriptCompiledNode *CScriptCompiledFunction::compileCondition() {
+    CScriptCompiledNode *a = compileExpression();
+    // shifts take everything after them as their right hand side, so leave them to the interpreter
+    if (l->tk==LEX_LSHIFT || l->tk==LEX_RSHIFT || l->tk==LEX_RSHIFTUNSIGNED) throw CScriptNotCompilable();
+    while (l->tk==LEX_EQUAL || l->tk==LEX_NEQUAL ||
+           l->tk==LEX_TYPEEQUAL || l->tk==LEX_NTYPEEQUAL ||
+           l->tk==LEX_LEQUAL || l->tk==LEX_GEQUAL ||
+           l->tk=='<' || l->tk=='>') {
+      int op = l->tk;
+      l->match(l->tk);
+      a = newNode(CN_OP, a, compileExpression());
+      a->op = op;
+      if (l->tk==LEX_LSHIFT || l->tk==LEX_RSHIFT || l->tk==LEX_RSHIFTUNSIGNED) throw CScriptNotCompilable();
+    }
+    return a;
+}
+
+CScriptCompiledNode *CScriptCompiledFunction::compileLogic() {
+    CScriptCompiledNode *a = compileCondition();
+    while (l->tk=='&' || l->tk=='|' || l->tk=='^' || l->tk==LEX_ANDAND || l->tk==LEX_OROR) {
+      int op = l->tk;
+      l->match(l->tk);
+      if (op==LEX_ANDAND) a = newNode(CN_ANDAND, a, compileCondition());
+      else if (op==LEX_OROR) a = newNode(CN_OROR, a, compileCondition());
+      else {
+        a = newNode(CN_OP, a, compileCondition());
+        a->op = op;
+      }
+    }
+    return a;
+}
+
+CScriptCompiledNode *CScriptCompiledFunction::compileTernary() {
+    CScriptCompiledNode *a = compileLogic();
+    if (l->tk=='?') {
+      l->match('?');
+      a = newNode(CN_TERNARY, a, compileBase());
+      l->match(':');
+      a->c = compileBase();
+    }
+    return a;
+}
+
+CScriptCompiledNode *CScriptCompiledFunction::compileBase() {
+    CScriptCompiledNode *lhs = compileTernary();
+    if (l->tk=='=' || l->tk==LEX_PLUSEQUAL || l->tk==LEX_MINUSEQUAL) {
+      if (lhs->kind!=CN_LOCAL) throw CScriptNotCompilable();
+      int op = l->tk;
+      l->match(l->tk);
+      int slot = lhs->slot;
+      lhs = newNode(op=='=' ? CN_ASSIGN : CN_OPASSIGN, compileBase());
+      lhs->slot = slot;
+      lhs->op = op==LEX_MINUSEQUAL ? '-' : '+';
+    }
+    return lhs;
+}
+
+CScriptNumber CScriptCompiledFunction::eval(CScriptCompiledNode *n) {
+    switch (n->kind) {
+      case CN_NUMBER: return n->value;
+      case CN_LOCAL: return locals[n->slot];
+      case CN_OP: {
+        CScriptNumber a = eval(n->a);
+        return a.mathsOp(eval(n->b), n->op);
+      }
+      case CN_NOT: return eval(n->a).mathsOp(CScriptNumber::makeInt(0), LEX_EQUAL);
+      case CN_NEGATE: return CScriptNumber::makeInt(0).mathsOp(eval(n->a), '-');
+      case CN_ANDAND: {
+        CScriptNumber a = eval(n->a);
+        if (!a.getBool()) return a;
+        return CScriptNumber::makeInt(eval(n->b).getBool());
+      }
+      case CN_OROR: {
+        CScriptNumber a = eval(n->a);
+        if (a.getBool()) return a;
+        return CScriptNumber::makeInt(eval(n->b).getBool());
+      }
+      case CN_TERNARY: return eval(n->a).getBool() ? eval(n->b) : eval(n->c);
+      case CN_ASSIGN: {
+        CScriptNumber a = eval(n->a);
+        locals[n->slot] = a;
+        return a;
+      }
+      case CN_OPASSIGN: {
+        CScriptNumber a = eval(n->a);
+        locals[n->slot] = locals[n->slot].mathsOp(a, n->op);
+        return locals[n->slot];
+      }
+      case CN_POSTFIX: {
+        CScriptNumber oldValue = locals[n->slot];
+        locals[n->slot] = oldValue.mathsOp(CScriptNumber::makeInt(1), n->op);
+        return oldValue;
+      }
+    }
+    ASSERT(0);
+    return CScriptNumber();
+}
+
+bool CScriptCompiledFunction::exec(CScriptCompiledNode *n) {
+    switch (n->kind) {
+      case CN_EXPRESSION:
+        eval(n->a);
+        return false;
+      case CN_BLOCK:
+        for (size_t i=0;i<n->statements.size();i++)
+          if (exec(n->statements[i])) return true;
+        return false;
+      case CN_IF:
+        if (eval(n->a).getBool()) return exec(n->b);
+        if (n->c) return exec(n->c);
+        return false;
+      case CN_WHILE: {
+        // use fuel at the same points as CTinyJS::statement
+        bool returned = false;
+        bool loopCond = eval(n->a).getBool();
+        if (loopCond) returned = exec(n->b);
+        while (loopCond && !returned) {
+          limits->use();
+          loopCond = eval(n->a).getBool();
+          if (loopCond) returned = exec(n->b);
+        }
+        return returned;
+      }
+      case CN_FOR: {
+        bool returned = exec(n->a);
+        bool loopCond = !returned && eval(n->b).getBool();
+        if (loopCond) returned = exec(n->d);
+        if (loopCond && !returned) eval(n->c);
+        while (!returned && loopCond) {
+          limits->use();
+          loopCond = eval(n->b).getBool();
+          if (loopCond) returned = exec(n->d);
+          if (loopCond && !returned) eval(n->c);
+        }
+        return returned;
+      }
+      case CN_RETURN:
+        result = n->a ? eval(n->a) : CScriptNumber();
+        return true;
+    }
+    ASSERT(0);
+    return false;
+}
+
+
+// ----------------------------------------------------------------------------------- CSCRIPT
+
+void CTinyJS::init() {
+    l = 0;
+    optimiseCode = false;
+    compileThreshold = 0;
+    loopControl = LOOP_NONE;
+    memory = (new CScriptMemory())->ref();
+    memory->limits = &limits;
+    memory->engine = this;
+    limits.memory = memory;
+    methodCacheEpoch = memory->classEpoch;
+    for (int i=0;i<4;i++)
+      baselineRoots[i] = 0;
+}
+
+CTinyJS::CTinyJS() {
+    init();
+    // the built-in classes are charged to us too
+    CScriptMemory *oldMemory = CScriptMemory::current;
+    CScriptMemory::current = memory;
+    root = (new CScriptVar(TINYJS_BLANK_DATA, SCRIPTVAR_OBJECT))->ref();
+    // Add built-in classes
+    stringClass = (new CScriptVar(TINYJS_BLANK_DATA, SCRIPTVAR_OBJECT))->ref();
+    arrayClass = (new CScriptVar(TINYJS_BLANK_DATA, SCRIPTVAR_OBJECT))->ref();
+    objectClass = (new CScriptVar(TINYJS_BLANK_DATA, SCRIPTVAR_OBJECT))->ref();
+    stringClass->makeClass();
+    arrayClass->makeClass();
+    objectClass->makeClass();
+    root->addChild("String", stringClass);
+    root->addChild("Array", arrayClass);
+    root->addChild("Object", objectClass);
+    CScriptMemory::current = oldMemory;
+}
+
+CTinyJS::CTinyJS(const CTinyJS &engine) {
+    init();
+    optimiseCode = engine.optimiseCode;
+    compileThreshold = engine.compileThreshold;
+    limits.fuelLimit = engine.limits.fuelLimit;
+    limits.timeLimit = engine.limits.timeLimit;
+    memory->limit = engine.memory->limit;
+    CScriptMemory *oldMemory = CScriptMemory::current;
+    CScriptMemory::current = memory;
+    CScriptCloner cloner;
+    cloner.oldUserData = (void*)&engine;
+    cloner.newUserData = this;
+    root = engine.root->clone(cloner)->ref();
+    stringClass = engine.stringClass->clone(cloner)->ref();
+    arrayClass = engine.arrayClass->clone(cloner)->ref();
+    objectClass = engine.objectClass->clone(cloner)->ref();
+    // our copies of frozen vars are the copies of its copies
+    std::map<CScriptVar*, CScriptVar*> copies;
+    for (std::map<CScriptVar*, CScriptVar*>::const_iterator it = engine.frozenCopies.begin(); it!=engine.frozenCopies.end(); it++)
+      copies[it->first] = it->second->clone(cloner);
+    setFrozenCopies(frozenCopies, copies);
+    CScriptMemory::current = oldMemory;
+    nativeBindings = engine.nativeBindings;
+    for (map<string, NativeBinding>::iterator it = nativeBindings.begin(); it!=nativeBindings.end(); it++)
+      if (it->second.userdata==cloner.oldUserData)
+        it->second.userdata = cloner.newUserData;
+    lazyTables = engine.lazyTables;
+    lazyNames = engine.lazyNames;
+    frozenVars = engine.frozenVars;
+    for (size_t i=0;i<frozenVars.size();i++)
+      frozenVars[i]->ref();
+    for (size_t t=0;t<lazyTables.size();t++)
+      if (lazyTables[t].userdata==cloner.oldUserData)
+        lazyTables[t].userdata = cloner.newUserData;
+}
+
+CTinyJS::~CTinyJS() {
+    ASSERT(!l);
+    discardBaseline();
+    scopes.clear();
+    stringClass->unref();
+    arrayClass->unref();
+    objectClass->unref();
+    root->unref();
+    clearSwitchTables();
+    setFrozenCopies(frozenCopies, std::map<CScriptVar*, CScriptVar*>());
+    for (size_t i=0;i<frozenVars.size();i++)
+      frozenVars[i]->unref();
+    // anything the host still holds on to keeps memory alive, but mustn't use our limits or find us
+    memory->limits = 0;
+    memory->engine = 0;
+    memory->unref();
+
+#if DEBUG_MEMORY
+    show_allocated();
+#endif
+}
+
+void CTinyJS::trace() {
+    root->trace();
+}
+
+void CTinyJS::freezeBuiltins() {
+    discardBaseline(); // what is frozen can't be put back
+    createAllNatives(); // once they're shared, they can't be added to
+    // any we have are frozen along with everything else, and then shared like the originals were
+    setFrozenCopies(frozenCopies, std::map<CScriptVar*, CScriptVar*>());
+    CScriptFrozenVars *frozen = new CScriptFrozenVars();
+    CScriptVar *classes[] = { stringClass, arrayClass, objectClass };
+    for (int i=0;i<3;i++) {
+      std::set<CScriptVar*> visited;
+      if (canFreeze(classes[i], visited)) classes[i]->freeze(frozen->vars);
+    }
+    for (CScriptVarLink *child = root->firstChild; child; child = child->nextSibling) {
+      std::set<CScriptVar*> visited;
+      if (child->var->isObject() && canFreeze(child->var, visited)) child->var->freeze(frozen->vars);
+    }
+    if (frozen->vars.empty()) {
+      frozen->ref()->unref();
+      return;
+    }
+    frozenVars.push_back(frozen->ref());
+    methodCache.clear();
+}
+
+bool CTinyJS::canFreeze(CScriptVar *var, std::set<CScriptVar*> &visited) {
+    if (var->isConstant() || !visited.insert(var).second) return true;
+    // calls to functions written in JavaScript are counted, and reference the source, so they can't be shared
+    if (var->sourceData) return false;
+    // each copy of us has its own version of these
+    if (var->jsCallback && var->jsCallbackUserData==this) return false;
+    for (CScriptVarLink *child = var->firstChild; child; child = child->nextSibling)
+      if (!canFreeze(child->var, visited)) return false;
+    return true;
+}
 
-        throw new CScriptException(msg.str());
+void CTinyJS::setFrozenCopies(std::map<CScriptVar*, CScriptVar*> &copies, const std::map<CScriptVar*, CScriptVar*> &newCopies) {
+    std::map<CScriptVar*, CScriptVar*>::const_iterator it;
+    for (it = newCopies.begin(); it!=newCopies.end(); it++)
+      it->second->ref();
+    for (it = copies.begin(); it!=copies.end(); it++)
+      it->second->unref();
+    copies = newCopies;
+}
+
+CScriptVar *CTinyJS::getFrozenCopy(CScriptVar *var) {
+    std::map<CScriptVar*, CScriptVar*>::iterator it = frozenCopies.find(var);
+    if (it != frozenCopies.end()) return it->second;
+    CScriptMemory *oldMemory = CScriptMemory::current;
+    CScriptMemory::current = memory;
+    CScriptVar *copy = var->writableCopy()->ref();
+    frozenCopies[var] = copy;
+    // it links to what var did, so copy those too (anything that links back finds the copy we've just added)
+    for (CScriptVarLink *child = copy->firstChild; child; child = child->nextSibling)
+      if (child->var->isFrozen()) child->replaceWith(getFrozenCopy(child->var));
+    CScriptMemory::current = oldMemory;
+    return copy;
+}
+
+void CTinyJS::unfreeze() {
+    // if one of our classes is frozen, we use the copy from now on
+    CScriptVar **classes[] = { &stringClass, &arrayClass, &objectClass };
+    for (int i=0;i<3;i++)
+      if ((*classes[i])->isFrozen()) {
+        CScriptVar *oldVar = *classes[i];
+        *classes[i] = getFrozenCopy(oldVar)->ref();
+        oldVar->unref();
+      }
+    // then everything else we can reach, so that it's the same whichever way the change is seen
+    std::set<CScriptVar*> visited;
+    std::vector<CScriptVar*> toVisit(scopes);
+    toVisit.push_back(root);
+    for (int i=0;i<3;i++)
+      toVisit.push_back(*classes[i]);
+    while (!toVisit.empty()) {
+      CScriptVar *var = toVisit.back();
+      toVisit.pop_back();
+      if (var->isConstant() || !visited.insert(var).second) continue;
+      for (CScriptVarLink *child = var->firstChild; child; child = child->nextSibling) {
+        if (child->var->isFrozen())
+          child->replaceWith(getFrozenCopy(child->var));
+        else
+          toVisit.push_back(child->var);
+      }
+    }
+    // cached methods could be in what was copied
+    methodCache.clear();
+}
+
+void CTinyJS::makeWritable(CScriptVarLink *link) {
+    if (!link->var->isFrozen()) {
+      link->makeWritable();
+      return;
+    }
+    if (frozenCopies.empty()) unfreeze();
+    // unfreezing may have done it already, if we can reach link
+    if (link->var->isFrozen()) link->replaceWith(getFrozenCopy(link->var));
+}
+
+void CTinyJS::markBaseline() {
+    ASSERT(!l);
+    discardBaseline();
+    memory->baseline = new CScriptBaseline();
+    std::set<CScriptVar*> visited;
+    CScriptVar *roots[] = { root, stringClass, arrayClass, objectClass };
+    for (int i=0;i<4;i++) {
+      baselineRoots[i] = roots[i]->ref();
+      addToBaseline(roots[i], visited);
+    }
+    baselineTables = lazyTables;
+    baselineNames = lazyNames;
+    setFrozenCopies(baselineCopies, frozenCopies);
+}
+
+void CTinyJS::resetToBaseline() {
+    ASSERT(!l);
+    if (!memory->baseline) throw new CScriptException("markBaseline hasn't been called");
+    // the links that are put back are charged to us, so that changes to them are saved too
+    CScriptMemory *oldMemory = CScriptMemory::current;
+    CScriptMemory::current = memory;
+    memory->baseline->restore();
+    CScriptMemory::current = oldMemory;
+    // we may have switched to copies of shared classes (see makeWritable)
+    CScriptVar **roots[] = { &root, &stringClass, &arrayClass, &objectClass };
+    for (int i=0;i<4;i++)
+      if (*roots[i] != baselineRoots[i]) {
+        (*roots[i])->unref();
+        *roots[i] = baselineRoots[i]->ref();
+      }
+    // copies of frozen vars made since aren't referenced any more
+    setFrozenCopies(frozenCopies, baselineCopies);
+    // anything created from lazyTables since has gone again
+    if (lazyNames != baselineNames) {
+      lazyNames = baselineNames;
+      lazyTables = baselineTables;
+    }
+    methodCache.clear();
+    // the code they were for has probably gone too
+    clearSwitchTables();
+    scopes.clear();
+    loopControl = LOOP_NONE;
+}
+
+void CTinyJS::addToBaseline(CScriptVar *var, std::set<CScriptVar*> &visited) {
+    // constants never change, so there's nothing to save
+    if (var->isConstant() || !visited.insert(var).second) return;
+    var->flags |= SCRIPTVAR_BASELINE;
+    // changes are saved in memory->baseline, so everything in the baseline must be charged to us
+    if (var->memory != memory) {
+      CScriptMemory::release(var->memory, sizeof(CScriptVar)+var->chargedData);
+      var->memory = memory->ref();
+      memory->allocate(sizeof(CScriptVar)+var->chargedData);
+    }
+    for (CScriptVarLink *child = var->firstChild; child; child = child->nextSibling) {
+      child->baseline = true;
+      if (child->memory != memory) {
+        CScriptMemory::release(child->memory, sizeof(CScriptVarLink)+child->name.capacity());
+        child->memory = memory->ref();
+        memory->allocate(sizeof(CScriptVarLink)+child->name.capacity());
+      }
+      addToBaseline(child->var, visited);
+    }
+}
+
+void CTinyJS::discardBaseline() {
+    CScriptBaseline *baseline = memory->baseline;
+    if (!baseline) return;
+    // nothing must be saved in it while what it saved is freed
+    memory->baseline = 0;
+    delete baseline;
+    for (int i=0;i<4;i++) {
+      baselineRoots[i]->unref();
+      baselineRoots[i] = 0;
+    }
+    baselineTables.clear();
+    baselineNames.clear();
+    setFrozenCopies(baselineCopies, std::map<CScriptVar*, CScriptVar*>());
+}
+
+CScriptVarLink *CTinyJS::findFrozenChild(CScriptVar *object, const string &name) {
+    bool write = l->tk=='=' || l->tk==LEX_PLUSEQUAL || l->tk==LEX_MINUSEQUAL || l->tk==LEX_PLUSPLUS || l->tk==LEX_MINUSMINUS;
+    if (!frozenCopies.empty()) object = getFrozenCopy(object);
+    if (!write) {
+      CScriptVarLink *child = object->findChild(name);
+      if (!child) child = findInParentClasses(object, name);
+      if (child) return child;
+      if (object->isArray() && name == "length")
+        return new CScriptVarLink(CScriptVar::constInt(object->getArrayLength()));
+      if (object->isString() && name == "length")
+        return new CScriptVarLink(CScriptVar::constInt(object->getString().size()));
+    }
+    // the first change to anything shared - from now on we use our own copies
+    if (object->isFrozen()) {
+      unfreeze();
+      object = getFrozenCopy(object);
+    }
+    return object->findChildOrCreate(name);
+}
+
+void CTinyJS::execute(const string &code) {
+    // the code is charged to us, just like what it creates
+    CScriptMemory *oldMemory = CScriptMemory::current;
+    CScriptMemory::current = memory;
+    CScriptSource *source = new CScriptSource(optimiseCode ? optimise(code) : code);
+    CScriptMemory::current = oldMemory;
+    executeSource(source);
+}
+
+void CTinyJS::executePrecompiled(const string &precompiled) {
+    CScriptMemory *oldMemory = CScriptMemory::current;
+    CScriptMemory::current = memory;
+    CScriptSource *source = 0;
+    try {
+      source = loadPrecompiled(precompiled);
+    } catch (CScriptException *e) {
+      CScriptMemory::current = oldMemory;
+      e->raise();
+    }
+    CScriptMemory::current = oldMemory;
+    executeSource(source);
+}
+
+void CTinyJS::executeSource(CScriptSource *source) {
+    CScriptLex *oldLex = l;
+    vector<CScriptVar*> oldScopes = scopes;
+    CScriptMemory *oldMemory = CScriptMemory::current;
+    CScriptMemory::current = memory;
+    l = new CScriptLex(source, 0, source->getLength());
+#ifdef TINYJS_CALL_STACK
+    call_stack.clear();
+#endif
+    scopes.clear();
+    scopes.push_back(root);
+    loopControl = LOOP_NONE;
+    // code run by native functions shares the limits of the code that called them
+    if (!oldLex) limits.start();
+    try {
+        bool execute = true;
+        while (l->tk) statement(execute);
+        checkLoopControl();
+    } catch (CScriptException *e) {
+        ostringstream msg;
+        msg << "Error " << e->text;
+#ifdef TINYJS_CALL_STACK
+        for (int i=(int)call_stack.size()-1;i>=0;i--)
+          msg << "\n" << i << ": " << call_stack.at(i);
+#endif
+        msg << " at " << l->getPosition();
+        delete l;
+        l = oldLex;
+        CScriptMemory::current = oldMemory;
+
+        e->text = msg.str();
+        e->raise();
     }
     delete l;
     l = oldLex;
     scopes = oldScopes;
+    CScriptMemory::current = oldMemory;
+}
+
+void CTinyJS::swapExecutionState(ExecutionState &state) {
+    std::swap(l, state.l);
+    scopes.swap(state.scopes);
+    std::swap(loopControl, state.loopControl);
+#ifdef TINYJS_CALL_STACK
+    call_stack.swap(state.call_stack);
+#endif
+    std::swap(limits, state.limits);
 }
 
 CScriptVarLink CTinyJS::evaluateComplex(const string &code) {
     CScriptLex *oldLex = l;
     vector<CScriptVar*> oldScopes = scopes;
+    CScriptMemory *oldMemory = CScriptMemory::current;
+    CScriptMemory::current = memory;
 
-    l = new CScriptLex(code);
+    l = new CScriptLex(optimiseCode ? optimise(code) : code);
 #ifdef TINYJS_CALL_STACK
     call_stack.clear();
 #endif
     scopes.clear();
     scopes.push_back(root);
     CScriptVarLink *v = 0;
+    loopControl = LOOP_NONE;
+    if (!oldLex) limits.start();
     try {
         bool execute = true;
         do {
@@ -1376,24 +2788,932 @@ CScriptVarLink CTinyJS::evaluateComplex(const string &code) {
       msg << " at " << l->getPosition();
       delete l;
       l = oldLex;
+      CScriptMemory::current = oldMemory;
+
+      e->text = msg.str();
+      e->raise();
+    }
+    delete l;
+    l = oldLex;
+    scopes = oldScopes;
+    CScriptMemory::current = oldMemory;
+
+    if (v) {
+        CScriptVarLink r = *v;
+        CLEAN(v);
+        return r;
+    }
+    // return undefined...
+    return CScriptVarLink(new CScriptVar());
+}
+
+string CTinyJS::evaluate(const string &code) {
+    return evaluateComplex(code).var->getString();
+}
+
+// ----------------------------------------------------------------------------------- SNAPSHOTS
+
+/* A snapshot file contains:
+ *   "TJSS", version, byte order check
+ *   the number of sources, then each source's text
+ *   the number of variables, then each variable's value:
+ *     flags, data (unless it's a number), source index (or -1), start, end, intData, doubleData,
+ *     native function description (or "")
+ *   each variable's children: number of children, then the name and variable index of each
+ *   the variable indices of root, and the String, Array and Object classes
+ * Integers are 32 bit (intData is 64), strings are a length then characters. Constants just
+ * have their flags and intData, and are replaced with the constant when loaded. */
+static const char TINYJS_SNAPSHOT_MAGIC[4] = { 'T', 'J', 'S', 'S' };
+static const int TINYJS_SNAPSHOT_VERSION = 1;
+static const int TINYJS_SNAPSHOT_BYTE_ORDER = 0x01020304;
+
+static void writeBinaryInt(string &out, int value) {
+    int32_t v = value;
+    out.append((const char*)&v, sizeof(v));
+}
+
+static void writeBinaryString(string &out, const string &str) {
+    writeBinaryInt(out, (int)str.size());
+    out.append(str);
+}
+
+/// Reads values from a snapshot or precompiled code, throwing an exception rather than going past the end
+struct CScriptBinaryReader {
+    const char *pos, *end;
+    const char *what; ///< What we're reading, for error messages
+
+    void read(void *dest, size_t size) {
+      if ((size_t)(end-pos) < size) throw new CScriptException(string(what) + " is truncated");
+      memcpy(dest, pos, size);
+      pos += size;
+    }
+    int readInt() {
+      int32_t v;
+      read(&v, sizeof(v));
+      return v;
+    }
+    int readIndex(int count) { ///< read an index into something with count items
+      int i = readInt();
+      if (i<0 || i>=count) throw new CScriptException(string(what) + " is corrupt");
+      return i;
+    }
+    string readString() {
+      int size = readInt();
+      if (size<0 || size>end-pos) throw new CScriptException(string(what) + " is truncated");
+      string str(pos, size);
+      pos += size;
+      return str;
+    }
+};
+
+void CTinyJS::saveSnapshot(const string &filename) {
+    createAllNatives();
+    // give every variable and source an index, in the order we find them
+    vector<CScriptVar*> vars;
+    unordered_map<CScriptVar*, int> varIndices;
+    vector<CScriptSource*> sources;
+    unordered_map<CScriptSource*, int> sourceIndices;
+    CScriptVar *roots[4] = { root, stringClass, arrayClass, objectClass };
+    for (int i=0;i<4;i++)
+      if (varIndices.insert(make_pair(roots[i], (int)vars.size())).second)
+        vars.push_back(roots[i]);
+    for (size_t i=0;i<vars.size();i++) {
+      CScriptVar *var = vars[i];
+      if (var->sourceData && sourceIndices.insert(make_pair(var->sourceData, (int)sources.size())).second)
+        sources.push_back(var->sourceData);
+      for (CScriptVarLink *child = var->firstChild; child; child = child->nextSibling)
+        if (varIndices.insert(make_pair(child->var, (int)vars.size())).second)
+          vars.push_back(child->var);
+    }
+
+    string out(TINYJS_SNAPSHOT_MAGIC, sizeof(TINYJS_SNAPSHOT_MAGIC));
+    writeBinaryInt(out, TINYJS_SNAPSHOT_VERSION);
+    writeBinaryInt(out, TINYJS_SNAPSHOT_BYTE_ORDER);
+    writeBinaryInt(out, (int)sources.size());
+    for (size_t i=0;i<sources.size();i++)
+      writeBinaryString(out, string(sources[i]->getData(), sources[i]->getLength()));
+    writeBinaryInt(out, (int)vars.size());
+    for (size_t i=0;i<vars.size();i++) {
+      CScriptVar *var = vars[i];
+      long long intData = var->intData;
+      // objects shared by freezeBuiltins are written like any other, and loaded as private copies
+      int varFlags = var->flags & ~SCRIPTVAR_BASELINE;
+      writeBinaryInt(out, var->isFrozen() ? varFlags & ~(SCRIPTVAR_CONSTANT | SCRIPTVAR_FROZEN) : varFlags);
+      if (var->isConstant() && !var->isFrozen()) {
+        out.append((const char*)&intData, sizeof(intData));
+        continue;
+      }
+      // numbers cache their string in data, which we don't need
+      writeBinaryString(out, var->isInt() || var->isDouble() || var->sourceData ? TINYJS_BLANK_DATA : var->data);
+      writeBinaryInt(out, var->sourceData ? sourceIndices[var->sourceData] : -1);
+      writeBinaryInt(out, var->sourceStart);
+      writeBinaryInt(out, var->sourceEnd);
+      out.append((const char*)&intData, sizeof(intData));
+      out.append((const char*)&var->doubleData, sizeof(var->doubleData));
+      string nativeDesc;
+      if (var->isNative()) {
+        map<string, NativeBinding>::iterator it;
+        for (it = nativeBindings.begin(); it!=nativeBindings.end(); it++)
+          if (it->second.callback==var->jsCallback &&
+              it->second.userdata==var->jsCallbackUserData &&
+              it->second.intrinsic==var->jsIntrinsic)
+            break;
+        if (it==nativeBindings.end())
+          throw new CScriptException("Native function wasn't added with addNative, so can't be saved");
+        nativeDesc = it->first;
+      }
+      writeBinaryString(out, nativeDesc);
+    }
+    for (size_t i=0;i<vars.size();i++) {
+      writeBinaryInt(out, vars[i]->getChildren());
+      for (CScriptVarLink *child = vars[i]->firstChild; child; child = child->nextSibling) {
+        writeBinaryString(out, child->name);
+        writeBinaryInt(out, varIndices[child->var]);
+      }
+    }
+    for (int i=0;i<4;i++)
+      writeBinaryInt(out, varIndices[roots[i]]);
+
+    FILE *file = fopen(filename.c_str(), "wb");
+    bool ok = file && fwrite(out.data(), 1, out.size(), file)==out.size();
+    if (file && fclose(file)!=0) ok = false;
+    if (!ok) throw new CScriptException("Unable to write snapshot " + filename);
+}
+
+void CTinyJS::loadSnapshot(const string &filename) {
+    createAllNatives(); // so that nativeBindings has everything
+    FILE *file = fopen(filename.c_str(), "rb");
+    if (!file) throw new CScriptException("Unable to open snapshot " + filename);
+    string in;
+    char buffer[65536];
+    size_t n;
+    while ((n = fread(buffer, 1, sizeof(buffer), file)) > 0)
+      in.append(buffer, n);
+    fclose(file);
+
+    CScriptBinaryReader reader;
+    reader.pos = in.data();
+    reader.end = in.data()+in.size();
+    reader.what = "Snapshot";
+    char magic[sizeof(TINYJS_SNAPSHOT_MAGIC)];
+    reader.read(magic, sizeof(magic));
+    if (memcmp(magic, TINYJS_SNAPSHOT_MAGIC, sizeof(magic))!=0)
+      throw new CScriptException(filename + " is not a snapshot");
+    if (reader.readInt()!=TINYJS_SNAPSHOT_VERSION || reader.readInt()!=TINYJS_SNAPSHOT_BYTE_ORDER)
+      throw new CScriptException(filename + " was written by a different version of TinyJS or kind of machine");
+
+    CScriptMemory *oldMemory = CScriptMemory::current;
+    CScriptMemory::current = memory;
+    // everything we create has a reference until we're done, so it's freed if the snapshot is bad
+    vector<CScriptSource*> sources;
+    vector<CScriptVar*> vars;
+    vector<int> flags;
+    try {
+      int sourceCount = reader.readInt();
+      for (int i=0;i<sourceCount;i++)
+        sources.push_back((new CScriptSource(reader.readString()))->ref());
+      int varCount = reader.readInt();
+      if (varCount<0 || varCount>reader.end-reader.pos) throw new CScriptException("Snapshot is corrupt");
+      for (int i=0;i<varCount;i++) {
+        int varFlags = reader.readInt();
+        long long intData;
+        if (varFlags & SCRIPTVAR_CONSTANT) {
+          reader.read(&intData, sizeof(intData));
+          if (varFlags & SCRIPTVAR_NULL) vars.push_back(CScriptVar::constNull());
+          else if (varFlags & SCRIPTVAR_INTEGER) vars.push_back(CScriptVar::constInt((int)intData));
+          else vars.push_back(CScriptVar::constUndefined());
+          flags.push_back(varFlags);
+          continue;
+        }
+        CScriptVar *var = (new CScriptVar())->ref();
+        vars.push_back(var);
+        flags.push_back(varFlags);
+        // classes are only marked as such once they have their children - see CScriptVar::clone
+        var->flags = varFlags & ~SCRIPTVAR_CLASS;
+        var->data = reader.readString();
+        var->chargeData();
+        int sourceIndex = reader.readInt();
+        int start = reader.readInt();
+        int end = reader.readInt();
+        if (sourceIndex>=0) {
+          if (sourceIndex>=sourceCount || start<0 || start>end || end>sources[sourceIndex]->getLength())
+            throw new CScriptException("Snapshot is corrupt");
+          var->setFunctionSource(sources[sourceIndex], start, end);
+        }
+        reader.read(&intData, sizeof(intData));
+        var->intData = (long)intData;
+        reader.read(&var->doubleData, sizeof(var->doubleData));
+        string nativeDesc = reader.readString();
+        if (nativeDesc.empty()==var->isNative())
+          throw new CScriptException("Snapshot is corrupt");
+        if (!nativeDesc.empty()) {
+          map<string, NativeBinding>::iterator it = nativeBindings.find(nativeDesc);
+          if (it==nativeBindings.end())
+            throw new CScriptException("Snapshot uses native function '" + nativeDesc + "', which hasn't been added");
+          var->jsCallback = it->second.callback;
+          var->jsCallbackUserData = it->second.userdata;
+          var->jsIntrinsic = it->second.intrinsic;
+          var->intrinsicArgs = it->second.intrinsicArgs;
+        }
+      }
+      for (int i=0;i<varCount;i++) {
+        int childCount = reader.readInt();
+        for (int c=0;c<childCount;c++) {
+          string name = reader.readString();
+          CScriptVar *child = vars[reader.readIndex(varCount)];
+          if (vars[i]->isConstant()) throw new CScriptException("Snapshot is corrupt");
+          vars[i]->addChild(name, child);
+        }
+      }
+      for (int i=0;i<varCount;i++)
+        if (!vars[i]->isConstant()) vars[i]->flags = flags[i];
+      CScriptVar *roots[4];
+      for (int i=0;i<4;i++)
+        roots[i] = vars[reader.readIndex(varCount)];
+      if (reader.pos!=reader.end) throw new CScriptException("Snapshot is corrupt");
+
+      discardBaseline(); // it was of the variables we're replacing
+      stringClass->unref();
+      arrayClass->unref();
+      objectClass->unref();
+      root->unref();
+      root = roots[0]->ref();
+      stringClass = roots[1]->ref();
+      arrayClass = roots[2]->ref();
+      objectClass = roots[3]->ref();
+      // what we had copies of has gone, and nothing that was loaded is frozen
+      setFrozenCopies(frozenCopies, std::map<CScriptVar*, CScriptVar*>());
+    } catch (CScriptException *e) {
+      for (size_t i=0;i<vars.size();i++) vars[i]->unref();
+      for (size_t i=0;i<sources.size();i++) sources[i]->unref();
+      CScriptMemory::current = oldMemory;
+      e->raise();
+    }
+    for (size_t i=0;i<vars.size();i++) vars[i]->unref();
+    for (size_t i=0;i<sources.size();i++) sources[i]->unref();
+    CScriptMemory::current = oldMemory;
+}
+
+// ----------------------------------------------------------------------------------- MESSAGES
+
+/* What CScriptVar::serialize writes is a character saying what each value is, followed by its data:
+ *   'U'ndefined, 'N'ull, 'I'nteger (32 bit), 'D'ouble, 'S'tring (a length then characters)
+ *   'O'bject or 'A'rray: the number of children, then the name and value of each
+ *   'R'eference: the index of an object or array that was already written (in the order they were) */
+
+void CScriptVar::serialize(string &out) {
+    unordered_map<CScriptVar*, int> written;
+    serialize(out, written);
+}
+
+void CScriptVar::serialize(string &out, unordered_map<CScriptVar*, int> &written) {
+    if (isFunction())
+      throw new CScriptException("Functions can't be sent as messages");
+    if (isObject() || isArray()) {
+      unordered_map<CScriptVar*, int>::iterator it = written.find(this);
+      if (it != written.end()) {
+        out += 'R';
+        writeBinaryInt(out, it->second);
+        return;
+      }
+      int index = (int)written.size();
+      written[this] = index;
+      out += isArray() ? 'A' : 'O';
+      int count = 0;
+      for (CScriptVarLink *child = firstChild; child; child = child->nextSibling)
+        if (child->name != TINYJS_PROTOTYPE_CLASS) count++;
+      writeBinaryInt(out, count);
+      for (CScriptVarLink *child = firstChild; child; child = child->nextSibling)
+        if (child->name != TINYJS_PROTOTYPE_CLASS) {
+          writeBinaryString(out, child->name);
+          child->var->serialize(out, written);
+        }
+    } else if (isInt()) {
+      out += 'I';
+      writeBinaryInt(out, (int)intData);
+    } else if (isDouble()) {
+      out += 'D';
+      out.append((const char*)&doubleData, sizeof(doubleData));
+    } else if (isString()) {
+      out += 'S';
+      writeBinaryString(out, data);
+    } else
+      out += isNull() ? 'N' : 'U';
+}
+
+CScriptVar *CScriptVar::deserialize(const string &data) {
+    CScriptBinaryReader reader;
+    reader.pos = data.data();
+    reader.end = reader.pos + data.size();
+    reader.what = "Message";
+    // every object has a reference until we're done, so they're freed if the message is bad
+    vector<CScriptVar*> read;
+    CScriptVar *var = 0;
+    try {
+      var = deserialize(reader, read)->ref();
+      if (reader.pos!=reader.end) throw new CScriptException("Message is corrupt");
+    } catch (CScriptException *e) {
+      if (var) var->unref();
+      for (size_t i=0;i<read.size();i++) read[i]->unref();
+      e->raise();
+    }
+    for (size_t i=0;i<read.size();i++) read[i]->unref();
+    return var;
+}
+
+CScriptVar *CScriptVar::deserialize(CScriptBinaryReader &reader, vector<CScriptVar*> &read) {
+    char type;
+    reader.read(&type, 1);
+    switch (type) {
+      case 'U': return constUndefined();
+      case 'N': return constNull();
+      case 'I': return constInt(reader.readInt());
+      case 'D': {
+        double value;
+        reader.read(&value, sizeof(value));
+        return new CScriptVar(value);
+      }
+      case 'S': return new CScriptVar(reader.readString());
+      case 'R': return read[reader.readIndex((int)read.size())];
+      case 'O':
+      case 'A': {
+        CScriptVar *var = new CScriptVar(TINYJS_BLANK_DATA, type=='A' ? SCRIPTVAR_ARRAY : SCRIPTVAR_OBJECT);
+        read.push_back(var->ref());
+        int count = reader.readInt();
+        for (int i=0;i<count;i++) {
+          string name = reader.readString();
+          var->addChild(name, deserialize(reader, read));
+        }
+        return var;
+      }
+    }
+    throw new CScriptException("Message is corrupt");
+}
+
+// ----------------------------------------------------------------------------------- CSCRIPTTASK
+
+/// A stack for a CScriptTask to run on, and the registers of whichever of the task and its host isn't running
+struct CScriptTaskContext {
+#ifdef _WIN32
+    void *fiber;
+    void *hostFiber;
+
+    static void WINAPI start(void *task) { ((CScriptTask*)task)->body(); }
+
+    CScriptTaskContext(CScriptTask *task, size_t stackSize) {
+      // only what the task uses is committed
+      fiber = CreateFiberEx(0, stackSize, 0, start, task);
+      if (!fiber) throw new CScriptException("Not enough memory for a task's stack");
+    }
+    ~CScriptTaskContext() { DeleteFiber(fiber); }
+
+    void switchToTask() {
+      // only fibers can switch to fibers, so the thread has to be one while it does
+      bool converted = !IsThreadAFiber();
+      hostFiber = converted ? ConvertThreadToFiber(0) : GetCurrentFiber();
+      SwitchToFiber(fiber);
+      if (converted) ConvertFiberToThread();
+    }
+    void switchToHost(bool) { SwitchToFiber(hostFiber); }
+#else
+    ucontext_t task;
+    ucontext_t host;
+    char *stack; ///< What we mapped: a guard page, then the stack
+    size_t mappedSize;
+    size_t stackSize;
+#ifdef TINYJS_ASAN_FIBERS
+    void *hostFakeStack; ///< AddressSanitizer's state for the host while the task runs
+    void *taskFakeStack; ///< ... and for the task while the host runs
+    const void *hostStack; ///< The host's stack, found when switching from it
+    size_t hostStackSize;
+#endif
+#ifdef TINYJS_TSAN_FIBERS
+    void *tsanFiber;
+    void *tsanHostFiber;
+#endif
+
+    // makecontext can only pass ints, so the task is found from CScriptTask::current instead
+    static void start() {
+      CScriptTask *task = CScriptTask::current;
+      task->context->switched();
+      task->body();
+    }
+
+    CScriptTaskContext(CScriptTask *, size_t size) {
+      size_t pageSize = (size_t)sysconf(_SC_PAGESIZE);
+      stackSize = (size+pageSize-1) / pageSize * pageSize;
+      // the pages are only allocated when they are first used
+      mappedSize = stackSize + pageSize;
+      stack = (char*)mmap(0, mappedSize, PROT_READ|PROT_WRITE, MAP_PRIVATE|MAP_ANONYMOUS|MAP_NORESERVE, -1, 0);
+      if (stack==MAP_FAILED) throw new CScriptException("Not enough memory for a task's stack");
+      // leave the bottom page inaccessible, so overflowing the stack crashes rather than overwriting something
+      mprotect(stack, pageSize, PROT_NONE);
+      getcontext(&task);
+      task.uc_stack.ss_sp = stack + pageSize;
+      task.uc_stack.ss_size = stackSize;
+      task.uc_link = 0;
+      makecontext(&task, start, 0);
+#ifdef TINYJS_ASAN_FIBERS
+      taskFakeStack = 0;
+#endif
+#ifdef TINYJS_TSAN_FIBERS
+      tsanFiber = __tsan_create_fiber(0);
+#endif
+    }
+    ~CScriptTaskContext() {
+#ifdef TINYJS_TSAN_FIBERS
+      __tsan_destroy_fiber(tsanFiber);
+#endif
+      munmap(stack, mappedSize);
+    }
+
+    void switchToTask() {
+#ifdef TINYJS_ASAN_FIBERS
+      __sanitizer_start_switch_fiber(&hostFakeStack, task.uc_stack.ss_sp, stackSize);
+#endif
+#ifdef TINYJS_TSAN_FIBERS
+      tsanHostFiber = __tsan_get_current_fiber();
+      __tsan_switch_to_fiber(tsanFiber, 0);
+#endif
+      swapcontext(&host, &task);
+#ifdef TINYJS_ASAN_FIBERS
+      __sanitizer_finish_switch_fiber(hostFakeStack, 0, 0);
+#endif
+    }
+    /// Switch back to the host. If the task has finished, it will never be switched back to
+    void switchToHost(bool finished) {
+#ifdef TINYJS_ASAN_FIBERS
+      __sanitizer_start_switch_fiber(finished ? 0 : &taskFakeStack, hostStack, hostStackSize);
+#else
+      (void)finished;
+#endif
+#ifdef TINYJS_TSAN_FIBERS
+      __tsan_switch_to_fiber(tsanHostFiber, 0);
+#endif
+      swapcontext(&task, &host);
+      switched();
+    }
+    /// Called on the task's stack each time it is switched to
+    void switched() {
+#ifdef TINYJS_ASAN_FIBERS
+      __sanitizer_finish_switch_fiber(taskFakeStack, &hostStack, &hostStackSize);
+#endif
+    }
+#endif
+};
+
+thread_local CScriptTask *CScriptTask::current = 0;
+
+CScriptTask::CScriptTask(CTinyJS *engine, const string &code, size_t stackSize) {
+    status = NOT_STARTED;
+    this->engine = engine;
+    this->code = code;
+    state.l = 0;
+    state.loopControl = LOOP_NONE;
+    state.limits = engine->limits;
+    memory = 0;
+    result = 0;
+    exception = 0;
+    previous = 0;
+    context = new CScriptTaskContext(this, stackSize);
+}
+
+CScriptTask::~CScriptTask() {
+    // the code must return from everything it was running, so what it is using gets freed
+    while (status==WAITING) {
+      try {
+        resumeWithError("The task was deleted");
+      } catch (CScriptException *e) {
+        delete e;
+      }
+    }
+    delete context;
+}
+
+bool CScriptTask::run() {
+    if (status!=NOT_STARTED) throw new CScriptException("The task has already been run");
+    return switchTo();
+}
+
+bool CScriptTask::resume(CScriptVar *result) {
+    // wait() gives this reference to the native function's result
+    result->ref();
+    if (status!=WAITING) {
+      result->unref();
+      throw new CScriptException("The task isn't waiting to be resumed");
+    }
+    this->result = result;
+    return switchTo();
+}
+
+bool CScriptTask::resumeWithError(const string &message) {
+    if (status!=WAITING) throw new CScriptException("The task isn't waiting to be resumed");
+    result = 0;
+    error = message;
+    return switchTo();
+}
+
+bool CScriptTask::switchTo() {
+    // give the code the engine as it left it, and keep the host's to put back afterwards
+    engine->swapExecutionState(state);
+    swap(memory, CScriptMemory::current);
+    previous = current;
+    current = this;
+    status = RUNNING;
+    context->switchToTask();
+    current = previous;
+    swap(memory, CScriptMemory::current);
+    engine->swapExecutionState(state);
+    if (exception) {
+      CScriptException *e = exception;
+      exception = 0;
+      e->raise();
+    }
+    return status==FINISHED;
+}
+
+void CScriptTask::switchBack() {
+    context->switchToHost(status==FINISHED);
+}
+
+void CScriptTask::body() {
+    try {
+      engine->execute(code);
+    } catch (CScriptException *e) {
+      exception = e;
+    }
+    status = FINISHED;
+    // we are never switched to again, so this doesn't return
+    switchBack();
+}
+
+void CScriptTask::wait(CScriptVarLink *returnVar) {
+    status = WAITING;
+    switchBack();
+    if (!result) throw new CScriptException(error);
+    returnVar->replaceWith(result);
+    result->unref();
+    result = 0;
+}
+
+// ----------------------------------------------------------------------------------- PRECOMPILED CODE
+
+/* Precompiled code contains:
+ *   "TJSC", version, byte order check, checksum of everything after it
+ *   the code
+ *   the number of strings, then each string (the tkStr of tokens, without duplicates)
+ *   the number of tokens, then for each: tk, start, end, index of its string (or -1)
+ *   the number of newlines, then the position of each
+ * using the same encoding as snapshots. */
+static const char TINYJS_PRECOMPILED_MAGIC[4] = { 'T', 'J', 'S', 'C' };
+static const int TINYJS_PRECOMPILED_VERSION = 1;
+static const int TINYJS_PRECOMPILED_HEADER_SIZE = sizeof(TINYJS_PRECOMPILED_MAGIC) + 3*sizeof(int32_t);
+
+/// FNV-1a hash, to check precompiled code hasn't been damaged
+static int getChecksum(const char *data, size_t length) {
+    uint32_t hash = 2166136261u;
+    for (size_t i=0;i<length;i++)
+      hash = (hash ^ (unsigned char)data[i]) * 16777619u;
+    return (int)hash;
+}
+
+string CTinyJS::precompile(const string &code) {
+    string source = optimiseCode ? optimise(code) : code;
+    vector<string> strings;
+    unordered_map<string, int> stringIndices;
+    vector<CScriptPrecompiledToken> tokens;
+    CScriptLex lex(source);
+    while (true) {
+      CScriptPrecompiledToken token;
+      token.tk = lex.tk;
+      token.start = lex.tokenStart;
+      token.end = lex.tokenEnd;
+      token.str = -1;
+      if (!lex.tkStr.empty()) {
+        unordered_map<string, int>::iterator it = stringIndices.find(lex.tkStr);
+        if (it==stringIndices.end()) {
+          it = stringIndices.insert(make_pair(lex.tkStr, (int)strings.size())).first;
+          strings.push_back(lex.tkStr);
+        }
+        token.str = it->second;
+      }
+      tokens.push_back(token);
+      if (lex.tk==LEX_EOF) break;
+      lex.match(lex.tk);
+    }
+
+    string body;
+    writeBinaryString(body, source);
+    writeBinaryInt(body, (int)strings.size());
+    for (size_t i=0;i<strings.size();i++)
+      writeBinaryString(body, strings[i]);
+    writeBinaryInt(body, (int)tokens.size());
+    for (size_t i=0;i<tokens.size();i++) {
+      writeBinaryInt(body, tokens[i].tk);
+      writeBinaryInt(body, tokens[i].start);
+      writeBinaryInt(body, tokens[i].end);
+      writeBinaryInt(body, tokens[i].str);
+    }
+    vector<int> newlines;
+    for (size_t i=0;i<source.size();i++)
+      if (source[i]=='\n') newlines.push_back((int)i);
+    writeBinaryInt(body, (int)newlines.size());
+    for (size_t i=0;i<newlines.size();i++)
+      writeBinaryInt(body, newlines[i]);
+
+    string out(TINYJS_PRECOMPILED_MAGIC, sizeof(TINYJS_PRECOMPILED_MAGIC));
+    writeBinaryInt(out, TINYJS_PRECOMPILED_VERSION);
+    writeBinaryInt(out, TINYJS_SNAPSHOT_BYTE_ORDER);
+    writeBinaryInt(out, getChecksum(body.data(), body.size()));
+    return out + body;
+}
+
+bool CTinyJS::isPrecompiled(const string &data) {
+    return data.size()>=sizeof(TINYJS_PRECOMPILED_MAGIC) &&
+           memcmp(data.data(), TINYJS_PRECOMPILED_MAGIC, sizeof(TINYJS_PRECOMPILED_MAGIC))==0;
+}
+
+CScriptSource *CTinyJS::loadPrecompiled(const string &precompiled) {
+    if (!isPrecompiled(precompiled) || precompiled.size()<(size_t)TINYJS_PRECOMPILED_HEADER_SIZE)
+      throw new CScriptException("Not precompiled code");
+    CScriptBinaryReader reader;
+    reader.pos = precompiled.data()+sizeof(TINYJS_PRECOMPILED_MAGIC);
+    reader.end = precompiled.data()+precompiled.size();
+    reader.what = "Precompiled code";
+    if (reader.readInt()!=TINYJS_PRECOMPILED_VERSION || reader.readInt()!=TINYJS_SNAPSHOT_BYTE_ORDER)
+      throw new CScriptException("Code was precompiled by a different version of TinyJS or kind of machine");
+    int checksum = reader.readInt();
+    if (checksum!=getChecksum(reader.pos, reader.end-reader.pos))
+      throw new CScriptException("Precompiled code is corrupt");
+
+    string code = reader.readString();
+    int length = (int)code.size();
+    vector<string> strings(reader.readIndex((int)((reader.end-reader.pos)/sizeof(int32_t))+1));
+    for (size_t i=0;i<strings.size();i++)
+      strings[i] = reader.readString();
+    /* Check that the tokens are in order and in the code, and end with LEX_EOF, so that
+     * CScriptLex never goes out of bounds. They may still be nonsense, but then so may code. */
+    vector<CScriptPrecompiledToken> tokens(reader.readIndex((int)((reader.end-reader.pos)/(4*sizeof(int32_t)))+1));
+    if (tokens.empty()) throw new CScriptException("Precompiled code is corrupt");
+    for (size_t i=0;i<tokens.size();i++) {
+      CScriptPrecompiledToken &token = tokens[i];
+      token.tk = reader.readInt();
+      token.start = reader.readInt();
+      token.end = reader.readInt();
+      token.str = reader.readInt();
+      if ((token.tk==LEX_EOF) != (i+1==tokens.size()) ||
+          token.start<0 || token.start>length+1 || token.end<token.start-1 || token.end>=length+1 ||
+          (i>0 && token.start<=tokens[i-1].end) ||
+          token.str<-1 || token.str>=(int)strings.size())
+        throw new CScriptException("Precompiled code is corrupt");
+    }
+    // every newline in the code must be listed, in order - or error positions would be wrong
+    vector<int> newlines(reader.readIndex(length+1));
+    if ((int)newlines.size()!=(int)count(code.begin(), code.end(), '\n'))
+      throw new CScriptException("Precompiled code is corrupt");
+    for (size_t i=0;i<newlines.size();i++) {
+      newlines[i] = reader.readIndex(length);
+      if (code[newlines[i]]!='\n' || (i>0 && newlines[i]<=newlines[i-1]))
+        throw new CScriptException("Precompiled code is corrupt");
+    }
+    if (reader.pos!=reader.end) throw new CScriptException("Precompiled code is corrupt");
+
+    CScriptSource *source = new CScriptSource(code);
+    source->setPrecompiled(tokens, strings, newlines);
+    return source;
+}
+
+// ----------------------------------------------------------------------------------- OPTIMISER
+
+/// A token found by tokenise - 'end' is the position just after its last character
+struct CScriptToken {
+    int tk;
+    int start, end;
+};
+
+static void tokenise(CScriptLex *lex, vector<CScriptToken> &tokens) {
+    lex->reset();
+    while (lex->tk) {
+      CScriptToken token;
+      token.tk = lex->tk;
+      token.start = lex->tokenStart;
+      token.end = lex->tokenEnd+1;
+      tokens.push_back(token);
+      lex->match(lex->tk);
+    }
+}
+
+/// Can this token be part of some constant arithmetic?
+static bool isConstantArithmetic(int tk) {
+    return tk==LEX_INT || tk==LEX_FLOAT || tk=='(' || tk==')' ||
+           tk=='+' || tk=='-' || tk=='*' || tk=='/' || tk=='%';
+}
+
+/* An expression between one of these and one of isExpressionEnd is parsed
+ * on its own by base(), so can be replaced by its value */
+static bool isExpressionStart(int tk) {
+    return tk=='=' || tk=='(' || tk=='[' || tk==',' || tk==':' || tk=='?' ||
+           tk==LEX_PLUSEQUAL || tk==LEX_MINUSEQUAL || tk==LEX_R_RETURN;
+}
+
+static bool isExpressionEnd(int tk) {
+    return tk==';' || tk==',' || tk==')' || tk==']' || tk==':' || tk=='}';
+}
+
+/// Return text to replace the given text with, with the same number of lines
+static string keepLines(const string &replacement, const string &code, int start, int end) {
+    string r = replacement;
+    for (int i=start;i<end;i++)
+      if (code[i]=='\n') r += '\n';
+    return r;
+}
+
+string CTinyJS::optimise(const string &code) {
+    return removeDeadBranches(foldConstants(code));
+}
+
+string CTinyJS::foldConstants(const string &code) {
+    CScriptLex lex(code);
+    vector<CScriptToken> tokens;
+    try {
+      tokenise(&lex, tokens);
+    } catch (CScriptException *e) {
+      // leave code we can't lex for execute to complain about
+      delete e;
+      return code;
+    }
+
+    string result;
+    int copied = 0; // how much of 'code' has been copied into 'result'
+    int n = (int)tokens.size();
+    for (int i=0;i<n;i++) {
+      if (!isExpressionStart(tokens[i].tk)) continue;
+      // find a run of constant arithmetic, with balanced brackets
+      int j = i+1;
+      int depth = 0;
+      bool hasOperator = false;
+      while (j<n && isConstantArithmetic(tokens[j].tk)) {
+        if (tokens[j].tk=='(') depth++;
+        else if (tokens[j].tk==')') {
+          if (depth==0) break;
+          depth--;
+        } else if (tokens[j].tk!=LEX_INT && tokens[j].tk!=LEX_FLOAT)
+          hasOperator = true;
+        j++;
+      }
+      if (j==i+1 || j>=n || depth!=0 || !hasOperator || !isExpressionEnd(tokens[j].tk))
+        continue;
+      int start = tokens[i+1].start;
+      int end = tokens[j-1].end;
+      string value;
+      if (!evaluateConstant(code.substr(start, end-start), value))
+        continue;
+      result.append(code, copied, start-copied);
+      result += keepLines(value, code, start, end);
+      copied = end;
+      i = j-1; // carry on from the end of the expression
+    }
+    result.append(code, copied, string::npos);
+    return result;
+}
+
+bool CTinyJS::evaluateConstant(const string &code, string &result) {
+    CScriptLex *oldLex = l;
+    l = new CScriptLex(code);
+    CScriptVarLink *v = 0;
+    bool ok = false;
+    try {
+      bool execute = true;
+      v = base(execute);
+      ok = v && l->tk==LEX_EOF;
+    } catch (CScriptException *e) {
+      delete e;
+    }
+    delete l;
+    l = oldLex;
+    if (ok) {
+      char buffer[64];
+      if (v->var->isInt()) {
+        sprintf_s(buffer, sizeof(buffer), "%d", v->var->getInt());
+        result = buffer;
+      } else if (v->var->isDouble()) {
+        double d = v->var->getDouble();
+        sprintf_s(buffer, sizeof(buffer), "%.17g", d);
+        result = buffer;
+        // the lexer can't read infinity, NaN or exponents with a '+'
+        if (d!=d || d-d!=0 || result.find('+')!=string::npos)
+          ok = false;
+        // make sure we still have a double
+        if (result.find_first_of(".e")==string::npos)
+          result += ".0";
+      } else
+        ok = false;
+    }
+    CLEAN(v);
+    return ok;
+}
 
-        throw new CScriptException(msg.str());
+int CTinyJS::findStatementEnd(CScriptLex *lex, int start) {
+    CScriptLex *oldLex = l;
+    l = new CScriptLex(lex, start, lex->getSubEnd());
+    int end = -1;
+    try {
+      bool noexecute = false;
+      statement(noexecute);
+      end = l->tk ? l->tokenStart : lex->getSubEnd();
+    } catch (CScriptException *e) {
+      delete e;
     }
     delete l;
     l = oldLex;
-    scopes = oldScopes;
-
-    if (v) {
-        CScriptVarLink r = *v;
-        CLEAN(v);
-        return r;
-    }
-    // return undefined...
-    return CScriptVarLink(new CScriptVar());
+    return end;
 }
 
-string CTinyJS::evaluate(const string &code) {
-    return evaluateComplex(code).var->getString();
+string CTinyJS::removeDeadBranches(const string &code) {
+    CScriptLex lex(code);
+    vector<CScriptToken> tokens;
+    try {
+      tokenise(&lex, tokens);
+    } catch (CScriptException *e) {
+      delete e;
+      return code;
+    }
+    /* Text to remove, keyed on where it starts. Anything we keep is still
+     * scanned, so dead branches inside it get removed too. */
+    struct Removal { int end; string replacement; };
+    std::map<int, Removal> removals;
+    std::set<int> doWhiles; ///< where the 'while's of do...while loops start
+
+    string result;
+    int copied = 0;
+    int n = (int)tokens.size();
+    for (int i=0;i<n;i++) {
+      std::map<int, Removal>::iterator r = removals.find(tokens[i].start);
+      if (r != removals.end()) {
+        result.append(code, copied, tokens[i].start-copied);
+        result += keepLines(r->second.replacement, code, tokens[i].start, r->second.end);
+        copied = r->second.end;
+        while (i+1<n && tokens[i+1].start<copied) i++;
+        continue;
+      }
+      // the 'while' at the end of 'do ... while (constant);' isn't a while loop
+      if (tokens[i].tk==LEX_R_DO && i+1<n) {
+        int bodyEnd = findStatementEnd(&lex, tokens[i+1].start);
+        if (bodyEnd>=0) doWhiles.insert(bodyEnd);
+      }
+      // look for 'if (constant)' or 'while (constant)'
+      if ((tokens[i].tk!=LEX_R_IF && tokens[i].tk!=LEX_R_WHILE) || i+4>=n ||
+          tokens[i+1].tk!='(' || tokens[i+3].tk!=')' || doWhiles.count(tokens[i].start))
+        continue;
+      int condTk = tokens[i+2].tk;
+      bool cond;
+      if (condTk==LEX_R_TRUE) cond = true;
+      else if (condTk==LEX_R_FALSE || condTk==LEX_R_NULL || condTk==LEX_R_UNDEFINED) cond = false;
+      else if (condTk==LEX_INT || condTk==LEX_FLOAT) {
+        CScriptVar value(code.substr(tokens[i+2].start, tokens[i+2].end-tokens[i+2].start),
+                         condTk==LEX_INT ? SCRIPTVAR_INTEGER : SCRIPTVAR_DOUBLE);
+        cond = value.getBool();
+      } else continue;
+
+      int bodyStart = tokens[i+4].start;
+      int bodyEnd = findStatementEnd(&lex, bodyStart);
+      if (bodyEnd<0) continue;
+      int elseStart = -1, elseEnd = -1, elseBodyStart = -1;
+      if (tokens[i].tk==LEX_R_IF) {
+        int k = i+4;
+        while (k<n && tokens[k].start<bodyEnd) k++;
+        if (k+1<n && tokens[k].tk==LEX_R_ELSE) {
+          elseStart = tokens[k].start;
+          elseBodyStart = tokens[k+1].start;
+          elseEnd = findStatementEnd(&lex, elseBodyStart);
+          if (elseEnd<0) continue;
+        }
+      } else if (cond)
+        continue; // 'while (true)' - nothing to remove
+
+      Removal header;
+      if (cond) {
+        // keep the body, remove 'if (...)' and any 'else ...'
+        header.end = bodyStart;
+        if (elseStart>=0) {
+          Removal elseBranch;
+          elseBranch.end = elseEnd;
+          removals[elseStart] = elseBranch;
+        }
+      } else if (elseStart>=0) {
+        // keep just the else branch
+        header.end = elseBodyStart;
+      } else {
+        header.end = bodyEnd;
+        header.replacement = ";";
+      }
+      result.append(code, copied, tokens[i].start-copied);
+      result += keepLines(header.replacement, code, tokens[i].start, header.end);
+      copied = header.end;
+      while (i+1<n && tokens[i+1].start<copied) i++;
+    }
+    result.append(code, copied, string::npos);
+    return result;
 }
 
 void CTinyJS::parseFunctionArguments(CScriptVar *funcVar) {
@@ -1406,7 +3726,35 @@ void CTinyJS::parseFunctionArguments(CScriptVar *funcVar) {
   l->match(')');
 }
 
+/** The key for a native function in nativeBindings, 'function path(arg,arg)' with no spaces - so it's
+ * the same whether the function came from addNative or a table, and however its description was spaced */
+static string getNativeKey(const string &path, CScriptVar *funcVar) {
+    string key = "function " + path + "(";
+    for (CScriptVarLink *arg = funcVar->firstChild; arg; arg = arg->nextSibling) {
+      if (arg != funcVar->firstChild) key += ',';
+      key += arg->name;
+    }
+    return key + ")";
+}
+
 void CTinyJS::addNative(const string &funcDesc, JSCallback ptr, void *userdata) {
+    string key;
+    addNativeFunction(funcDesc, key)->setCallback(ptr, userdata);
+    NativeBinding binding = { ptr, userdata, 0, 0 };
+    nativeBindings[key] = binding;
+}
+
+void CTinyJS::addIntrinsic(const string &funcDesc, JSIntrinsic ptr) {
+    string key;
+    CScriptVar *funcVar = addNativeFunction(funcDesc, key);
+    if (funcVar->getChildren() > TINYJS_INTRINSIC_MAX_ARGS)
+      throw new CScriptException("Too many arguments for intrinsic " + funcDesc);
+    funcVar->setIntrinsic(ptr, funcVar->getChildren());
+    NativeBinding binding = { 0, 0, ptr, funcVar->getChildren() };
+    nativeBindings[key] = binding;
+}
+
+CScriptVar *CTinyJS::addNativeFunction(const string &funcDesc, string &key) {
     CScriptLex *oldLex = l;
     l = new CScriptLex(funcDesc);
 
@@ -1414,7 +3762,9 @@ void CTinyJS::addNative(const string &funcDesc, JSCallback ptr, void *userdata)
 
     l->match(LEX_R_FUNCTION);
     string funcName = l->tkStr;
+    string path = funcName;
     l->match(LEX_ID);
+    createNatives(funcName); // so we add to the object from addNatives rather than making another
     /* Check for dots, we might want to do something like function String.substring ... */
     while (l->tk == '.') {
       l->match('.');
@@ -1423,16 +3773,128 @@ void CTinyJS::addNative(const string &funcDesc, JSCallback ptr, void *userdata)
       if (!link) link = base->addChild(funcName, new CScriptVar(TINYJS_BLANK_DATA, SCRIPTVAR_OBJECT));
       base = link->var;
       funcName = l->tkStr;
+      path += "." + funcName;
       l->match(LEX_ID);
     }
 
     CScriptVar *funcVar = new CScriptVar(TINYJS_BLANK_DATA, SCRIPTVAR_FUNCTION | SCRIPTVAR_NATIVE);
-    funcVar->setCallback(ptr, userdata);
     parseFunctionArguments(funcVar);
     delete l;
     l = oldLex;
 
     base->addChild(funcName, funcVar);
+    key = getNativeKey(path, funcVar);
+    return funcVar;
+}
+
+void CTinyJS::addNatives(const CScriptNativeDesc *natives, int count, void *userdata) {
+    NativeTable table = { natives, 0, 0, count, userdata };
+    addNativeTable(table);
+}
+
+void CTinyJS::addIntrinsics(const CScriptIntrinsicDesc *intrinsics, int count) {
+    NativeTable table = { 0, intrinsics, 0, count, 0 };
+    addNativeTable(table);
+}
+
+void CTinyJS::addConstants(const CScriptConstantDesc *constants, int count) {
+    NativeTable table = { 0, 0, constants, count, 0 };
+    addNativeTable(table);
+}
+
+/// The first name in a path, eg. 'Math' for 'Math.sin'
+static string getFirstName(const char *path) {
+    const char *dot = strchr(path, '.');
+    return dot ? string(path, dot-path) : string(path);
+}
+
+void CTinyJS::addNativeTable(const NativeTable &table) {
+    CScriptMemory *oldMemory = CScriptMemory::current;
+    CScriptMemory::current = memory;
+    CScriptVar *parent = 0;
+    string parentPath;
+    bool lazy = false;
+    for (int i=0;i<table.count;i++) {
+      string name = getFirstName(table.getPath(i));
+      // If the object exists, it'll never be looked up as missing - so we can't wait
+      if (root->findChild(name)) {
+        createNative(table, i, parent, parentPath);
+      } else {
+        lazyNames.insert(name);
+        lazy = true;
+      }
+    }
+    if (lazy) lazyTables.push_back(table);
+    CScriptMemory::current = oldMemory;
+}
+
+bool CTinyJS::createNatives(const string &name) {
+    std::set<string>::iterator it = lazyNames.find(name);
+    if (it == lazyNames.end()) return false;
+    CScriptMemory *oldMemory = CScriptMemory::current;
+    CScriptMemory::current = memory;
+    for (size_t t=0;t<lazyTables.size();t++) {
+      CScriptVar *parent = 0;
+      string parentPath;
+      for (int i=0;i<lazyTables[t].count;i++) {
+        const char *path = lazyTables[t].getPath(i);
+        if (!strncmp(path, name.c_str(), name.size()) && (path[name.size()]=='.' || !path[name.size()]))
+          createNative(lazyTables[t], i, parent, parentPath);
+      }
+    }
+    CScriptMemory::current = oldMemory;
+    lazyNames.erase(it); // not before, as name could be what 'it' points to
+    if (lazyNames.empty()) lazyTables.clear();
+    return true;
+}
+
+void CTinyJS::createAllNatives() {
+    while (!lazyNames.empty())
+      createNatives(*lazyNames.begin());
+}
+
+void CTinyJS::createNative(const NativeTable &table, int i, CScriptVar *&parent, string &parentPath) {
+    const char *path = table.getPath(i);
+    const char *name = strrchr(path, '.');
+    name = name ? name+1 : path;
+    // find the object it goes in, unless it's the same one as last time
+    if (!parent || parentPath.compare(0, string::npos, path, name-path) != 0) {
+      parentPath.assign(path, name-path);
+      parent = root;
+      const char *objectName = path;
+      while (objectName < name) {
+        const char *dot = strchr(objectName, '.');
+        string childName(objectName, dot-objectName);
+        CScriptVarLink *link = parent->findChild(childName);
+        // if it doesn't exist, make an object class
+        if (!link) link = parent->addChild(childName, new CScriptVar(TINYJS_BLANK_DATA, SCRIPTVAR_OBJECT));
+        parent = link->var;
+        objectName = dot+1;
+      }
+    }
+
+    if (table.constants) {
+      parent->addChild(name, new CScriptVar(table.constants[i].value));
+      return;
+    }
+
+    const char *const *args = table.natives ? table.natives[i].args : table.intrinsics[i].args;
+    CScriptVar *funcVar = new CScriptVar(TINYJS_BLANK_DATA, SCRIPTVAR_FUNCTION | SCRIPTVAR_NATIVE);
+    for (int a=0;a<TINYJS_NATIVE_DESC_MAX_ARGS && args[a];a++)
+      funcVar->addChildNoDup(args[a]);
+    parent->addChild(name, funcVar);
+    string key = getNativeKey(path, funcVar);
+
+    if (table.natives) {
+      funcVar->setCallback(table.natives[i].callback, table.userdata);
+      NativeBinding binding = { table.natives[i].callback, table.userdata, 0, 0 };
+      nativeBindings[key] = binding;
+    } else {
+      static_assert(TINYJS_NATIVE_DESC_MAX_ARGS <= TINYJS_INTRINSIC_MAX_ARGS, "an intrinsic in a table could have too many arguments");
+      funcVar->setIntrinsic(table.intrinsics[i].intrinsic, funcVar->getChildren());
+      NativeBinding binding = { 0, 0, table.intrinsics[i].intrinsic, funcVar->getChildren() };
+      nativeBindings[key] = binding;
+    }
 }
 
 CScriptVarLink *CTinyJS::parseFunctionDefinition() {
@@ -1449,7 +3911,7 @@ CScriptVarLink *CTinyJS::parseFunctionDefinition() {
   int funcBegin = l->tokenStart;
   bool noexecute = false;
   block(noexecute);
-  funcVar->var->data = l->getSubString(funcBegin);
+  funcVar->var->setFunctionSource(l->getSource(), funcBegin, l->getSubEnd());
   return funcVar;
 }
 
@@ -1457,82 +3919,239 @@ CScriptVarLink *CTinyJS::parseFunctionDefinition() {
  * on the start bracket). 'parent' is the object that contains this method,
  * if there was one (otherwise it's just a normnal function).
  */
+static void addFunctionParameter(CScriptVar *functionRoot, const string &name, CScriptVar *value) {
+    if (value->isBasic()) {
+      // pass by value
+      functionRoot->addChild(name, value->deepCopy());
+    } else {
+      // pass by reference
+      functionRoot->addChild(name, value);
+    }
+}
+
+CScriptCompiledFunction *CTinyJS::getCompiledFunction(CScriptVar *function) {
+    if (!function->compiled) {
+      if (function->isNative() || ++function->callCount < compileThreshold)
+        return 0;
+      function->compiled = new CScriptCompiledFunction(function);
+    }
+    return function->compiled->isValid() ? function->compiled : 0;
+}
+
+CScriptVarLink *CTinyJS::runFunction(CScriptVarLink *function, CScriptVar *functionRoot, bool &execute) {
+  // setup a return variable
+  CScriptVarLink *returnVar = NULL;
+  // execute function!
+  // add the function's execute space to the symbol table so we can recurse
+  CScriptVarLink *returnVarLink = functionRoot->addChild(TINYJS_RETURN_VAR);
+  scopes.push_back(functionRoot);
+#ifdef TINYJS_CALL_STACK
+  call_stack.push_back(function->name + (l ? " from " + l->getPosition() : ""));
+#endif
+
+  CScriptException *exception = 0;
+  if (function->var->isNative()) {
+      ASSERT(function->var->jsCallback);
+      try {
+        function->var->jsCallback(functionRoot, function->var->jsCallbackUserData);
+        // its result will come later, so stop until the task we are running in is resumed with it
+        if (returnVarLink->var==CScriptVar::constPending()) {
+          CScriptTask *task = CScriptTask::getCurrent();
+          if (!task || task->engine!=this)
+            throw new CScriptException("'" + function->name + "' can only be called by code run in a CScriptTask");
+          task->wait(returnVarLink);
+        }
+      } catch (CScriptException *e) {
+        exception = e;
+      }
+  } else {
+      /* we just want to execute the block, but something could
+       * have messed up and left us with the wrong ScriptLex, so
+       * we want to be careful here... */
+      CScriptLex *oldLex = l;
+      CScriptLex *newLex = function->var->getFunctionLex();
+      l = newLex;
+      try {
+        block(execute);
+        checkLoopControl();
+        // because return will probably have called this, and set execute to false
+        execute = true;
+      } catch (CScriptException *e) {
+        exception = e;
+      }
+      delete newLex;
+      l = oldLex;
+  }
+  if (exception) {
+      // the call stack is left for the error message, but our scope goes
+      scopes.pop_back();
+      delete functionRoot;
+      exception->raise();
+  }
+#ifdef TINYJS_CALL_STACK
+  if (!call_stack.empty()) call_stack.pop_back();
+#endif
+  scopes.pop_back();
+  /* get the real return var before we remove it from our function */
+  returnVar = new CScriptVarLink(returnVarLink->var);
+  functionRoot->removeLink(returnVarLink);
+  delete functionRoot;
+  if (returnVar)
+    return returnVar;
+  else
+    return new CScriptVarLink(new CScriptVar());
+}
+
+CScriptVarLink CTinyJS::callFunction(CScriptVar *function, const vector<CScriptVar*> &args) {
+    if (!function->isFunction()) throw new CScriptException("Expecting a function");
+    CScriptLex *oldLex = l;
+    vector<CScriptVar*> oldScopes = scopes;
+    CScriptMemory *oldMemory = CScriptMemory::current;
+    CScriptMemory::current = memory;
+
+#ifdef TINYJS_CALL_STACK
+    call_stack.clear();
+#endif
+    scopes.clear();
+    scopes.push_back(root);
+    loopControl = LOOP_NONE;
+    if (!oldLex) limits.start();
+    CScriptVarLink *v = 0;
+    try {
+      limits.use();
+      if (function->jsIntrinsic) {
+        CScriptVar *argValues[TINYJS_INTRINSIC_MAX_ARGS];
+        for (int i=0;i<function->intrinsicArgs;i++)
+          argValues[i] = i<(int)args.size() ? args[i] : CScriptVar::constUndefined();
+        v = new CScriptVarLink(function->jsIntrinsic(argValues));
+      }
+      // as in functionCall, compiled functions just want the values of their arguments if they're numbers
+      CScriptCompiledFunction *compiled = v || compileThreshold<=0 ? 0 : getCompiledFunction(function);
+      if (compiled && function->getChildren()==compiled->getParameterCount()) {
+        vector<CScriptVar*> argValues(compiled->getParameterCount(), CScriptVar::constUndefined());
+        bool numeric = true;
+        for (size_t i=0;i<argValues.size() && i<args.size();i++) {
+          argValues[i] = args[i];
+          numeric = numeric && CScriptCompiledFunction::canCallWith(args[i]);
+        }
+        if (numeric) v = new CScriptVarLink(compiled->call(argValues.data(), &limits));
+      }
+      if (!v) {
+        // missing arguments are undefined, and extra ones are ignored
+        CScriptVar *functionRoot = new CScriptVar(TINYJS_BLANK_DATA, SCRIPTVAR_FUNCTION);
+        size_t i = 0;
+        for (CScriptVarLink *param = function->firstChild; param; param = param->nextSibling, i++)
+          addFunctionParameter(functionRoot, param->name, i<args.size() ? args[i] : CScriptVar::constUndefined());
+        CScriptVarLink functionLink(function);
+        bool execute = true;
+        v = runFunction(&functionLink, functionRoot, execute);
+      }
+    } catch (CScriptException *e) {
+      ostringstream msg;
+      msg << "Error " << e->text;
+#ifdef TINYJS_CALL_STACK
+      for (int i=(int)call_stack.size()-1;i>=0;i--)
+        msg << "\n" << i << ": " << call_stack.at(i);
+#endif
+      l = oldLex;
+      scopes = oldScopes;
+      CScriptMemory::current = oldMemory;
+
+      e->text = msg.str();
+      e->raise();
+    }
+    l = oldLex;
+    scopes = oldScopes;
+    CScriptMemory::current = oldMemory;
+
+    CScriptVarLink r = *v;
+    CLEAN(v);
+    return r;
+}
+
 CScriptVarLink *CTinyJS::functionCall(bool &execute, CScriptVarLink *function, CScriptVar *parent) {
   if (execute) {
+    limits.use();
     if (!function->var->isFunction()) {
         string errorMsg = "Expecting '";
         errorMsg = errorMsg + function->name + "' to be a function";
         throw new CScriptException(errorMsg.c_str());
     }
     l->match('(');
+    if (function->var->jsIntrinsic) {
+      // intrinsics just want the values of their arguments, so skip creating a scope
+      CScriptVarLink *args[TINYJS_INTRINSIC_MAX_ARGS];
+      CScriptVar *argValues[TINYJS_INTRINSIC_MAX_ARGS];
+      // scripts may have given the function other children, so only its real arguments are counted
+      int argCount = function->var->intrinsicArgs;
+      ASSERT(argCount<=TINYJS_INTRINSIC_MAX_ARGS);
+      for (int i=0;i<argCount;i++) {
+        args[i] = base(execute);
+        argValues[i] = args[i]->var;
+        if (l->tk!=')') l->match(',');
+      }
+      l->match(')');
+      CScriptVar *result = function->var->jsIntrinsic(argValues);
+      for (int i=0;i<argCount;i++)
+        CLEAN(args[i]);
+      return new CScriptVarLink(result);
+    }
     // create a new symbol table entry for execution of this function
     CScriptVar *functionRoot = new CScriptVar(TINYJS_BLANK_DATA, SCRIPTVAR_FUNCTION);
     if (parent)
       functionRoot->addChildNoDup("this", parent);
-    // grab in all parameters
-    CScriptVarLink *v = function->var->firstChild;
-    while (v) {
-        CScriptVarLink *value = base(execute);
-        if (execute) {
-            if (value->var->isBasic()) {
-              // pass by value
-              functionRoot->addChild(v->name, value->var->deepCopy());
-            } else {
-              // pass by reference
-              functionRoot->addChild(v->name, value->var);
-            }
-        }
-        CLEAN(value);
+    CScriptCompiledFunction *compiled = compileThreshold>0 ? getCompiledFunction(function->var) : 0;
+    if (compiled) {
+      // compiled functions just want the values of their arguments, so only create a scope if they aren't numbers
+      std::vector<CScriptVarLink*> args;
+      bool numeric = true;
+      CScriptVarLink *v = function->var->firstChild;
+      while (v) {
+        args.push_back(base(execute));
+        numeric = numeric && CScriptCompiledFunction::canCallWith(args.back()->var);
         if (l->tk!=')') l->match(',');
         v = v->nextSibling;
-    }
-    l->match(')');
-    // setup a return variable
-    CScriptVarLink *returnVar = NULL;
-    // execute function!
-    // add the function's execute space to the symbol table so we can recurse
-    CScriptVarLink *returnVarLink = functionRoot->addChild(TINYJS_RETURN_VAR);
-    scopes.push_back(functionRoot);
-#ifdef TINYJS_CALL_STACK
-    call_stack.push_back(function->name + " from " + l->getPosition());
-#endif
-
-    if (function->var->isNative()) {
-        ASSERT(function->var->jsCallback);
-        function->var->jsCallback(functionRoot, function->var->jsCallbackUserData);
-    } else {
-        /* we just want to execute the block, but something could
-         * have messed up and left us with the wrong ScriptLex, so
-         * we want to be careful here... */
+      }
+      l->match(')');
+      // parameters are function's children, so they may have been changed since it was compiled
+      if (numeric && (int)args.size()==compiled->getParameterCount()) {
+        std::vector<CScriptVar*> argValues(args.size());
+        for (size_t i=0;i<args.size();i++)
+          argValues[i] = args[i]->var;
+        CScriptVar *result = 0;
         CScriptException *exception = 0;
-        CScriptLex *oldLex = l;
-        CScriptLex *newLex = new CScriptLex(function->var->getString());
-        l = newLex;
         try {
-          block(execute);
-          // because return will probably have called this, and set execute to false
-          execute = true;
+          result = compiled->call(argValues.data(), &limits);
         } catch (CScriptException *e) {
           exception = e;
         }
-        delete newLex;
-        l = oldLex;
-
+        for (size_t i=0;i<args.size();i++)
+          CLEAN(args[i]);
+        delete functionRoot;
         if (exception)
-          throw exception;
+          exception->raise();
+        return new CScriptVarLink(result);
+      }
+      v = function->var->firstChild;
+      for (size_t i=0;i<args.size();i++) {
+        addFunctionParameter(functionRoot, v->name, args[i]->var);
+        CLEAN(args[i]);
+        v = v->nextSibling;
+      }
+    } else {
+      // grab in all parameters
+      CScriptVarLink *v = function->var->firstChild;
+      while (v) {
+          CScriptVarLink *value = base(execute);
+          if (execute)
+            addFunctionParameter(functionRoot, v->name, value->var);
+          CLEAN(value);
+          if (l->tk!=')') l->match(',');
+          v = v->nextSibling;
+      }
+      l->match(')');
     }
-#ifdef TINYJS_CALL_STACK
-    if (!call_stack.empty()) call_stack.pop_back();
-#endif
-    scopes.pop_back();
-    /* get the real return var before we remove it from our function */
-    returnVar = new CScriptVarLink(returnVarLink->var);
-    functionRoot->removeLink(returnVarLink);
-    delete functionRoot;
-    if (returnVar)
-      return returnVar;
-    else
-      return new CScriptVarLink(new CScriptVar());
+    return runFunction(function, functionRoot, execute);
   } else {
     // function, but not executing - just parse args and be done
     l->match('(');
@@ -1560,22 +4179,22 @@ CScriptVarLink *CTinyJS::factor(bool &execute) {
     }
     if (l->tk==LEX_R_TRUE) {
         l->match(LEX_R_TRUE);
-        return new CScriptVarLink(new CScriptVar(1));
+        return new CScriptVarLink(CScriptVar::constBool(true));
     }
     if (l->tk==LEX_R_FALSE) {
         l->match(LEX_R_FALSE);
-        return new CScriptVarLink(new CScriptVar(0));
+        return new CScriptVarLink(CScriptVar::constBool(false));
     }
     if (l->tk==LEX_R_NULL) {
         l->match(LEX_R_NULL);
-        return new CScriptVarLink(new CScriptVar(TINYJS_BLANK_DATA,SCRIPTVAR_NULL));
+        return new CScriptVarLink(CScriptVar::constNull());
     }
     if (l->tk==LEX_R_UNDEFINED) {
         l->match(LEX_R_UNDEFINED);
-        return new CScriptVarLink(new CScriptVar(TINYJS_BLANK_DATA,SCRIPTVAR_UNDEFINED));
+        return new CScriptVarLink(CScriptVar::constUndefined());
     }
     if (l->tk==LEX_ID) {
-        CScriptVarLink *a = execute ? findInScopes(l->tkStr) : new CScriptVarLink(new CScriptVar());
+        CScriptVarLink *a = execute ? findInScopes(l->tkStr) : new CScriptVarLink(CScriptVar::constUndefined());
         //printf("0x%08X for %s at %s\n", (unsigned int)a, l->tkStr.c_str(), l->getPosition().c_str());
         /* The parent if we're executing a method call */
         CScriptVar *parent = 0;
@@ -1583,12 +4202,18 @@ CScriptVarLink *CTinyJS::factor(bool &execute) {
         if (execute && !a) {
           /* Variable doesn't exist! JavaScript says we should create it
            * (we won't add it here. This is done in the assignment operator)*/
-          a = new CScriptVarLink(new CScriptVar(), l->tkStr);
+          a = new CScriptVarLink(CScriptVar::constUndefined(), l->tkStr);
         }
         l->match(LEX_ID);
         while (l->tk=='(' || l->tk=='.' || l->tk=='[') {
             if (l->tk=='(') { // ------------------------------------- Function Call
                 a = functionCall(execute, a, parent);
+            } else if (l->tk == '.' && execute && a->var->isFrozen()) { // ------------------------------------- Record Access (frozen - see freezeBuiltins)
+                l->match('.');
+                string name = l->tkStr;
+                l->match(LEX_ID);
+                parent = a->var;
+                a = findFrozenChild(a->var, name);
             } else if (l->tk == '.') { // ------------------------------------- Record Access
                 l->match('.');
                 if (execute) {
@@ -1600,11 +4225,12 @@ CScriptVarLink *CTinyJS::factor(bool &execute) {
                        'length' properly */
                     if (a->var->isArray() && name == "length") {
                       int l = a->var->getArrayLength();
-                      child = new CScriptVarLink(new CScriptVar(l));
+                      child = new CScriptVarLink(CScriptVar::constInt(l));
                     } else if (a->var->isString() && name == "length") {
                       int l = a->var->getString().size();
-                      child = new CScriptVarLink(new CScriptVar(l));
+                      child = new CScriptVarLink(CScriptVar::constInt(l));
                     } else {
+                      a->makeWritable();
                       child = a->var->addChild(name);
                     }
                   }
@@ -1616,7 +4242,11 @@ CScriptVarLink *CTinyJS::factor(bool &execute) {
                 l->match('[');
                 CScriptVarLink *index = base(execute);
                 l->match(']');
-                if (execute) {
+                if (execute && a->var->isFrozen()) {
+                  parent = a->var;
+                  a = findFrozenChild(a->var, index->var->getString());
+                } else if (execute) {
+                  a->makeWritable();
                   CScriptVarLink *child = a->var->findChildOrCreate(index->var->getString());
                   parent = a->var;
                   a = child;
@@ -1626,10 +4256,19 @@ CScriptVarLink *CTinyJS::factor(bool &execute) {
         }
         return a;
     }
-    if (l->tk==LEX_INT || l->tk==LEX_FLOAT) {
-        CScriptVar *a = new CScriptVar(l->tkStr,
-            ((l->tk==LEX_INT)?SCRIPTVAR_INTEGER:SCRIPTVAR_DOUBLE));
-        l->match(l->tk);
+    if (l->tk==LEX_INT) {
+        long val = strtol(l->tkStr.c_str(),0,0);
+        CScriptVar *a;
+        if (val>=TINYJS_SMALL_INT_MIN && val<=TINYJS_SMALL_INT_MAX)
+          a = CScriptVar::constInt((int)val);
+        else
+          a = new CScriptVar(l->tkStr, SCRIPTVAR_INTEGER);
+        l->match(LEX_INT);
+        return new CScriptVarLink(a);
+    }
+    if (l->tk==LEX_FLOAT) {
+        CScriptVar *a = new CScriptVar(l->tkStr, SCRIPTVAR_DOUBLE);
+        l->match(LEX_FLOAT);
         return new CScriptVarLink(a);
     }
     if (l->tk==LEX_STR) {
@@ -1694,7 +4333,7 @@ CScriptVarLink *CTinyJS::factor(bool &execute) {
         CScriptVarLink *objClassOrFunc = findInScopes(className);
         if (!objClassOrFunc) {
           TRACE("%s is not a valid class name", className.c_str());
-          return new CScriptVarLink(new CScriptVar());
+          return new CScriptVarLink(CScriptVar::constUndefined());
         }
         l->match(LEX_ID);
         CScriptVar *obj = new CScriptVar(TINYJS_BLANK_DATA, SCRIPTVAR_OBJECT);
@@ -1728,8 +4367,7 @@ CScriptVarLink *CTinyJS::unary(bool &execute) {
         l->match('!'); // binary not
         a = factor(execute);
         if (execute) {
-            CScriptVar zero(0);
-            CScriptVar *res = a->var->mathsOp(&zero, LEX_EQUAL);
+            CScriptVar *res = a->var->mathsOp(CScriptVar::constInt(0), LEX_EQUAL);
             CREATE_LINK(a, res);
         }
     } else
@@ -1760,8 +4398,7 @@ CScriptVarLink *CTinyJS::expression(bool &execute) {
     }
     CScriptVarLink *a = term(execute);
     if (negate) {
-        CScriptVar zero(0);
-        CScriptVar *res = zero.mathsOp(a->var, '-');
+        CScriptVar *res = CScriptVar::constInt(0)->mathsOp(a->var, '-');
         CREATE_LINK(a, res);
     }
 
@@ -1771,13 +4408,21 @@ CScriptVarLink *CTinyJS::expression(bool &execute) {
         l->match(l->tk);
         if (op==LEX_PLUSPLUS || op==LEX_MINUSMINUS) {
             if (execute) {
-                CScriptVar one(1);
-                CScriptVar *res = a->var->mathsOp(&one, op==LEX_PLUSPLUS ? '+' : '-');
-                CScriptVarLink *oldValue = new CScriptVarLink(a->var);
-                // in-place add/subtract
-                a->replaceWith(res);
-                CLEAN(a);
-                a = oldValue;
+                int mathsOp = op==LEX_PLUSPLUS ? '+' : '-';
+                if (a->var->getRefs()==1 && !a->var->isConstant() &&
+                    (a->var->isInt() || a->var->isDouble())) {
+                    // nothing else can see this number, so add/subtract in-place
+                    CScriptVar *oldValue = a->var->isInt() ?
+                        CScriptVar::constInt(a->var->getInt()) : new CScriptVar(a->var->getDouble());
+                    a->var->mathsOpInPlace(CScriptVar::constInt(1), mathsOp);
+                    CREATE_LINK(a, oldValue);
+                } else {
+                    CScriptVar *res = a->var->mathsOp(CScriptVar::constInt(1), mathsOp);
+                    CScriptVarLink *oldValue = new CScriptVarLink(a->var);
+                    a->replaceWith(res);
+                    CLEAN(a);
+                    a = oldValue;
+                }
             }
         } else {
             CScriptVarLink *b = term(execute);
@@ -1801,9 +4446,12 @@ CScriptVarLink *CTinyJS::shift(bool &execute) {
     int shift = execute ? b->var->getInt() : 0;
     CLEAN(b);
     if (execute) {
-      if (op==LEX_LSHIFT) a->var->setInt(a->var->getInt() << shift);
-      if (op==LEX_RSHIFT) a->var->setInt(a->var->getInt() >> shift);
-      if (op==LEX_RSHIFTUNSIGNED) a->var->setInt(((unsigned int)a->var->getInt()) >> shift);
+      // not in-place, as 'a' may be a variable (or a shared constant)
+      int res = 0;
+      if (op==LEX_LSHIFT) res = a->var->getInt() << shift;
+      if (op==LEX_RSHIFT) res = a->var->getInt() >> shift;
+      if (op==LEX_RSHIFTUNSIGNED) res = ((unsigned int)a->var->getInt()) >> shift;
+      CREATE_LINK(a, CScriptVar::constInt(res));
     }
   }
   return a;
@@ -1852,8 +4500,8 @@ CScriptVarLink *CTinyJS::logic(bool &execute) {
         b = condition(shortCircuit ? noexecute : execute);
         if (execute && !shortCircuit) {
             if (boolean) {
-              CScriptVar *newa = new CScriptVar(a->var->getBool());
-              CScriptVar *newb = new CScriptVar(b->var->getBool());
+              CScriptVar *newa = CScriptVar::constBool(a->var->getBool());
+              CScriptVar *newb = CScriptVar::constBool(b->var->getBool());
               CREATE_LINK(a, newa);
               CREATE_LINK(b, newb);
             }
@@ -1913,12 +4561,12 @@ CScriptVarLink *CTinyJS::base(bool &execute) {
         if (execute) {
             if (op=='=') {
                 lhs->replaceWith(rhs);
-            } else if (op==LEX_PLUSEQUAL) {
-                CScriptVar *res = lhs->var->mathsOp(rhs->var, '+');
-                lhs->replaceWith(res);
-            } else if (op==LEX_MINUSEQUAL) {
-                CScriptVar *res = lhs->var->mathsOp(rhs->var, '-');
-                lhs->replaceWith(res);
+            } else if (op==LEX_PLUSEQUAL || op==LEX_MINUSEQUAL) {
+                int mathsOp = op==LEX_PLUSEQUAL ? '+' : '-';
+                if (!lhs->var->mathsOpInPlace(rhs->var, mathsOp)) {
+                    CScriptVar *res = lhs->var->mathsOp(rhs->var, mathsOp);
+                    lhs->replaceWith(res);
+                }
             } else ASSERT(0);
         }
         CLEAN(rhs);
@@ -1944,6 +4592,60 @@ void CTinyJS::block(bool &execute) {
 
 }
 
+/** Check whether a for loop's condition and iterator are 'i<bound' and 'i++' (or '<=', or
+ * '>'/'>=' with 'i--'), where bound is an integer or a variable such as 'n' or 'a.length'.
+ * If so, return the counter's name, the comparison, and either the integer or a lexer for the bound */
+static bool isCountedLoop(CScriptLex *cond, CScriptLex *iter, string &counter, int &op, int &intBound, CScriptLex **boundLex) {
+    cond->reset();
+    if (cond->tk!=LEX_ID) return false;
+    counter = cond->tkStr;
+    cond->match(LEX_ID);
+    op = cond->tk;
+    if (op!='<' && op!=LEX_LEQUAL && op!='>' && op!=LEX_GEQUAL) return false;
+    cond->match(op);
+    int boundStart = cond->tokenStart;
+    bool isInt = cond->tk==LEX_INT;
+    if (isInt) {
+      long val = strtol(cond->tkStr.c_str(),0,0);
+      if (val<INT_MIN || val>INT_MAX) return false;
+      intBound = (int)val;
+      cond->match(LEX_INT);
+    } else {
+      if (cond->tk!=LEX_ID || cond->tkStr==counter) return false;
+      cond->match(LEX_ID);
+      while (cond->tk=='.') {
+        cond->match('.');
+        if (cond->tk!=LEX_ID) return false;
+        cond->match(LEX_ID);
+      }
+    }
+    if (cond->tk!=LEX_EOF) return false;
+
+    iter->reset();
+    if (iter->tk!=LEX_ID || iter->tkStr!=counter) return false;
+    iter->match(LEX_ID);
+    if (iter->tk!=((op=='<' || op==LEX_LEQUAL) ? LEX_PLUSPLUS : LEX_MINUSMINUS)) return false;
+    iter->match(iter->tk);
+    if (iter->tk!=LEX_EOF) return false;
+
+    if (!isInt) *boundLex = cond->getSubLex(boundStart);
+    return true;
+}
+
+/// Do counter++ (or counter--) if counter is an int, and return true if done
+static bool stepLoopCounter(CScriptVarLink *counter, bool increment) {
+    CScriptVar *v = counter->var;
+    if (!v->isInt()) return false;
+    int val = v->getInt();
+    if (increment ? val==INT_MAX : val==INT_MIN) return false; // will become a double
+    val += increment ? 1 : -1;
+    if (v->getRefs()==1 && !v->isConstant())
+      v->setInt(val);
+    else
+      counter->replaceWith(CScriptVar::constInt(val));
+    return true;
+}
+
 void CTinyJS::statement(bool &execute) {
     if (l->tk==LEX_ID ||
         l->tk==LEX_INT ||
@@ -1974,6 +4676,7 @@ void CTinyJS::statement(bool &execute) {
               l->match('.');
               if (execute) {
                   CScriptVarLink *lastA = a;
+                  makeWritable(lastA);
                   a = lastA->var->findChildOrCreate(l->tkStr);
               }
               l->match(LEX_ID);
@@ -2017,10 +4720,13 @@ void CTinyJS::statement(bool &execute) {
         l->match(')');
         int whileBodyStart = l->tokenStart;
         statement(loopCond ? execute : noexecute);
+        if (loopCond) loopCond = endLoopBody(execute);
         CScriptLex *whileBody = l->getSubLex(whileBodyStart);
         CScriptLex *oldLex = l;
-        int loopCount = TINYJS_LOOP_MAX_ITERATIONS;
-        while (loopCond && loopCount-->0) {
+        CScriptException *exception = 0;
+        try {
+          while (loopCond) {
+            limits.use();
             whileCond->reset();
             l = whileCond;
             cond = base(execute);
@@ -2030,17 +4736,16 @@ void CTinyJS::statement(bool &execute) {
                 whileBody->reset();
                 l = whileBody;
                 statement(execute);
+                loopCond = endLoopBody(execute);
             }
+          }
+        } catch (CScriptException *e) {
+          exception = e;
         }
         l = oldLex;
         delete whileCond;
         delete whileBody;
-
-        if (loopCount<=0) {
-            root->trace();
-            TRACE("WHILE Loop exceeded %d iterations at %s\n", TINYJS_LOOP_MAX_ITERATIONS, l->getPosition().c_str());
-            throw new CScriptException("LOOP_ERROR");
-        }
+        if (exception) exception->raise();
     } else if (l->tk==LEX_R_FOR) {
         l->match(LEX_R_FOR);
         l->match('(');
@@ -2059,40 +4764,190 @@ void CTinyJS::statement(bool &execute) {
         l->match(')');
         int forBodyStart = l->tokenStart;
         statement(loopCond ? execute : noexecute);
+        if (loopCond) loopCond = endLoopBody(execute);
         CScriptLex *forBody = l->getSubLex(forBodyStart);
         CScriptLex *oldLex = l;
-        if (loopCond) {
-            forIter->reset();
-            l = forIter;
-            CLEAN(base(execute));
-        }
-        int loopCount = TINYJS_LOOP_MAX_ITERATIONS;
-        while (execute && loopCond && loopCount-->0) {
-            forCond->reset();
-            l = forCond;
-            cond = base(execute);
-            loopCond = cond->var->getBool();
-            CLEAN(cond);
-            if (execute && loopCond) {
-                forBody->reset();
-                l = forBody;
-                statement(execute);
-            }
-            if (execute && loopCond) {
-                forIter->reset();
-                l = forIter;
-                CLEAN(base(execute));
-            }
+        CScriptLex *counterBoundLex = 0;
+        CScriptException *exception = 0;
+        try {
+          if (loopCond) {
+              forIter->reset();
+              l = forIter;
+              CLEAN(base(execute));
+          }
+          /* For loops like 'for (...; i<n; i++)', we can test and step the counter
+           * directly rather than parsing the condition and iterator each time. We
+           * check the counter is still an int every time, in case the body changed it */
+          CScriptVarLink *counter = 0;
+          string counterName;
+          int counterOp = 0;
+          int counterBound = 0;
+          if (execute && loopCond && isCountedLoop(forCond, forIter, counterName, counterOp, counterBound, &counterBoundLex))
+              counter = findInScopes(counterName);
+          while (execute && loopCond) {
+              limits.use();
+              if (counter && counter->var->isInt()) {
+                  CScriptVarLink *bound = 0;
+                  if (counterBoundLex) {
+                      counterBoundLex->reset();
+                      l = counterBoundLex;
+                      bound = base(execute);
+                  }
+                  if (!bound || bound->var->isInt()) {
+                      int a = counter->var->getInt();
+                      int b = bound ? bound->var->getInt() : counterBound;
+                      if (counterOp=='<') loopCond = a<b;
+                      else if (counterOp==LEX_LEQUAL) loopCond = a<=b;
+                      else if (counterOp=='>') loopCond = a>b;
+                      else loopCond = a>=b;
+                  } else {
+                      CScriptVar *res = counter->var->mathsOp(bound->var, counterOp);
+                      loopCond = res->getBool();
+                      if (!res->getRefs()) delete res;
+                  }
+                  CLEAN(bound);
+              } else {
+                  forCond->reset();
+                  l = forCond;
+                  cond = base(execute);
+                  loopCond = cond->var->getBool();
+                  CLEAN(cond);
+              }
+              if (execute && loopCond) {
+                  forBody->reset();
+                  l = forBody;
+                  statement(execute);
+                  loopCond = endLoopBody(execute);
+              }
+              if (execute && loopCond &&
+                  !(counter && stepLoopCounter(counter, counterOp=='<' || counterOp==LEX_LEQUAL))) {
+                  forIter->reset();
+                  l = forIter;
+                  CLEAN(base(execute));
+              }
+          }
+        } catch (CScriptException *e) {
+          exception = e;
         }
         l = oldLex;
         delete forCond;
         delete forIter;
         delete forBody;
-        if (loopCount<=0) {
-            root->trace();
-            TRACE("FOR Loop exceeded %d iterations at %s\n", TINYJS_LOOP_MAX_ITERATIONS, l->getPosition().c_str());
-            throw new CScriptException("LOOP_ERROR");
+        delete counterBoundLex;
+        if (exception) exception->raise();
+    } else if (l->tk==LEX_R_DO) {
+        l->match(LEX_R_DO);
+        int doBodyStart = l->tokenStart;
+        bool noexecute = false;
+        bool loopCond = execute;
+        statement(execute);
+        if (loopCond) loopCond = endLoopBody(execute);
+        CScriptLex *doBody = l->getSubLex(doBodyStart);
+        l->match(LEX_R_WHILE);
+        l->match('(');
+        int doCondStart = l->tokenStart;
+        CScriptVarLink *cond = base(loopCond ? execute : noexecute);
+        loopCond = loopCond && cond->var->getBool();
+        CLEAN(cond);
+        CScriptLex *doCond = l->getSubLex(doCondStart);
+        l->match(')');
+        l->match(';');
+        CScriptLex *oldLex = l;
+        CScriptException *exception = 0;
+        try {
+          while (loopCond) {
+            limits.use();
+            doBody->reset();
+            l = doBody;
+            statement(execute);
+            loopCond = endLoopBody(execute);
+            if (loopCond) {
+                doCond->reset();
+                l = doCond;
+                cond = base(execute);
+                loopCond = cond->var->getBool();
+                CLEAN(cond);
+            }
+          }
+        } catch (CScriptException *e) {
+          exception = e;
+        }
+        l = oldLex;
+        delete doBody;
+        delete doCond;
+        if (exception) exception->raise();
+    } else if (l->tk==LEX_R_SWITCH) {
+        l->match(LEX_R_SWITCH);
+        l->match('(');
+        CScriptVarLink *value = base(execute);
+        l->match(')');
+        if (!execute) {
+          CLEAN(value);
+          block(execute);
+        } else {
+          /* Look up which case to start at, then run code until the end
+           * (falling through other cases) or until 'break' */
+          const SwitchTable &table = getSwitchTable();
+          int start = table.defaultPos;
+          int end = table.endPos;
+          if (table.constant) {
+            if (value->var->isInt()) {
+              std::unordered_map<int, int>::const_iterator it = table.intCases.find(value->var->getInt());
+              if (it != table.intCases.end()) start = it->second;
+            } else if (value->var->isString()) {
+              std::unordered_map<string, int>::const_iterator it = table.stringCases.find(value->var->getString());
+              if (it != table.stringCases.end()) start = it->second;
+            }
+          } else {
+            // case expressions could do anything, so evaluate them in order
+            std::vector<std::pair<int, int> > cases = table.cases;
+            for (size_t i=0;i<cases.size();i++) {
+              l->seek(cases[i].first);
+              CScriptVarLink *caseValue = base(execute);
+              CScriptVar *res = value->var->mathsOp(caseValue->var, LEX_TYPEEQUAL);
+              bool match = res->getBool();
+              if (!res->getRefs()) delete res;
+              CLEAN(caseValue);
+              if (match) {
+                start = cases[i].second;
+                break;
+              }
+            }
+          }
+          CLEAN(value);
+          if (start>=0) {
+            l->seek(start);
+            bool noexecute = false;
+            while (execute && l->tk && l->tk!='}') {
+              if (l->tk==LEX_R_CASE) {
+                l->match(LEX_R_CASE);
+                CLEAN(base(noexecute));
+                l->match(':');
+              } else if (l->tk==LEX_R_DEFAULT) {
+                l->match(LEX_R_DEFAULT);
+                l->match(':');
+              } else
+                statement(execute);
+            }
+            // 'continue' and 'return' are for whatever we're in
+            if (!execute && loopControl==LOOP_BREAK) {
+              loopControl = LOOP_NONE;
+              execute = true;
+            }
+          }
+          l->seek(end);
+          l->match('}');
+        }
+    } else if (l->tk==LEX_R_BREAK || l->tk==LEX_R_CONTINUE) {
+        /* Stop executing like 'return' does - the loop we're in will see
+         * loopControl when its body finishes and stop or carry on */
+        int tk = l->tk;
+        l->match(tk);
+        if (execute) {
+          loopControl = tk==LEX_R_BREAK ? LOOP_BREAK : LOOP_CONTINUE;
+          execute = false;
         }
+        l->match(';');
     } else if (l->tk==LEX_R_RETURN) {
         l->match(LEX_R_RETURN);
         CScriptVarLink *result = 0;
@@ -2120,6 +4975,78 @@ void CTinyJS::statement(bool &execute) {
     } else l->match(LEX_EOF);
 }
 
+const CTinyJS::SwitchTable &CTinyJS::getSwitchTable() {
+    std::pair<CScriptSource*, int> key(l->getSource(), l->tokenStart);
+    std::map<std::pair<CScriptSource*, int>, SwitchTable>::iterator it = switchTables.find(key);
+    if (it != switchTables.end()) return it->second;
+
+    if (switchTables.size() >= TINYJS_SWITCH_CACHE_SIZE) clearSwitchTables();
+    SwitchTable table;
+    table.constant = true;
+    table.defaultPos = -1;
+    bool noexecute = false;
+    l->match('{');
+    while (l->tk && l->tk!='}') {
+      if (l->tk==LEX_R_CASE) {
+        l->match(LEX_R_CASE);
+        int caseStart = l->tokenStart;
+        // is this just an integer or string?
+        bool negate = l->tk=='-';
+        if (negate) l->match('-');
+        int tk = l->tk;
+        string str = l->tkStr;
+        long val = strtol(str.c_str(),0,0);
+        bool isConstant = false;
+        if (tk==LEX_STR || (tk==LEX_INT && val>=INT_MIN && val<=INT_MAX)) {
+          l->match(tk);
+          isConstant = l->tk==':' && (tk==LEX_INT || !negate);
+        }
+        if (!isConstant) {
+          table.constant = false;
+          l->seek(caseStart);
+          CLEAN(base(noexecute));
+        }
+        l->match(':');
+        // if a value is used twice, the first case is the one that gets run
+        if (isConstant && tk==LEX_INT)
+          table.intCases.insert(std::make_pair((int)(negate ? -val : val), l->tokenStart));
+        if (isConstant && tk==LEX_STR)
+          table.stringCases.insert(std::make_pair(str, l->tokenStart));
+        table.cases.push_back(std::make_pair(caseStart, l->tokenStart));
+      } else if (l->tk==LEX_R_DEFAULT) {
+        l->match(LEX_R_DEFAULT);
+        l->match(':');
+        if (table.defaultPos<0) table.defaultPos = l->tokenStart;
+      } else
+        statement(noexecute);
+    }
+    table.endPos = l->tokenStart;
+    key.first->ref();
+    return switchTables[key] = table;
+}
+
+void CTinyJS::clearSwitchTables() {
+    std::map<std::pair<CScriptSource*, int>, SwitchTable>::iterator it;
+    for (it = switchTables.begin(); it != switchTables.end(); ++it)
+      it->first.first->unref();
+    switchTables.clear();
+}
+
+bool CTinyJS::endLoopBody(bool &execute) {
+    if (loopControl==LOOP_NONE) return execute; // stopped by 'return'?
+    bool carryOn = loopControl==LOOP_CONTINUE;
+    loopControl = LOOP_NONE;
+    execute = true;
+    return carryOn;
+}
+
+void CTinyJS::checkLoopControl() {
+    if (loopControl!=LOOP_NONE) {
+      loopControl = LOOP_NONE;
+      throw new CScriptException("'break' or 'continue' used outside of a loop");
+    }
+}
+
 /// Get the given variable specified by a path (var1.var2.etc), or return 0
 CScriptVar *CTinyJS::getScriptVariable(const string &path) {
     // traverse path
@@ -2129,6 +5056,7 @@ CScriptVar *CTinyJS::getScriptVariable(const string &path) {
     CScriptVar *var = root;
     while (var && prevIdx<path.length()) {
         string el = path.substr(prevIdx, thisIdx-prevIdx);
+        if (var==root) createNatives(el);
         CScriptVarLink *varl = var->findChild(el);
         var = varl?varl->var:0;
         prevIdx = thisIdx+1;
@@ -2150,7 +5078,24 @@ const string *CTinyJS::getVariable(const string &path) {
 
 /// set the value of the given variable, return trur if it exists and gets set
 bool CTinyJS::setVariable(const std::string &path, const std::string &varData) {
-    CScriptVar *var = getScriptVariable(path);
+    // find the link, making our own copy of any shared constants on the way (see freezeBuiltins)
+    size_t prevIdx = 0;
+    size_t thisIdx = path.find('.');
+    if (thisIdx == string::npos) thisIdx = path.length();
+    createNatives(path.substr(0, thisIdx));
+    CScriptVarLink *link = root->findChild(path.substr(0, thisIdx));
+    while (link && thisIdx<path.length()) {
+        makeWritable(link);
+        prevIdx = thisIdx+1;
+        thisIdx = path.find('.', prevIdx);
+        if (thisIdx == string::npos) thisIdx = path.length();
+        link = link->var->findChild(path.substr(prevIdx, thisIdx-prevIdx));
+    }
+    CScriptVar *var = 0;
+    if (link) {
+        makeWritable(link);
+        var = link->var;
+    }
     // return result
     if (var) {
         if (var->isInt())
@@ -2171,15 +5116,39 @@ CScriptVarLink *CTinyJS::findInScopes(const std::string &childName) {
       CScriptVarLink *v = scopes[s]->findChild(childName);
       if (v) return v;
     }
+    // functions from addNatives are only created when they're first looked up
+    if (!lazyNames.empty() && createNatives(childName))
+      return root->findChild(childName);
     return NULL;
 
 }
 
 /// Look up in any parent classes of the given object
 CScriptVarLink *CTinyJS::findInParentClasses(CScriptVar *object, const std::string &name) {
+    if (methodCacheEpoch != memory->classEpoch || methodCache.size() > TINYJS_METHOD_CACHE_SIZE) {
+      methodCache.clear();
+      methodCacheEpoch = memory->classEpoch;
+    }
+    // Which classes we search depend only on the first class and whether we're a string or array
+    MethodCacheKey key;
+    CScriptVarLink *parentClass = object->findChild(TINYJS_PROTOTYPE_CLASS);
+    key.firstClass = parentClass ? parentClass->var : 0;
+    key.kind = object->isString() ? SCRIPTVAR_STRING : (object->isArray() ? SCRIPTVAR_ARRAY : 0);
+    key.name = name;
+    std::unordered_map<MethodCacheKey, CScriptVarLink*, MethodCacheHash>::iterator it = methodCache.find(key);
+    if (it != methodCache.end()) return it->second;
+
+    CScriptVarLink *implementation = findInParentClassesUncached(object, name);
+    methodCache[key] = implementation;
+    return implementation;
+}
+
+CScriptVarLink *CTinyJS::findInParentClassesUncached(CScriptVar *object, const std::string &name) {
     // Look for links to actual parent classes
     CScriptVarLink *parentClass = object->findChild(TINYJS_PROTOTYPE_CLASS);
     while (parentClass) {
+      // once we've looked in a class, changes to it must invalidate methodCache
+      parentClass->var->makeClass();
       CScriptVarLink *implementation = parentClass->var->findChild(name);
       if (implementation) return implementation;
       parentClass = parentClass->var->findChild(TINYJS_PROTOTYPE_CLASS);
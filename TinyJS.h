@@ -41,13 +41,35 @@
 #endif
 #include <string>
 #include <vector>
+#include <chrono>
+#include <atomic>
+#include <unordered_map>
+#include <map>
+#include <set>
 
 #ifndef TRACE
 #define TRACE printf
 #endif // TRACE
 
 
-const int TINYJS_LOOP_MAX_ITERATIONS = 8192;
+/* The amount of fuel used between checks of the time limit (see CScriptLimits) */
+const int TINYJS_TIME_CHECK_INTERVAL = 1024;
+/* Integers in this range are preallocated as shared constants
+ * (see CScriptVar::constInt) rather than allocated each time */
+const int TINYJS_SMALL_INT_MIN = -128;
+const int TINYJS_SMALL_INT_MAX = 1023;
+/* The maximum number of method lookups CTinyJS caches before it starts again */
+const size_t TINYJS_METHOD_CACHE_SIZE = 4096;
+/* The maximum number of arguments an intrinsic function can take */
+const int TINYJS_INTRINSIC_MAX_ARGS = 4;
+// maximum number of arguments a native function in a descriptor table can name (see CTinyJS::addNatives)
+const int TINYJS_NATIVE_DESC_MAX_ARGS = 4;
+/* The maximum number of switch statements CTinyJS keeps the cases of before it starts again */
+const size_t TINYJS_SWITCH_CACHE_SIZE = 256;
+/* The size of the stack each CScriptTask runs on by default - the same as a thread usually gets, as
+ * each call in a script uses a few KB of it. Pages of it are only allocated as they are used, so a
+ * task that doesn't recurse far costs much less */
+const size_t TINYJS_TASK_STACK_SIZE = 8*1024*1024;
 
 enum LEX_TYPES {
     LEX_EOF = 0,
@@ -93,6 +115,9 @@ enum LEX_TYPES {
     LEX_R_NULL,
     LEX_R_UNDEFINED,
     LEX_R_NEW,
+    LEX_R_SWITCH,
+    LEX_R_CASE,
+    LEX_R_DEFAULT,
 
 	LEX_R_LIST_END /* always the last entry */
 };
@@ -108,6 +133,10 @@ enum SCRIPTVAR_FLAGS {
     SCRIPTVAR_NULL        = 64, // it seems null is its own data type
 
     SCRIPTVAR_NATIVE      = 128, // to specify this is a native function
+    SCRIPTVAR_CONSTANT    = 256, // a shared, immutable value that is never freed
+    SCRIPTVAR_CLASS       = 512, // used as a class/prototype, so changes must invalidate cached method lookups
+    SCRIPTVAR_BASELINE    = 1024, // unchanged since CTinyJS::markBaseline, so what it was must be saved before it changes
+    SCRIPTVAR_FROZEN      = 2048, // a constant shared by CTinyJS::freezeBuiltins, which each CTinyJS copies before changing
     SCRIPTVAR_NUMERICMASK = SCRIPTVAR_NULL |
                             SCRIPTVAR_DOUBLE |
                             SCRIPTVAR_INTEGER,
@@ -121,6 +150,13 @@ enum SCRIPTVAR_FLAGS {
 
 };
 
+/// Why a loop body stopped executing early
+enum LOOP_CONTROL {
+    LOOP_NONE,     // it didn't (or it was 'return', which loops just stop for)
+    LOOP_BREAK,
+    LOOP_CONTINUE,
+};
+
 #define TINYJS_RETURN_VAR "return"
 #define TINYJS_PROTOTYPE_CLASS "prototype"
 #define TINYJS_TEMP_NAME ""
@@ -133,6 +169,93 @@ class CScriptException {
 public:
     std::string text;
     CScriptException(const std::string &exceptionText);
+    virtual ~CScriptException() {}
+    virtual void raise() { throw this; } ///< Throw this (again), as the type it really is
+};
+
+/// Thrown when a script goes over the limits set with CTinyJS::setFuelLimit or setTimeLimit
+class CScriptLimitException : public CScriptException {
+public:
+    CScriptLimitException(const std::string &exceptionText) : CScriptException(exceptionText) {}
+    void raise() { throw this; }
+};
+
+class CScriptLimits;
+class CScriptBaseline;
+class CScriptTask;
+
+/** Counts the bytes used by the variables, links, sources and lexers belonging to one CTinyJS.
+ * Everything allocated while this is CScriptMemory::current is charged to it, and keeps a
+ * reference to it so that the bytes are given back when it is freed (even if that happens
+ * after the CTinyJS has gone) */
+class CTinyJS;
+
+class CScriptMemory {
+public:
+    CScriptMemory();
+
+    size_t used; ///< Bytes in use now
+    size_t peak; ///< The most bytes that have been in use at once
+    size_t limit; ///< If more than this is used, scripts are stopped with a CScriptLimitException (0 for no limit)
+    CScriptLimits *limits; ///< The limits that stop scripts when we go over our limit (0 if there are none)
+    CScriptBaseline *baseline; ///< Where changes to our variables are saved (see CTinyJS::markBaseline), or 0
+    CTinyJS *engine; ///< The CTinyJS whose memory we count, or 0 once it has been deleted
+    unsigned int classEpoch; ///< Incremented whenever a class charged to us changes - our engine's cached method lookups are only valid for one epoch
+
+    void allocate(size_t bytes) { used += bytes; if (used>peak) peak = used; if (limit && used>limit) exceeded(); }
+    void free(size_t bytes) { used -= bytes; }
+    bool isExceeded() { return limit && used>limit; }
+
+    CScriptMemory *ref(); ///< Add reference to this
+    void unref(); ///< Remove a reference, and delete this if required
+
+    /// Charge bytes to the current CScriptMemory, returning it (with a reference added) or 0 if there is none
+    static CScriptMemory *charge(size_t bytes);
+    /// Give back bytes charged by charge(), and remove the reference it added
+    static void release(CScriptMemory *memory, size_t bytes) { if (memory) { memory->free(bytes); memory->unref(); } }
+    /// A class charged to owner (which may be 0) changed, so cached lookups by its engine and whichever one is running now must go
+    static void classChanged(CScriptMemory *owner) { if (owner) owner->classEpoch++; if (current && current!=owner) current->classEpoch++; }
+    /// Where allocations are being charged to right now on this thread, or 0 if they aren't being counted
+    static thread_local CScriptMemory *current;
+protected:
+    int refs;
+    void exceeded();
+};
+
+/// A token read by CScriptLex, as stored in a precompiled CScriptSource
+struct CScriptPrecompiledToken {
+    int tk;
+    int start; ///< CScriptLex::tokenStart for this token
+    int end; ///< CScriptLex::tokenEnd for this token
+    int str; ///< Index of CScriptLex::tkStr in CScriptSource::strings, or -1 if it's empty
+};
+
+/// Immutable, reference counted source text. Lexers and the functions defined in them share this rather than copying it
+class CScriptSource
+{
+public:
+    CScriptSource(const std::string &code);
+
+    const char *getData() { return code.c_str(); }
+    int getLength() { return (int)code.length(); }
+
+    CScriptSource *ref(); ///< Add reference to this source
+    void unref(); ///< Remove a reference, and delete this source if required
+
+    /** Set the tokens of the whole source (ending with LEX_EOF), so that lexers can read these
+     * rather than lexing the code. See CTinyJS::precompile */
+    void setPrecompiled(std::vector<CScriptPrecompiledToken> &tokens, std::vector<std::string> &strings, std::vector<int> &newlines);
+    bool isPrecompiled() { return !tokens.empty(); }
+
+    std::vector<CScriptPrecompiledToken> tokens; ///< If precompiled, every token in the source
+    std::vector<std::string> strings; ///< If precompiled, the tkStr of the tokens
+    std::vector<int> newlines; ///< If precompiled, the position of each newline in the source
+protected:
+    std::string code;
+    int refs;
+    CScriptMemory *memory; ///< What our size is charged to
+    size_t getPrecompiledSize(); ///< Bytes used by tokens, strings and newlines
+    ~CScriptSource();
 };
 
 class CScriptLex
@@ -140,6 +263,7 @@ class CScriptLex
 public:
     CScriptLex(const std::string &input);
     CScriptLex(CScriptLex *owner, int startChar, int endChar);
+    CScriptLex(CScriptSource *source, int startChar, int endChar);
     ~CScriptLex(void);
 
     char currCh, nextCh;
@@ -152,29 +276,59 @@ public:
     void match(int expected_tk); ///< Lexical match wotsit
     static std::string getTokenStr(int token); ///< Get the string representation of the given token
     void reset(); ///< Reset this lex so we can start again
+    void seek(int position); ///< Carry on getting tokens from the given position in the data
 
+    int getSubEnd(); ///< Return the position just after the last token, which is where getSubString/getSubLex end
     std::string getSubString(int pos); ///< Return a sub-string from the given position up until right now
     CScriptLex *getSubLex(int lastPosition); ///< Return a sub-lexer from the given position up until right now
 
     std::string getPosition(int pos=-1); ///< Return a string representing the position in lines and columns of the character pos given
+    CScriptSource *getSource() { return source; } ///< The source this lexer is reading from
 
 protected:
     /* When we go into a loop, we use getSubLex to get a lexer for just the sub-part of the
-       relevant string. This doesn't re-allocate and copy the string, but instead copies
-       the data pointer and sets dataOwned to false, and dataStart/dataEnd to the relevant things. */
-    char *data; ///< Data string to get tokens from
+       relevant string. This doesn't re-allocate and copy the string, but instead references
+       the same CScriptSource and sets dataStart/dataEnd to the relevant things. */
+    CScriptSource *source; ///< The (shared) source we get tokens from
+    const char *data; ///< Data string to get tokens from
     int dataStart, dataEnd; ///< Start and end position in data string
-    bool dataOwned; ///< Do we own this data string?
 
     int dataPos; ///< Position in data (we CAN go past the end of the string here)
+    CScriptMemory *memory; ///< What our size is charged to
 
     void getNextCh();
     void getNextToken(); ///< Get the text token from our text string
+
+    int tokenIndex; ///< If our source is precompiled, the index of the next token in it
+    void getNextPrecompiledToken(); ///< getNextToken for precompiled sources
 };
 
 class CScriptVar;
+class CScriptCompiledFunction;
+struct CScriptBinaryReader;
 
 typedef void (*JSCallback)(CScriptVar *var, void *userdata);
+/** A native function that is called directly with the values of its arguments (in the order
+ * they were declared) and without a 'this'. Return the result - a new var, or a shared constant */
+typedef CScriptVar *(*JSIntrinsic)(CScriptVar **args);
+
+/// A native function in a table for CTinyJS::addNatives, eg. { "String.substring", { "lo", "hi" }, scStringSubstring }
+struct CScriptNativeDesc {
+  const char *path; ///< Where the function goes - names separated by dots
+  const char *args[TINYJS_NATIVE_DESC_MAX_ARGS]; ///< The names of its arguments, the unused ones being 0
+  JSCallback callback;
+};
+/// An intrinsic function in a table for CTinyJS::addIntrinsics, eg. { "Math.sin", { "a" }, scMathSin }
+struct CScriptIntrinsicDesc {
+  const char *path; ///< Where the function goes - names separated by dots
+  const char *args[TINYJS_NATIVE_DESC_MAX_ARGS]; ///< The names of its arguments, the unused ones being 0
+  JSIntrinsic intrinsic;
+};
+/// A number in a table for CTinyJS::addConstants, eg. { "Math.PI", 3.14159265358979323846 }
+struct CScriptConstantDesc {
+  const char *path; ///< Where the constant goes - names separated by dots
+  double value;
+};
 
 class CScriptVarLink
 {
@@ -184,14 +338,30 @@ public:
   CScriptVarLink *prevSibling;
   CScriptVar *var;
   bool owned;
+  bool baseline; ///< Unchanged since CTinyJS::markBaseline
+  bool baselineSaved; ///< Changed since CTinyJS::markBaseline, and what we were is saved in memory->baseline
+  CScriptMemory *memory; ///< What our size is charged to
 
   CScriptVarLink(CScriptVar *var, const std::string &name = TINYJS_TEMP_NAME);
   CScriptVarLink(const CScriptVarLink &link); ///< Copy constructor
   ~CScriptVarLink();
   void replaceWith(CScriptVar *newVar); ///< Replace the Variable pointed to
   void replaceWith(CScriptVarLink *newVar); ///< Replace the Variable pointed to (just dereferences)
+  void makeWritable(); ///< If we point to a shared constant, replace it with a private copy that can be modified
   int getIntName(); ///< Get the name as an integer (for arrays)
   void setIntName(int n); ///< Set the name as an integer (for arrays)
+
+  void changing() { if (baseline) saveBaseline(); } ///< Call before changing var or name, so that resetToBaseline can undo it
+protected:
+  void saveBaseline();
+};
+
+/// What CScriptVar::clone has copied so far
+struct CScriptCloner {
+    std::unordered_map<CScriptVar*, CScriptVar*> vars; ///< original -> copy, so variables that were shared stay shared
+    std::unordered_map<CScriptSource*, CScriptSource*> sources; ///< original -> copy of function bodies' source
+    void *oldUserData; ///< Native functions with this userdata...
+    void *newUserData; ///< ... get this instead
 };
 
 /// Variable class (containing a doubly-linked list of children)
@@ -205,6 +375,15 @@ public:
     CScriptVar(int val);
     ~CScriptVar(void);
 
+    /* Shared, immutable values. These are never freed and must never be modified -
+     * use CScriptVarLink::makeWritable or deepCopy() to get a copy that can be. */
+    static CScriptVar *constUndefined();
+    static CScriptVar *constNull();
+    static CScriptVar *constBool(bool val) { return constInt(val ? 1 : 0); }
+    static CScriptVar *constInt(int val); ///< A shared constant if val is small, or a new variable if not
+    /// What a native function returns (with setReturnVar) when its result will come later - see CScriptTask
+    static CScriptVar *constPending();
+
     CScriptVar *getReturnVar(); ///< If this is a function, get the result value (for use by native functions)
     void setReturnVar(CScriptVar *var); ///< Set the result value. Use this when setting complex return data as it avoids a deepCopy()
     CScriptVar *getParameter(const std::string &name); ///< If this is a function, get the parameter with the given name (for use by native functions)
@@ -244,16 +423,35 @@ public:
     bool isNative() { return (flags&SCRIPTVAR_NATIVE)!=0; }
     bool isUndefined() { return (flags & SCRIPTVAR_VARTYPEMASK) == SCRIPTVAR_UNDEFINED; }
     bool isNull() { return (flags & SCRIPTVAR_NULL)!=0; }
+    bool isConstant() { return (flags & SCRIPTVAR_CONSTANT)!=0; }
+    bool isFrozen() { return (flags & SCRIPTVAR_FROZEN)!=0; }
+    bool isClass() { return (flags & SCRIPTVAR_CLASS)!=0; }
     bool isBasic() { return firstChild==0; } ///< Is this *not* an array/object/etc
 
     CScriptVar *mathsOp(CScriptVar *b, int op); ///< do a maths op with another script variable
+    bool mathsOpInPlace(CScriptVar *b, int op); ///< do '+' or '-' storing the result in this variable. Only done if nothing else references us - returns false if not done
     void copyValue(CScriptVar *val); ///< copy the value from the value given
     CScriptVar *deepCopy(); ///< deep copy this node and return the result
+    /** Copy this and everything it references (including prototypes and function source), so that
+     * the copy shares nothing with the original except constants. Variables referenced from more than
+     * one place (or from themselves) are only copied once. */
+    CScriptVar *clone(CScriptCloner &cloner);
+    /** Append this and everything it references to out, in a flat form that deserialize() turns back into a
+     * copy - which can be in another CTinyJS, on another thread. Objects referenced more than once (or from
+     * themselves) are written once, so the copy shares them in the same way. As with a structured clone,
+     * prototypes aren't written, and functions can't be - a CScriptException is thrown for them. */
+    void serialize(std::string &out);
+    /** Create a copy of the variable that serialize() wrote to data, with a reference that the caller
+     * must remove. Throws a CScriptException if data isn't valid. */
+    static CScriptVar *deserialize(const std::string &data);
 
     void trace(std::string indentStr = "", const std::string &name = ""); ///< Dump out the contents of this using trace
     std::string getFlagsAsString(); ///< For debugging - just dump a string version of the flags
     void getJSON(std::ostringstream &destination, const std::string linePrefix=""); ///< Write out all the JS code needed to recreate this script variable to the stream (as JSON)
     void setCallback(JSCallback callback, void *userdata); ///< Set the callback for native functions
+    void setIntrinsic(JSIntrinsic intrinsic, int argCount); ///< Set the callback for intrinsic native functions, and how many arguments it takes
+    void setFunctionSource(CScriptSource *source, int start, int end); ///< Set the body of a function as a span of shared source (0 to clear)
+    CScriptLex *getFunctionLex(); ///< Create a lexer for the body of this function
 
     CScriptVarLink *firstChild;
     CScriptVarLink *lastChild;
@@ -265,38 +463,224 @@ public:
     void setUserCustomData(void *);
     void *getUserCustomData();
 
+    /// Note that this is used as a class, so changes to it invalidate method caches (constants never change, so needn't be)
+    void makeClass() { if (!(flags & (SCRIPTVAR_CLASS|SCRIPTVAR_CONSTANT))) flags |= SCRIPTVAR_CLASS; }
+    void classChanged() { if (isClass()) CScriptMemory::classChanged(memory); } ///< Call before changing which children we have
+    void changing() { if (flags & SCRIPTVAR_BASELINE) saveBaseline(); } ///< Call before changing this, so that resetToBaseline can undo it
+
 protected:
     int refs; ///< The number of references held to this - used for garbage collection
 
     std::string data; ///< The contents of this variable if it is a string
+    CScriptSource *sourceData; ///< The source containing this function's body, if it is a function
+    int sourceStart, sourceEnd; ///< Span of the function's body in sourceData
     void *userCustomData;
     long intData; ///< The contents of this variable if it is an int
     double doubleData; ///< The contents of this variable if it is a double
     int flags; ///< the flags determine the type of the variable - int/double/string/etc
     JSCallback jsCallback; ///< Callback for native functions
     void *jsCallbackUserData; ///< user data passed as second argument to native functions
+    JSIntrinsic jsIntrinsic; ///< Callback for intrinsic functions, which are called without a scope
+    int intrinsicArgs; ///< The number of arguments jsIntrinsic takes (scripts can add other children to the function)
+    int callCount; ///< If this is a function, the number of times it has been called (until it is compiled)
+    CScriptCompiledFunction *compiled; ///< If this is a function that has been compiled, the result (which may not be valid)
+    CScriptMemory *memory; ///< What our size is charged to
+    size_t chargedData; ///< The capacity of data that has been charged to memory
+    void chargeData(); ///< Charge memory for any change in the capacity of data
 
     void init(); ///< initialisation of data members
+    CScriptVar *makeConstant(); ///< Make this a shared constant that is never freed
+    void freeze(std::vector<CScriptVar*> &frozen); ///< Make this and its children constants, adding them to frozen (see CTinyJS::freezeBuiltins)
+    CScriptVar *writableCopy(); ///< A copy of this constant that can be modified - its children are shared until they are made writable too
+    void saveBaseline(); ///< Save what we are now in memory->baseline, as we're about to change
+    void copyCallbacks(CScriptVar *val); ///< Use the same native function as val
 
     /** Copy the basic data and flags from the variable given, with no
       * children. Should be used internally only - by copyValue and deepCopy */
     void copySimpleData(CScriptVar *val);
 
+    void serialize(std::string &out, std::unordered_map<CScriptVar*, int> &written); ///< written has the index of each object written so far
+    static CScriptVar *deserialize(CScriptBinaryReader &reader, std::vector<CScriptVar*> &read); ///< read has each object read so far (with a reference)
+
     friend class CTinyJS;
+    friend class CScriptVarLink;
+    friend class CScriptBaseline;
+};
+
+/** The variables made constant by CTinyJS::freezeBuiltins. These are shared by all the copies of the
+ * CTinyJS they were frozen in (even on different threads), and freed along with the last of them */
+class CScriptFrozenVars {
+public:
+    CScriptFrozenVars();
+    std::vector<CScriptVar*> vars;
+
+    CScriptFrozenVars *ref(); ///< Add reference to this
+    void unref(); ///< Remove a reference, and delete this (and vars) if required
+protected:
+    std::atomic<int> refs;
+    ~CScriptFrozenVars();
 };
 
+/** What has changed since CTinyJS::markBaseline. The variables and links that were reachable then are
+ * marked, and the first time each one changes, what it was is saved here so that restore() can put it back */
+class CScriptBaseline {
+public:
+    ~CScriptBaseline();
+
+    void saveVar(CScriptVar *var); ///< Save var, which has SCRIPTVAR_BASELINE set and is about to change
+    void saveLink(CScriptVarLink *link); ///< Save link, which is in the baseline and is about to change
+    void forgetLink(CScriptVarLink *link); ///< link has been saved, but is being deleted
+    void restore(); ///< Put back everything that has been saved, which is then marked as in the baseline again
+protected:
+    /// Each variable that has changed (with a reference), and a copy of what it was - whose children are what it had
+    std::vector<std::pair<CScriptVar*, CScriptVar*> > vars;
+    /// Each link that has changed, and the variable (with a reference) and name it had
+    std::unordered_map<CScriptVarLink*, std::pair<CScriptVar*, std::string> > links;
+};
+
+/// A number (or undefined) held by value, so that maths on numbers doesn't need CScriptVars
+struct CScriptNumber {
+    int type; ///< SCRIPTVAR_UNDEFINED, SCRIPTVAR_INTEGER or SCRIPTVAR_DOUBLE
+    int intData;
+    double doubleData;
+
+    CScriptNumber() : type(SCRIPTVAR_UNDEFINED), intData(0), doubleData(0) {}
+    static CScriptNumber makeInt(int val) { CScriptNumber n; n.type = SCRIPTVAR_INTEGER; n.intData = val; return n; }
+    static CScriptNumber makeDouble(double val) { CScriptNumber n; n.type = SCRIPTVAR_DOUBLE; n.doubleData = val; return n; }
+    static CScriptNumber fromVar(CScriptVar *v); ///< Only valid if v is undefined, null, an int or a double
+
+    int getInt() const { return type==SCRIPTVAR_DOUBLE ? (int)doubleData : intData; }
+    double getDouble() const { return type==SCRIPTVAR_DOUBLE ? doubleData : intData; }
+    bool getBool() const { return getInt() != 0; }
+    CScriptNumber mathsOp(const CScriptNumber &b, int op) const; ///< The same as CScriptVar::mathsOp
+    CScriptVar *toVar() const;
+};
+
+/** Counts the work scripts do - each loop iteration and function call uses one unit of
+ * fuel - and throws CScriptLimitException if it goes over the limits that have been set */
+class CScriptLimits {
+public:
+    CScriptLimits();
+
+    long long fuelLimit; ///< The most fuel that can be used, or 0 for no limit
+    int timeLimit; ///< The most time that can be taken in milliseconds, or 0 for no limit
+    long long fuelUsed; ///< Fuel used since start()
+    CScriptMemory *memory; ///< Memory used by the scripts we limit (0 if it isn't counted)
+
+    void start(); ///< Start counting fuel and time from now
+    void use() { if (++fuelUsed >= nextCheck) check(); } ///< Use one unit of fuel
+protected:
+    long long nextCheck; ///< When fuelUsed gets to this, we must check the limits
+    std::chrono::steady_clock::time_point deadline;
+    void check();
+    void setNextCheck();
+    friend class CScriptMemory;
+    void checkSoon() { nextCheck = fuelUsed+1; } ///< Check the limits when the next unit of fuel is used
+};
+
+struct CScriptCompiledNode;
+
+/** A function body compiled into a tree of CScriptCompiledNodes. This is only possible if the
+ * function just does arithmetic, comparisons, ifs and loops on numbers in its parameters and
+ * local variables - isValid() returns false otherwise. It's then run without a lexer, scopes
+ * or any CScriptVars. See CTinyJS::setCompileThreshold */
+class CScriptCompiledFunction {
+public:
+    CScriptCompiledFunction(CScriptVar *function);
+    ~CScriptCompiledFunction();
+
+    bool isValid() { return body!=0; }
+    int getParameterCount() { return parameterCount; }
+    static bool canCallWith(CScriptVar *arg); ///< Can this be passed as an argument (is it a number or undefined)?
+    CScriptVar *call(CScriptVar **args, CScriptLimits *limits); ///< Run the function with the given arguments, and return the result
+
+protected:
+    CScriptCompiledNode *body;
+    int parameterCount;
+    std::vector<std::string> localNames; ///< The name of each local variable (parameters first)
+    std::vector<CScriptCompiledNode*> nodes; ///< Every node we allocated
+    std::vector<CScriptNumber> locals; ///< Values of local variables while running
+    CScriptNumber result; ///< Value given to 'return'
+    CScriptLimits *limits; ///< Limits of the CTinyJS we're being run by
+
+    // compiling
+    CScriptLex *l;
+    std::vector<int> declared; ///< Local variables that will definitely have been declared at this point in the code
+    int addLocal(const std::string &name);
+    int findDeclaredLocal(const std::string &name);
+    CScriptCompiledNode *newNode(int kind, CScriptCompiledNode *a=0, CScriptCompiledNode *b=0);
+    CScriptCompiledNode *compileStatement();
+    CScriptCompiledNode *compileConditional(); ///< compile a statement that may not be run
+    CScriptCompiledNode *compileFactor();
+    CScriptCompiledNode *compileUnary();
+    CScriptCompiledNode *compileTerm();
+    CScriptCompiledNode *compileExpression();
+    CScriptCompiledNode *compileCondition();
+    CScriptCompiledNode *compileLogic();
+    CScriptCompiledNode *compileTernary();
+    CScriptCompiledNode *compileBase();
+
+    // running
+    CScriptNumber eval(CScriptCompiledNode *n);
+    bool exec(CScriptCompiledNode *n); ///< returns true if 'return' was called
+};
+
+/** A JavaScript interpreter. Separate CTinyJS instances share nothing that can be modified
+ * (the constants from CScriptVar::constInt and friends, and objects shared by freezeBuiltins,
+ * are never written to), so they can be run
+ * at the same time on different threads. One instance must only be used by one thread at a time,
+ * and variables must not be passed between instances on different threads. */
 class CTinyJS {
 public:
     CTinyJS();
+    /** Create a copy of the given CTinyJS, with all its variables, native functions and settings.
+     * This is much faster than creating a new CTinyJS and registering functions/running library
+     * code again. Native functions given the original CTinyJS as userdata get the copy instead.
+     * The original isn't modified, so many threads can copy it at once (as long as none are
+     * running code in it). */
+    CTinyJS(const CTinyJS &engine);
+    CTinyJS *clone() { return new CTinyJS(*this); } ///< Create a copy of this CTinyJS - see CTinyJS(const CTinyJS&)
+    /// The CTinyJS running code on this thread (so native functions can find the one calling them), or 0
+    static CTinyJS *getCurrent() { return CScriptMemory::current ? CScriptMemory::current->engine : 0; }
+    /** The value of link, made one that can be changed - for native functions that change 'this' or their
+     * arguments. If it's shared (see freezeBuiltins), we switch to our own copy just as scripts do when they change it */
+    CScriptVar *getWritable(CScriptVarLink *link) { makeWritable(link); return link->var; }
+    /** Make the built-in classes, and the objects in root such as Math, shared constants. Copies of this
+     * CTinyJS (see CTinyJS(const CTinyJS&)) then share them - even on different threads - rather than each
+     * having their own. The first time a script changes one, its CTinyJS makes its own copies of all of them
+     * and points every reference it has at those, so the change is seen however they're reached. Objects containing functions
+     * written in JavaScript, or native functions given this CTinyJS as userdata, can't be shared. */
+    void freezeBuiltins();
+    /** Remember the current state of all our variables, so that resetToBaseline can go back to it. From now
+     * on, the first change to anything that exists now saves what it was - so resetting only costs as much as
+     * what has changed. Calling loadSnapshot or freezeBuiltins forgets the baseline. */
+    void markBaseline();
+    /** Undo every change made to our variables since markBaseline (by scripts or the host), so that anything
+     * created since then is no longer referenced. This must not be called while code is running. Throws a
+     * CScriptException if markBaseline hasn't been called. */
+    void resetToBaseline();
     ~CTinyJS();
 
     void execute(const std::string &code);
+    /** Lex the given code (after passing it through optimise() if setOptimise is on), and return
+     * it in a form that executePrecompiled can run without lexing it again. The code is stored
+     * along with its tokens, so function bodies and error positions still work. */
+    std::string precompile(const std::string &code);
+    /** Execute code returned by precompile. Throws a CScriptException if it's not valid precompiled
+     * code from this version of TinyJS, or if it was precompiled on a different kind of machine */
+    void executePrecompiled(const std::string &precompiled);
+    /// Does this look like the result of precompile (rather than JavaScript)?
+    static bool isPrecompiled(const std::string &data);
     /** Evaluate the given code and return a link to a javascript object,
      * useful for (dangerous) JSON parsing. If nothing to return, will return
      * 'undefined' variable type. CScriptVarLink is returned as this will
      * automatically unref the result as it goes out of scope. If you want to
      * keep it, you must use ref() and unref() */
     CScriptVarLink evaluateComplex(const std::string &code);
+    /** Call function (one of our variables) with the given arguments, and return what it returns - as
+     * evaluateComplex would for a call to it, but without any code to lex and parse. So it's quicker for
+     * calling the same function many times. Missing arguments are undefined, and extra ones are ignored. */
+    CScriptVarLink callFunction(CScriptVar *function, const std::vector<CScriptVar*> &args);
     /** Evaluate the given code and return a string. If nothing to return, will return
      * 'undefined' */
     std::string evaluate(const std::string &code);
@@ -316,6 +700,49 @@ public:
        \endcode
     */
     void addNative(const std::string &funcDesc, JSCallback ptr, void *userdata);
+    /// add an intrinsic function - this is called directly with its arguments rather than a scope (see JSIntrinsic)
+    /** example:
+       \code
+           CScriptVar *scMathSin(CScriptVar **args) { return new CScriptVar(sin(args[0]->getDouble())); }
+           tinyJS->addIntrinsic("function Math.sin(a)", scMathSin);
+       \endcode
+    */
+    void addIntrinsic(const std::string &funcDesc, JSIntrinsic ptr);
+    /** add a table of native functions, which is quicker than calling addNative for each as nothing needs parsing.
+     * The table must stay valid for as long as we (and our clones) do, as the functions aren't actually created
+     * until the first name in their path (eg. 'Math') is first looked up - so ones a script doesn't use cost
+     * next to nothing. Functions in objects that already exist (such as String, Array and Object) are created
+     * straight away. Use getScriptVariable rather than root->findChild to find the others from C++. */
+    /** example:
+       \code
+           static constexpr CScriptNativeDesc natives[] = {
+             { "randInt", { "min", "max" }, scRandInt },
+             { "String.substring", { "lo", "hi" }, scSubstring },
+           };
+           tinyJS->addNatives(natives, 0);
+       \endcode
+    */
+    void addNatives(const CScriptNativeDesc *natives, int count, void *userdata);
+    template<int N> void addNatives(const CScriptNativeDesc (&natives)[N], void *userdata) { addNatives(natives, N, userdata); }
+    /// add a table of intrinsic functions (see addIntrinsic and addNatives)
+    void addIntrinsics(const CScriptIntrinsicDesc *intrinsics, int count);
+    template<int N> void addIntrinsics(const CScriptIntrinsicDesc (&intrinsics)[N]) { addIntrinsics(intrinsics, N); }
+    /// add a table of constant numbers (see addNatives)
+    void addConstants(const CScriptConstantDesc *constants, int count);
+    template<int N> void addConstants(const CScriptConstantDesc (&constants)[N]) { addConstants(constants, N); }
+    /// Create everything from addNatives/addIntrinsics/addConstants that hasn't been looked up yet
+    void createAllNatives();
+
+    /** Write all our variables (including functions and the built-in classes) to a file, so that
+     * loadSnapshot can recreate them without running the code that made them. Native functions
+     * are written as their path and argument names (so it doesn't matter whether they were added with
+     * addNative or a table, or how their descriptions were spaced), and userCustomData
+     * isn't written. Throws a CScriptException if this isn't possible. */
+    void saveSnapshot(const std::string &filename);
+    /** Replace all our variables with those in a file written by saveSnapshot. The native functions
+     * it uses must already have been added (eg. with registerFunctions), and the file must have been
+     * written by this version of TinyJS on the same kind of machine. Throws a CScriptException if not. */
+    void loadSnapshot(const std::string &filename);
 
     /// Get the given variable specified by a path (var1.var2.etc), or return 0
     CScriptVar *getScriptVariable(const std::string &path);
@@ -327,20 +754,114 @@ public:
     /// Send all variables to stdout
     void trace();
 
+    /** If enabled, code given to execute/evaluate is passed through optimise() first.
+     * Off by default, as it costs an extra pass over the code */
+    void setOptimise(bool enabled) { optimiseCode = enabled; }
+    /** Return a version of the code where constant arithmetic has been folded
+     * (eg. 'x = 60*60;' becomes 'x = 3600;') and if/while statements whose
+     * condition is a constant have had the branches that can never run removed.
+     * Line numbers are preserved. */
+    std::string optimise(const std::string &code);
+    /** Once a function has been called this many times, try to compile it so that it can be
+     * run without re-parsing it. Only functions that do arithmetic, comparisons, ifs and loops
+     * on numbers in local variables can be compiled - others (or calls with arguments that
+     * aren't numbers) are interpreted as normal. 0 (the default) disables this. */
+    void setCompileThreshold(int calls) { compileThreshold = calls; }
+
+    /** Limit the work each call to execute/evaluate can do (including any code it calls). One unit
+     * of fuel is used for each loop iteration and each function call. If scripts use more than this,
+     * a CScriptLimitException is thrown. 0 (the default) means no limit. */
+    void setFuelLimit(long long fuel) { limits.fuelLimit = fuel; }
+    /// Limit how long each call to execute/evaluate can take, in milliseconds (as for setFuelLimit)
+    void setTimeLimit(int milliseconds) { limits.timeLimit = milliseconds; }
+    /// Return the fuel used by the last call to execute/evaluate (see setFuelLimit)
+    long long getFuelUsed() { return limits.fuelUsed; }
+
+    /** Limit the memory used by the variables, strings and code that scripts create. This is checked
+     * along with the fuel limit, and going over it throws a CScriptLimitException. Memory used by
+     * variables that the host creates outside of execute/evaluate isn't counted. 0 (the default)
+     * means no limit. */
+    void setMemoryLimit(size_t bytes) { memory->limit = bytes; }
+    /// Return the number of bytes of memory in use (see setMemoryLimit)
+    size_t getMemoryUsed() { return memory->used; }
+    /// Return the most memory that has been in use at once (see setMemoryLimit)
+    size_t getMemoryPeak() { return memory->peak; }
+
     CScriptVar *root;   /// root of symbol table
 private:
     CScriptLex *l;             /// current lexer
+    bool optimiseCode;         /// run optimise() on code before executing it
+    int compileThreshold;      /// see setCompileThreshold
+    CScriptLimits limits;      /// fuel and time used by the current execute/evaluate
+    CScriptMemory *memory;     /// memory used by scripts run by us
+    int loopControl;           /// LOOP_CONTROL - set by break/continue (along with execute=false) for the loop to handle
     std::vector<CScriptVar*> scopes; /// stack of scopes when parsing
 #ifdef TINYJS_CALL_STACK
     std::vector<std::string> call_stack; /// Names of places called so we can show when erroring
 #endif
 
+    /// The code being run: l, scopes, loopControl, call_stack and limits. Each CScriptTask has its own
+    struct ExecutionState {
+      CScriptLex *l;
+      std::vector<CScriptVar*> scopes;
+      int loopControl;
+#ifdef TINYJS_CALL_STACK
+      std::vector<std::string> call_stack;
+#endif
+      CScriptLimits limits;
+    };
+    void swapExecutionState(ExecutionState &state); ///< Swap the code being run with state
+    friend class CScriptTask;
+
     CScriptVar *stringClass; /// Built in string class
     CScriptVar *objectClass; /// Built in object class
     CScriptVar *arrayClass; /// Built in array class
 
+    void init(); ///< initialisation shared by the constructors
+    void executeSource(CScriptSource *source); ///< Execute the given source (which will be freed unless something else references it)
+    static CScriptSource *loadPrecompiled(const std::string &precompiled); ///< Check and load the result of precompile
+
+    /// What a native function calls - see addNative/addIntrinsic
+    struct NativeBinding {
+      JSCallback callback;
+      void *userdata;
+      JSIntrinsic intrinsic;
+      int intrinsicArgs;
+    };
+    std::map<std::string, NativeBinding> nativeBindings; ///< Every native function added, by 'function path(arg,arg)' without spaces (for snapshots)
+    /// A table from addNatives, addIntrinsics or addConstants - only one of natives/intrinsics/constants is set
+    struct NativeTable {
+      const CScriptNativeDesc *natives;
+      const CScriptIntrinsicDesc *intrinsics;
+      const CScriptConstantDesc *constants;
+      int count;
+      void *userdata;
+      const char *getPath(int i) const { return natives ? natives[i].path : (intrinsics ? intrinsics[i].path : constants[i].path); }
+    };
+    std::vector<NativeTable> lazyTables; ///< Tables with things in them that haven't been created yet
+    std::set<std::string> lazyNames; ///< The first names in the paths of things in lazyTables that haven't been created yet
+    std::vector<CScriptFrozenVars*> frozenVars; ///< Shared constants we use (see freezeBuiltins)
+    CScriptVar *baselineRoots[4]; ///< root, stringClass, arrayClass and objectClass when markBaseline was called (with references)
+    std::vector<NativeTable> baselineTables; ///< lazyTables when markBaseline was called
+    std::set<std::string> baselineNames; ///< lazyNames when markBaseline was called
+    void addToBaseline(CScriptVar *var, std::set<CScriptVar*> &visited); ///< Mark var and everything it references as in the baseline
+    void discardBaseline(); ///< Forget what markBaseline saved
+    bool canFreeze(CScriptVar *var, std::set<CScriptVar*> &visited); ///< Can var (and everything in it) be shared between copies of us?
+    /** Our copies of the frozen vars (see freezeBuiltins) we can reach, with references. Once one has been
+     * written to, every frozen var we use is looked up here, so that we only ever change one copy of it */
+    std::map<CScriptVar*, CScriptVar*> frozenCopies;
+    std::map<CScriptVar*, CScriptVar*> baselineCopies; ///< frozenCopies when markBaseline was called (with references)
+    static void setFrozenCopies(std::map<CScriptVar*, CScriptVar*> &copies, const std::map<CScriptVar*, CScriptVar*> &newCopies); ///< Replace copies, moving the references
+    CScriptVar *getFrozenCopy(CScriptVar *var); ///< Our copy of frozen var, made (with copies of the frozen vars in it) if we don't have one
+    void unfreeze(); ///< Point everything we can reach at copies of the frozen vars in it, before one of them is changed
+    void makeWritable(CScriptVarLink *link); ///< link->makeWritable(), using our copy (see unfreeze) if it's frozen
+    /** Find member 'name' of object, a frozen var - in our copy of it if we have one. If it's about to be
+     * written to (or doesn't exist), we unfreeze first, so that nothing shared gets changed */
+    CScriptVarLink *findFrozenChild(CScriptVar *object, const std::string &name);
+
     // parsing - in order of precedence
     CScriptVarLink *functionCall(bool &execute, CScriptVarLink *function, CScriptVar *parent);
+    CScriptVarLink *runFunction(CScriptVarLink *function, CScriptVar *functionRoot, bool &execute); ///< Run function with functionRoot (which has its arguments, and is freed) as its scope
     CScriptVarLink *factor(bool &execute);
     CScriptVarLink *unary(bool &execute);
     CScriptVarLink *term(bool &execute);
@@ -352,13 +873,111 @@ private:
     CScriptVarLink *base(bool &execute);
     void block(bool &execute);
     void statement(bool &execute);
+    bool endLoopBody(bool &execute); ///< handle break/continue after a loop's body - returns false if the loop should stop
+    void checkLoopControl(); ///< throw an exception if break/continue was used outside of a loop
     // parsing utility functions
     CScriptVarLink *parseFunctionDefinition();
+    CScriptVar *addNativeFunction(const std::string &funcDesc, std::string &key); ///< parse the description of a native function and add it, setting its key in nativeBindings
     void parseFunctionArguments(CScriptVar *funcVar);
+    void addNativeTable(const NativeTable &table); ///< add a table, leaving what isn't in an existing object until it's looked up
+    bool createNatives(const std::string &name); ///< create the things in lazyTables whose paths start with name - false if there were none
+    /** create entry i of table. The object it was put in is remembered in parent/parentPath, as the next
+     * entry in the table is probably in the same one */
+    void createNative(const NativeTable &table, int i, CScriptVar *&parent, std::string &parentPath);
+    CScriptCompiledFunction *getCompiledFunction(CScriptVar *function); ///< count a call to function, and return its compiled version if it has a valid one
+    // optimiser passes
+    std::string foldConstants(const std::string &code);
+    std::string removeDeadBranches(const std::string &code);
+    bool evaluateConstant(const std::string &code, std::string &result); ///< Evaluate constant arithmetic, and return it as a literal
+    int findStatementEnd(CScriptLex *lex, int start); ///< Return the position of the first token after the statement at 'start', or -1
+
+    /// Key for methodCache: the first class we look in, what type of object it is, and the name
+    struct MethodCacheKey {
+      CScriptVar *firstClass;
+      int kind;
+      std::string name;
+      bool operator==(const MethodCacheKey &k) const { return firstClass==k.firstClass && kind==k.kind && name==k.name; }
+    };
+    struct MethodCacheHash {
+      size_t operator()(const MethodCacheKey &k) const { return std::hash<std::string>()(k.name) ^ (std::hash<void*>()(k.firstClass) << 2) ^ k.kind; }
+    };
+    std::unordered_map<MethodCacheKey, CScriptVarLink*, MethodCacheHash> methodCache; ///< results of findInParentClasses
+    unsigned int methodCacheEpoch; ///< The memory->classEpoch that methodCache is valid for
+
+    /// The cases of a switch statement, found the first time it is run so we can go straight to the right one
+    struct SwitchTable {
+      bool constant; ///< true if every case is an integer or string literal, so we can use intCases/stringCases
+      std::unordered_map<int, int> intCases; ///< case value -> position of the code after it
+      std::unordered_map<std::string, int> stringCases; ///< case value -> position of the code after it
+      std::vector<std::pair<int, int> > cases; ///< position of each case's expression, and of the code after it
+      int defaultPos; ///< position of the code after 'default:', or -1
+      int endPos; ///< position of the closing '}'
+    };
+    /// Switch statements we have run, keyed on their source and the position of their '{'. We hold a reference to each source.
+    std::map<std::pair<CScriptSource*, int>, SwitchTable> switchTables;
+    const SwitchTable &getSwitchTable(); ///< Get the SwitchTable for the switch whose '{' we are at, leaving l in any position
+    void clearSwitchTables();
 
     CScriptVarLink *findInScopes(const std::string &childName); ///< Finds a child, looking recursively up the scopes
     /// Look up in any parent classes of the given object
     CScriptVarLink *findInParentClasses(CScriptVar *object, const std::string &name);
+    CScriptVarLink *findInParentClassesUncached(CScriptVar *object, const std::string &name);
+};
+
+struct CScriptTaskContext;
+
+/** Code run in a CTinyJS that can stop part way through, and carry on later. A native function whose
+ * result isn't ready yet (because it is waiting for I/O, say) can remember CScriptTask::getCurrent(),
+ * start whatever it needs to and return CScriptVar::constPending() with setReturnVar. The task then
+ * stops, and run() or resume() returns false. When the host has the result, it calls resume() to
+ * carry on as if the native function had returned it.
+ *
+ * Each task runs on a stack of its own, so one thread can have thousands of tasks waiting at once,
+ * in the same CTinyJS (where they share variables, and only one runs at a time) or in different ones.
+ * A task must only be run and resumed on the thread that created it, its CTinyJS must outlive it, and
+ * resetToBaseline must not be called while it is waiting. Each task has its own fuel and time limits
+ * (see CTinyJS::setFuelLimit), and the time includes any spent waiting. */
+class CScriptTask {
+public:
+    CScriptTask(CTinyJS *engine, const std::string &code, size_t stackSize = TINYJS_TASK_STACK_SIZE);
+    /// If the task is waiting, this resumes it with an error so that the code stops
+    ~CScriptTask();
+
+    /** Start running the code. Returns true if it finished, or false if it is waiting for a native
+     * function (see CScriptVar::constPending). Throws a CScriptException if the code does. */
+    bool run();
+    /** Carry on from the native function we are waiting for, which returns result (a new
+     * variable, or one the caller has a reference to). Returns and throws as run() does. */
+    bool resume(CScriptVar *result);
+    /// Carry on by making the native function we are waiting for throw an error
+    bool resumeWithError(const std::string &message);
+
+    bool isWaiting() { return status==WAITING; }
+    bool isFinished() { return status==FINISHED; }
+    CTinyJS *getEngine() { return engine; }
+    /// The task whose code is running on this thread, or 0 if there isn't one
+    static CScriptTask *getCurrent() { return current; }
+
+protected:
+    enum Status { NOT_STARTED, RUNNING, WAITING, FINISHED };
+    Status status;
+    CTinyJS *engine;
+    std::string code;
+    CTinyJS::ExecutionState state; ///< What the code was doing when it stopped (or the host's, while it runs)
+    CScriptMemory *memory; ///< CScriptMemory::current when it stopped (or the host's, while it runs)
+    CScriptTaskContext *context; ///< Our stack, and the registers of whichever of us or the host isn't running
+    CScriptVar *result; ///< What the native function we are waiting for returns
+    std::string error; ///< The error it throws instead (if result is 0)
+    CScriptException *exception; ///< What the code threw
+    CScriptTask *previous; ///< getCurrent() when we were last switched to
+
+    static thread_local CScriptTask *current;
+    friend class CTinyJS;
+    friend struct CScriptTaskContext;
+    bool switchTo(); ///< Run the code until it waits or finishes, then return whether it finished (throwing what it threw)
+    void switchBack(); ///< Go back to whatever called switchTo
+    void body(); ///< Run the code (on our own stack)
+    void wait(CScriptVarLink *returnVar); ///< Stop until we are resumed, then set returnVar to the result (or throw the error)
 };
 
 #endif
@@ -32,6 +32,7 @@
 #include <math.h>
 #include <cstdlib>
 #include <sstream>
+#include <random>
 
 using namespace std;
 // ----------------------------------------------- Actual Functions
@@ -49,14 +50,22 @@ void scObjectClone(CScriptVar *c, void *) {
     c->getReturnVar()->copyValue(obj);
 }
 
+/* rand() shares its state between all threads, so each thread has its own generator
+ * to let CTinyJS instances run on different threads */
+static std::minstd_rand &getRandomGenerator() {
+    static thread_local std::minstd_rand generator;
+    return generator;
+}
+
 void scMathRand(CScriptVar *c, void *) {
-    c->getReturnVar()->setDouble((double)rand()/RAND_MAX);
+    std::minstd_rand &generator = getRandomGenerator();
+    c->getReturnVar()->setDouble((double)(generator()-generator.min())/(generator.max()-generator.min()));
 }
 
 void scMathRandInt(CScriptVar *c, void *) {
     int min = c->getParameter("min")->getInt();
     int max = c->getParameter("max")->getInt();
-    int val = min + (int)(rand()%(1+max-min));
+    int val = min + (int)getRandomGenerator()()%(1+max-min);
     c->getReturnVar()->setInt(val);
 }
 
@@ -180,8 +189,18 @@ void scArrayContains(CScriptVar *c, void *data) {
   c->getReturnVar()->setInt(contains);
 }
 
+// 'this' for functions that change it - if it's shared (see CTinyJS::freezeBuiltins), the engine's own copy
+static CScriptVar *getWritableThis(CScriptVar *c) {
+  CScriptVarLink *link = c->findChildOrCreate("this");
+  if (!link->var->isConstant()) return link->var;
+  CTinyJS *engine = CTinyJS::getCurrent();
+  if (!engine) throw new CScriptException("Can't modify a shared array");
+  return engine->getWritable(link);
+}
+
 void scArrayRemove(CScriptVar *c, void *data) {
   CScriptVar *obj = c->getParameter("obj");
+  getWritableThis(c);
   vector<int> removedIndices;
   CScriptVarLink *v;
   // remove
@@ -222,34 +241,43 @@ void scArrayJoin(CScriptVar *c, void *data) {
 
 void scArrayPush(CScriptVar *c, void *data) {
   CScriptVar *obj = c->getParameter("obj");
-  CScriptVar *arr = c->getParameter("this");
+  CScriptVar *arr = getWritableThis(c);
   int length = arr->getArrayLength();
   arr->setArrayIndex(length, obj);
 }
 
 // ----------------------------------------------- Register Functions
-void registerFunctions(CTinyJS *tinyJS) {
-    tinyJS->addNative("function exec(jsCode)", scExec, tinyJS); // execute the given code
-    tinyJS->addNative("function eval(jsCode)", scEval, tinyJS); // execute the given string (an expression) and return the result
-    tinyJS->addNative("function trace()", scTrace, tinyJS);
-    tinyJS->addNative("function Object.dump()", scObjectDump, 0);
-    tinyJS->addNative("function Object.clone()", scObjectClone, 0);
-    tinyJS->addNative("function Math.rand()", scMathRand, 0);
-    tinyJS->addNative("function Math.randInt(min, max)", scMathRandInt, 0);
-    tinyJS->addNative("function charToInt(ch)", scCharToInt, 0); //  convert a character to an int - get its value
-    tinyJS->addNative("function String.indexOf(search)", scStringIndexOf, 0); // find the position of a string in a string, -1 if not
-    tinyJS->addNative("function String.substring(lo,hi)", scStringSubstring, 0);
-    tinyJS->addNative("function String.charAt(pos)", scStringCharAt, 0);
-    tinyJS->addNative("function String.charCodeAt(pos)", scStringCharCodeAt, 0);
-    tinyJS->addNative("function String.fromCharCode(char)", scStringFromCharCode, 0);
-    tinyJS->addNative("function String.split(separator)", scStringSplit, 0);
-    tinyJS->addNative("function Integer.parseInt(str)", scIntegerParseInt, 0); // string to int
-    tinyJS->addNative("function Integer.valueOf(str)", scIntegerValueOf, 0); // value of a single character
-    tinyJS->addNative("function JSON.stringify(obj, replacer)", scJSONStringify, 0); // convert to JSON. replacer is ignored at the moment
+// These need the CTinyJS as userdata
+static constexpr CScriptNativeDesc engineFunctions[] = {
+    { "exec", { "jsCode" }, scExec }, // execute the given code
+    { "eval", { "jsCode" }, scEval }, // execute the given string (an expression) and return the result
+    { "trace", {}, scTrace },
+};
+
+static constexpr CScriptNativeDesc functions[] = {
+    { "Object.dump", {}, scObjectDump },
+    { "Object.clone", {}, scObjectClone },
+    { "Math.rand", {}, scMathRand },
+    { "Math.randInt", { "min", "max" }, scMathRandInt },
+    { "charToInt", { "ch" }, scCharToInt }, //  convert a character to an int - get its value
+    { "String.indexOf", { "search" }, scStringIndexOf }, // find the position of a string in a string, -1 if not
+    { "String.substring", { "lo", "hi" }, scStringSubstring },
+    { "String.charAt", { "pos" }, scStringCharAt },
+    { "String.charCodeAt", { "pos" }, scStringCharCodeAt },
+    { "String.fromCharCode", { "char" }, scStringFromCharCode },
+    { "String.split", { "separator" }, scStringSplit },
+    { "Integer.parseInt", { "str" }, scIntegerParseInt }, // string to int
+    { "Integer.valueOf", { "str" }, scIntegerValueOf }, // value of a single character
+    { "JSON.stringify", { "obj", "replacer" }, scJSONStringify }, // convert to JSON. replacer is ignored at the moment
     // JSON.parse is left out as you can (unsafely!) use eval instead
-    tinyJS->addNative("function Array.contains(obj)", scArrayContains, 0);
-    tinyJS->addNative("function Array.remove(obj)", scArrayRemove, 0);
-    tinyJS->addNative("function Array.join(separator)", scArrayJoin, 0);
-    tinyJS->addNative("function Array.push(obj)", scArrayPush, 0);
+    { "Array.contains", { "obj" }, scArrayContains },
+    { "Array.remove", { "obj" }, scArrayRemove },
+    { "Array.join", { "separator" }, scArrayJoin },
+    { "Array.push", { "obj" }, scArrayPush },
+};
+
+void registerFunctions(CTinyJS *tinyJS) {
+    tinyJS->addNatives(engineFunctions, tinyJS);
+    tinyJS->addNatives(functions, 0);
 }
 
@@ -35,7 +35,7 @@
 
 using namespace std;
 
-#define k_E                 exp(1.0)
+#define k_E                 2.7182818284590452353602874713527
 #define k_PI                3.1415926535897932384626433832795
 
 #define F_ABS(a)            ((a)>=0 ? (a) : (-(a)))
@@ -45,13 +45,14 @@ using namespace std;
 #define F_RNG(a,min,max)    ((a)<(min) ? min : ((a)>(max) ? max : a ))
 #define F_ROUND(a)          ((a)>0 ? (int) ((a)+0.5) : (int) ((a)-0.5) )
  
-//CScriptVar shortcut macro
-#define scIsInt(a)          ( c->getParameter(a)->isInt() )
-#define scIsDouble(a)       ( c->getParameter(a)->isDouble() )  
-#define scGetInt(a)         ( c->getParameter(a)->getInt() )
-#define scGetDouble(a)      ( c->getParameter(a)->getDouble() )  
-#define scReturnInt(a)      ( c->getReturnVar()->setInt(a) )
-#define scReturnDouble(a)   ( c->getReturnVar()->setDouble(a) )  
+//CScriptVar shortcut macro - these are intrinsics, so arguments are given by their index
+#define scIsInt(a)          ( args[a]->isInt() )
+#define scIsDouble(a)       ( args[a]->isDouble() )
+#define scGetInt(a)         ( args[a]->getInt() )
+#define scGetDouble(a)      ( args[a]->getDouble() )
+#define scReturnInt(a)      return CScriptVar::constInt((int)(a))
+#define scReturnDouble(a)   return new CScriptVar((double)(a))
+#define scReturnUndefined() return CScriptVar::constUndefined()
 
 #ifdef _MSC_VER
 namespace
@@ -83,213 +84,215 @@ namespace
 #endif
 
 //Math.abs(x) - returns absolute of given value
-void scMathAbs(CScriptVar *c, void *userdata) {
-    if ( scIsInt("a") ) {
-      scReturnInt( F_ABS( scGetInt("a") ) );
-    } else if ( scIsDouble("a") ) {
-      scReturnDouble( F_ABS( scGetDouble("a") ) );
+CScriptVar *scMathAbs(CScriptVar **args) {
+    if ( scIsInt(0) ) {
+      scReturnInt( F_ABS( scGetInt(0) ) );
+    } else if ( scIsDouble(0) ) {
+      scReturnDouble( F_ABS( scGetDouble(0) ) );
     }
+    scReturnUndefined();
 }
 
 //Math.round(a) - returns nearest round of given value
-void scMathRound(CScriptVar *c, void *userdata) {
-    if ( scIsInt("a") ) {
-      scReturnInt( F_ROUND( scGetInt("a") ) );
-    } else if ( scIsDouble("a") ) {
-      scReturnDouble( F_ROUND( scGetDouble("a") ) );
+CScriptVar *scMathRound(CScriptVar **args) {
+    if ( scIsInt(0) ) {
+      scReturnInt( F_ROUND( scGetInt(0) ) );
+    } else if ( scIsDouble(0) ) {
+      scReturnDouble( F_ROUND( scGetDouble(0) ) );
     }
+    scReturnUndefined();
 }
 
 //Math.floor(a) - returns nearest floor of given value
-void scMathFloor(CScriptVar *c, void *userdata) {
-    if ( scIsInt("a") ) {
-      scReturnInt( floor( scGetInt("a") ) );
-    } else if ( scIsDouble("a") ) {
-      scReturnInt( floor( scGetDouble("a") ) );
+CScriptVar *scMathFloor(CScriptVar **args) {
+    if ( scIsInt(0) ) {
+      scReturnInt( floor( scGetInt(0) ) );
+    } else if ( scIsDouble(0) ) {
+      scReturnInt( floor( scGetDouble(0) ) );
     }
+    scReturnUndefined();
 }
 
 //Math.min(a,b) - returns minimum of two given values 
-void scMathMin(CScriptVar *c, void *userdata) {
-    if ( (scIsInt("a")) && (scIsInt("b")) ) {
-      scReturnInt( F_MIN( scGetInt("a"), scGetInt("b") ) );
+CScriptVar *scMathMin(CScriptVar **args) {
+    if ( (scIsInt(0)) && (scIsInt(1)) ) {
+      scReturnInt( F_MIN( scGetInt(0), scGetInt(1) ) );
     } else {
-      scReturnDouble( F_MIN( scGetDouble("a"), scGetDouble("b") ) );
+      scReturnDouble( F_MIN( scGetDouble(0), scGetDouble(1) ) );
     }
 }
 
 //Math.max(a,b) - returns maximum of two given values  
-void scMathMax(CScriptVar *c, void *userdata) {
-    if ( (scIsInt("a")) && (scIsInt("b")) ) {
-      scReturnInt( F_MAX( scGetInt("a"), scGetInt("b") ) );
+CScriptVar *scMathMax(CScriptVar **args) {
+    if ( (scIsInt(0)) && (scIsInt(1)) ) {
+      scReturnInt( F_MAX( scGetInt(0), scGetInt(1) ) );
     } else {
-      scReturnDouble( F_MAX( scGetDouble("a"), scGetDouble("b") ) );
+      scReturnDouble( F_MAX( scGetDouble(0), scGetDouble(1) ) );
     }
 }
 
 //Math.range(x,a,b) - returns value limited between two given values  
-void scMathRange(CScriptVar *c, void *userdata) {
-    if ( (scIsInt("x")) ) {
-      scReturnInt( F_RNG( scGetInt("x"), scGetInt("a"), scGetInt("b") ) );
+CScriptVar *scMathRange(CScriptVar **args) {
+    if ( (scIsInt(0)) ) {
+      scReturnInt( F_RNG( scGetInt(0), scGetInt(1), scGetInt(2) ) );
     } else {
-      scReturnDouble( F_RNG( scGetDouble("x"), scGetDouble("a"), scGetDouble("b") ) );
+      scReturnDouble( F_RNG( scGetDouble(0), scGetDouble(1), scGetDouble(2) ) );
     }
 }
 
 //Math.sign(a) - returns sign of given value (-1==negative,0=zero,1=positive)
-void scMathSign(CScriptVar *c, void *userdata) {
-    if ( scIsInt("a") ) {
-      scReturnInt( F_SGN( scGetInt("a") ) );
-    } else if ( scIsDouble("a") ) {
-      scReturnDouble( F_SGN( scGetDouble("a") ) );
+CScriptVar *scMathSign(CScriptVar **args) {
+    if ( scIsInt(0) ) {
+      scReturnInt( F_SGN( scGetInt(0) ) );
+    } else if ( scIsDouble(0) ) {
+      scReturnDouble( F_SGN( scGetDouble(0) ) );
     }
-}
-
-//Math.PI() - returns PI value
-void scMathPI(CScriptVar *c, void *userdata) {
-    scReturnDouble(k_PI);
+    scReturnUndefined();
 }
 
 //Math.toDegrees(a) - returns degree value of a given angle in radians
-void scMathToDegrees(CScriptVar *c, void *userdata) {
-    scReturnDouble( (180.0/k_PI)*( scGetDouble("a") ) );
+CScriptVar *scMathToDegrees(CScriptVar **args) {
+    scReturnDouble( (180.0/k_PI)*( scGetDouble(0) ) );
 }
 
 //Math.toRadians(a) - returns radians value of a given angle in degrees
-void scMathToRadians(CScriptVar *c, void *userdata) {
-    scReturnDouble( (k_PI/180.0)*( scGetDouble("a") ) );
+CScriptVar *scMathToRadians(CScriptVar **args) {
+    scReturnDouble( (k_PI/180.0)*( scGetDouble(0) ) );
 }
 
 //Math.sin(a) - returns trig. sine of given angle in radians
-void scMathSin(CScriptVar *c, void *userdata) {
-    scReturnDouble( sin( scGetDouble("a") ) );
+CScriptVar *scMathSin(CScriptVar **args) {
+    scReturnDouble( sin( scGetDouble(0) ) );
 }
 
 //Math.asin(a) - returns trig. arcsine of given angle in radians
-void scMathASin(CScriptVar *c, void *userdata) {
-    scReturnDouble( asin( scGetDouble("a") ) );
+CScriptVar *scMathASin(CScriptVar **args) {
+    scReturnDouble( asin( scGetDouble(0) ) );
 }
 
 //Math.cos(a) - returns trig. cosine of given angle in radians
-void scMathCos(CScriptVar *c, void *userdata) {
-    scReturnDouble( cos( scGetDouble("a") ) );
+CScriptVar *scMathCos(CScriptVar **args) {
+    scReturnDouble( cos( scGetDouble(0) ) );
 }
 
 //Math.acos(a) - returns trig. arccosine of given angle in radians
-void scMathACos(CScriptVar *c, void *userdata) {
-    scReturnDouble( acos( scGetDouble("a") ) );
+CScriptVar *scMathACos(CScriptVar **args) {
+    scReturnDouble( acos( scGetDouble(0) ) );
 }
 
 //Math.tan(a) - returns trig. tangent of given angle in radians
-void scMathTan(CScriptVar *c, void *userdata) {
-    scReturnDouble( tan( scGetDouble("a") ) );
+CScriptVar *scMathTan(CScriptVar **args) {
+    scReturnDouble( tan( scGetDouble(0) ) );
 }
 
 //Math.atan(a) - returns trig. arctangent of given angle in radians
-void scMathATan(CScriptVar *c, void *userdata) {
-    scReturnDouble( atan( scGetDouble("a") ) );
+CScriptVar *scMathATan(CScriptVar **args) {
+    scReturnDouble( atan( scGetDouble(0) ) );
 }
 
 //Math.sinh(a) - returns trig. hyperbolic sine of given angle in radians
-void scMathSinh(CScriptVar *c, void *userdata) {
-    scReturnDouble( sinh( scGetDouble("a") ) );
+CScriptVar *scMathSinh(CScriptVar **args) {
+    scReturnDouble( sinh( scGetDouble(0) ) );
 }
 
 //Math.asinh(a) - returns trig. hyperbolic arcsine of given angle in radians
-void scMathASinh(CScriptVar *c, void *userdata) {
-    scReturnDouble( asinh( (long double)scGetDouble("a") ) );
+CScriptVar *scMathASinh(CScriptVar **args) {
+    scReturnDouble( asinh( (long double)scGetDouble(0) ) );
 }
 
 //Math.cosh(a) - returns trig. hyperbolic cosine of given angle in radians
-void scMathCosh(CScriptVar *c, void *userdata) {
-    scReturnDouble( cosh( scGetDouble("a") ) );
+CScriptVar *scMathCosh(CScriptVar **args) {
+    scReturnDouble( cosh( scGetDouble(0) ) );
 }
 
 //Math.acosh(a) - returns trig. hyperbolic arccosine of given angle in radians
-void scMathACosh(CScriptVar *c, void *userdata) {
-    scReturnDouble( acosh( (long double)scGetDouble("a") ) );
+CScriptVar *scMathACosh(CScriptVar **args) {
+    scReturnDouble( acosh( (long double)scGetDouble(0) ) );
 }
 
 //Math.tanh(a) - returns trig. hyperbolic tangent of given angle in radians
-void scMathTanh(CScriptVar *c, void *userdata) {
-    scReturnDouble( tanh( scGetDouble("a") ) );
+CScriptVar *scMathTanh(CScriptVar **args) {
+    scReturnDouble( tanh( scGetDouble(0) ) );
 }
 
 //Math.atan(a) - returns trig. hyperbolic arctangent of given angle in radians
-void scMathATanh(CScriptVar *c, void *userdata) {
-    scReturnDouble( atan( scGetDouble("a") ) );
-}
-
-//Math.E() - returns E Neplero value
-void scMathE(CScriptVar *c, void *userdata) {
-    scReturnDouble(k_E);
+CScriptVar *scMathATanh(CScriptVar **args) {
+    scReturnDouble( atan( scGetDouble(0) ) );
 }
 
 //Math.log(a) - returns natural logaritm (base E) of given value
-void scMathLog(CScriptVar *c, void *userdata) {
-    scReturnDouble( log( scGetDouble("a") ) );
+CScriptVar *scMathLog(CScriptVar **args) {
+    scReturnDouble( log( scGetDouble(0) ) );
 }
 
 //Math.log10(a) - returns logaritm(base 10) of given value
-void scMathLog10(CScriptVar *c, void *userdata) {
-    scReturnDouble( log10( scGetDouble("a") ) );
+CScriptVar *scMathLog10(CScriptVar **args) {
+    scReturnDouble( log10( scGetDouble(0) ) );
 }
 
 //Math.exp(a) - returns e raised to the power of a given number
-void scMathExp(CScriptVar *c, void *userdata) {
-    scReturnDouble( exp( scGetDouble("a") ) );
+CScriptVar *scMathExp(CScriptVar **args) {
+    scReturnDouble( exp( scGetDouble(0) ) );
 }
 
 //Math.pow(a,b) - returns the result of a number raised to a power (a)^(b)
-void scMathPow(CScriptVar *c, void *userdata) {
-    scReturnDouble( pow( scGetDouble("a"), scGetDouble("b") ) );
+CScriptVar *scMathPow(CScriptVar **args) {
+    scReturnDouble( pow( scGetDouble(0), scGetDouble(1) ) );
 }
 
 //Math.sqr(a) - returns square of given value
-void scMathSqr(CScriptVar *c, void *userdata) {
-    scReturnDouble( ( scGetDouble("a") * scGetDouble("a") ) );
+CScriptVar *scMathSqr(CScriptVar **args) {
+    scReturnDouble( ( scGetDouble(0) * scGetDouble(0) ) );
 }
 
 //Math.sqrt(a) - returns square root of given value
-void scMathSqrt(CScriptVar *c, void *userdata) {
-    scReturnDouble( sqrtf( scGetDouble("a") ) );
+CScriptVar *scMathSqrt(CScriptVar **args) {
+    scReturnDouble( sqrtf( scGetDouble(0) ) );
 }
 
 // ----------------------------------------------- Register Functions
-void registerMathFunctions(CTinyJS *tinyJS) {
-     
+// These are intrinsics, so calling them doesn't need a new scope
+static constexpr CScriptIntrinsicDesc mathFunctions[] = {
     // --- Math and Trigonometry functions ---
-    tinyJS->addNative("function Math.abs(a)", scMathAbs, 0);
-    tinyJS->addNative("function Math.round(a)", scMathRound, 0);
-    tinyJS->addNative("function Math.floor(a)", scMathFloor, 0);
-    tinyJS->addNative("function Math.min(a,b)", scMathMin, 0);
-    tinyJS->addNative("function Math.max(a,b)", scMathMax, 0);
-    tinyJS->addNative("function Math.range(x,a,b)", scMathRange, 0);
-    tinyJS->addNative("function Math.sign(a)", scMathSign, 0);
-    
-    tinyJS->addNative("function Math.PI()", scMathPI, 0);
-    tinyJS->addNative("function Math.toDegrees(a)", scMathToDegrees, 0);
-    tinyJS->addNative("function Math.toRadians(a)", scMathToRadians, 0);
-    tinyJS->addNative("function Math.sin(a)", scMathSin, 0);
-    tinyJS->addNative("function Math.asin(a)", scMathASin, 0);
-    tinyJS->addNative("function Math.cos(a)", scMathCos, 0);
-    tinyJS->addNative("function Math.acos(a)", scMathACos, 0);
-    tinyJS->addNative("function Math.tan(a)", scMathTan, 0);
-    tinyJS->addNative("function Math.atan(a)", scMathATan, 0);
-    tinyJS->addNative("function Math.sinh(a)", scMathSinh, 0);
-    tinyJS->addNative("function Math.asinh(a)", scMathASinh, 0);
-    tinyJS->addNative("function Math.cosh(a)", scMathCosh, 0);
-    tinyJS->addNative("function Math.acosh(a)", scMathACosh, 0);
-    tinyJS->addNative("function Math.tanh(a)", scMathTanh, 0);
-    tinyJS->addNative("function Math.atanh(a)", scMathATanh, 0);
-       
-    tinyJS->addNative("function Math.E()", scMathE, 0);
-    tinyJS->addNative("function Math.log(a)", scMathLog, 0);
-    tinyJS->addNative("function Math.log10(a)", scMathLog10, 0);
-    tinyJS->addNative("function Math.exp(a)", scMathExp, 0);
-    tinyJS->addNative("function Math.pow(a,b)", scMathPow, 0);
-    
-    tinyJS->addNative("function Math.sqr(a)", scMathSqr, 0);
-    tinyJS->addNative("function Math.sqrt(a)", scMathSqrt, 0);    
-  
+    { "Math.abs", { "a" }, scMathAbs },
+    { "Math.round", { "a" }, scMathRound },
+    { "Math.floor", { "a" }, scMathFloor },
+    { "Math.min", { "a", "b" }, scMathMin },
+    { "Math.max", { "a", "b" }, scMathMax },
+    { "Math.range", { "x", "a", "b" }, scMathRange },
+    { "Math.sign", { "a" }, scMathSign },
+
+    { "Math.toDegrees", { "a" }, scMathToDegrees },
+    { "Math.toRadians", { "a" }, scMathToRadians },
+    { "Math.sin", { "a" }, scMathSin },
+    { "Math.asin", { "a" }, scMathASin },
+    { "Math.cos", { "a" }, scMathCos },
+    { "Math.acos", { "a" }, scMathACos },
+    { "Math.tan", { "a" }, scMathTan },
+    { "Math.atan", { "a" }, scMathATan },
+    { "Math.sinh", { "a" }, scMathSinh },
+    { "Math.asinh", { "a" }, scMathASinh },
+    { "Math.cosh", { "a" }, scMathCosh },
+    { "Math.acosh", { "a" }, scMathACosh },
+    { "Math.tanh", { "a" }, scMathTanh },
+    { "Math.atanh", { "a" }, scMathATanh },
+
+    { "Math.log", { "a" }, scMathLog },
+    { "Math.log10", { "a" }, scMathLog10 },
+    { "Math.exp", { "a" }, scMathExp },
+    { "Math.pow", { "a", "b" }, scMathPow },
+
+    { "Math.sqr", { "a" }, scMathSqr },
+    { "Math.sqrt", { "a" }, scMathSqrt },
+};
+
+// --- Math constants ---
+static constexpr CScriptConstantDesc mathConstants[] = {
+    { "Math.PI", k_PI },
+    { "Math.E", k_E },
+};
+
+void registerMathFunctions(CTinyJS *tinyJS) {
+    tinyJS->addIntrinsics(mathFunctions);
+    tinyJS->addConstants(mathConstants);
 }
@@ -0,0 +1,294 @@
+/*
+ * TinyJS
+ *
+ * A single-file Javascript-alike engine
+ *
+ * - A pool of engines that run jobs on worker threads, and channels to send messages between engines
+ *
+ * Authored By Gordon Williams <gw@pur3.co.uk>
+ *
+ * Copyright (C) 2009 Pur3 Ltd
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy of
+ * this software and associated documentation files (the "Software"), to deal in
+ * the Software without restriction, including without limitation the rights to
+ * use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies
+ * of the Software, and to permit persons to whom the Software is furnished to do
+ * so, subject to the following conditions:
+
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#include "TinyJS_Pool.h"
+#include <algorithm>
+
+using namespace std;
+
+// ----------------------------------------------------------------------------------- CTINYJSPOOL
+
+/// The pool whose worker is running on this thread, if any
+static thread_local CTinyJSPool *workerPool = 0;
+
+CTinyJSPool::CTinyJSPool(const CTinyJS &engine, int threads, size_t queueSize) :
+    nextWorker(0), pending(0), sleeping(0), stopping(false) {
+    if (threads<=0) threads = max(1, (int)thread::hardware_concurrency());
+    // all the copies are made before any worker starts, so engine isn't needed after this
+    for (int i=0;i<threads;i++) {
+      Worker *worker = new Worker();
+      worker->index = i;
+      worker->engine = new CTinyJS(engine);
+      worker->engine->markBaseline();
+      worker->queue = new CScriptQueue<CTinyJSPoolJob*>(queueSize);
+      workers.push_back(worker);
+    }
+    for (size_t i=0;i<workers.size();i++)
+      workers[i]->thread = thread(&CTinyJSPool::run, this, workers[i]);
+}
+
+CTinyJSPool::~CTinyJSPool() {
+    {
+      lock_guard<mutex> lock(sleepMutex);
+      stopping = true;
+    }
+    wake.notify_all();
+    for (size_t i=0;i<workers.size();i++)
+      workers[i]->thread.join();
+    for (size_t i=0;i<workers.size();i++) {
+      delete workers[i]->engine;
+      delete workers[i]->queue;
+      delete workers[i];
+    }
+}
+
+future<string> CTinyJSPool::evaluate(const string &code) {
+    return submit([code](CTinyJS *js) { return js->evaluate(code); });
+}
+
+future<string> CTinyJSPool::call(const string &function, const vector<string> &args) {
+    string code = function + "(";
+    for (size_t i=0;i<args.size();i++) {
+      if (i) code += ",";
+      code += args[i];
+    }
+    return evaluate(code + ")");
+}
+
+future<string> CTinyJSPool::submit(const function<string(CTinyJS*)> &run) {
+    CTinyJSPoolJob *job = new CTinyJSPoolJob();
+    job->run = run;
+    future<string> result = job->result.get_future();
+    // if that worker's queue is full try the others, and if they all are, wait for some to be taken
+    size_t first = nextWorker++;
+    for (size_t i=0;!workers[(first+i)%workers.size()]->queue->push(job);i++)
+      if (i%workers.size() == workers.size()-1)
+        this_thread::yield();
+    pending++;
+    /* A worker that is about to sleep counts itself as sleeping before it checks pending (both while
+     * holding sleepMutex), so either it sees this job or we see it and wait for it to be asleep */
+    if (sleeping>0) {
+      lock_guard<mutex> lock(sleepMutex);
+      wake.notify_one();
+    }
+    return result;
+}
+
+CTinyJSPoolJob *CTinyJSPool::take(Worker *worker) {
+    CTinyJSPoolJob *job;
+    // start with our own queue, then take from the others (starting after us, so they're not all robbed in the same order)
+    for (size_t i=0;i<workers.size();i++)
+      if (workers[(worker->index+i)%workers.size()]->queue->pop(job)) {
+        pending--;
+        return job;
+      }
+    return 0;
+}
+
+void CTinyJSPool::run(Worker *worker) {
+    workerPool = this;
+    for (;;) {
+      CTinyJSPoolJob *job = take(worker);
+      if (!job) {
+        unique_lock<mutex> lock(sleepMutex);
+        sleeping++;
+        wake.wait(lock, [this]() { return pending>0 || stopping; });
+        sleeping--;
+        if (stopping && pending<=0) return;
+        continue;
+      }
+      try {
+        job->result.set_value(job->run(worker->engine));
+      } catch (CScriptException *e) {
+        job->result.set_exception(make_exception_ptr(e));
+      } catch (...) {
+        job->result.set_exception(current_exception());
+      }
+      worker->engine->resetToBaseline();
+      delete job;
+    }
+}
+
+void CTinyJSPool::addTo(CTinyJS *engine) {
+    engine->addNative("function Array.parallelMap(fn)", scArrayParallelMap, this);
+    engine->addNative("function Array.parallelForEach(fn)", scArrayParallelForEach, this);
+}
+
+/// Is this the name of an array element?
+static bool isIndex(const string &name) {
+    return !name.empty() && name.find_first_not_of("0123456789")==string::npos;
+}
+
+/// Run fn (the source of a function) on each of the items in message, returning the results in the same form
+static string runParallel(CTinyJS *js, const string &fn, const string &message, bool map) {
+    CScriptVar *items = CScriptVar::deserialize(message);
+    CScriptVar *results = (new CScriptVar(TINYJS_BLANK_DATA, SCRIPTVAR_ARRAY))->ref();
+    string out;
+    try {
+      // it's only parsed once, here - the worker's globals are reset after the job, so this goes too
+      js->execute("var __parallelFn = " + fn + ";");
+      CScriptVarLink function = *js->root->findChild("__parallelFn");
+      /* call it on each item from here rather than with a loop in JavaScript, as that would find
+       * each item by searching the array from the start */
+      vector<CScriptVar*> args(1);
+      for (CScriptVarLink *link = items->firstChild; link; link = link->nextSibling) {
+        args[0] = link->var;
+        CScriptVarLink result = js->callFunction(function.var, args);
+        if (map) results->addChild(link->name, result.var);
+      }
+      if (map) results->serialize(out);
+    } catch (CScriptException *e) {
+      items->unref();
+      results->unref();
+      e->raise();
+    }
+    items->unref();
+    results->unref();
+    return out;
+}
+
+void CTinyJSPool::scArrayParallel(CScriptVar *c, void *userdata, bool map) {
+    CTinyJSPool *pool = (CTinyJSPool*)userdata;
+    // we'd wait for jobs that need the worker we're using
+    if (workerPool == pool) throw new CScriptException("Jobs can't use their own pool for parallelMap/parallelForEach");
+    CScriptVar *arr = c->getParameter("this");
+    CScriptVar *fn = c->getParameter("fn");
+    if (!fn->isFunction() || fn->isNative())
+      throw new CScriptException("parallelMap/parallelForEach need a function written in JavaScript");
+    string source = fn->getParsableString();
+
+    // split the elements into a part for each worker, each of which is sent its part and the function once
+    int length = arr->getArrayLength();
+    int parts = min(length, pool->getThreadCount());
+    vector<CScriptVar*> items;
+    for (int p=0;p<parts;p++)
+      items.push_back((new CScriptVar(TINYJS_BLANK_DATA, SCRIPTVAR_ARRAY))->ref());
+    for (CScriptVarLink *link = arr->firstChild; link; link = link->nextSibling) {
+      if (!isIndex(link->name)) continue;
+      // each part's elements are numbered from the start of the part
+      int index = link->getIntName();
+      int p = (int)((long long)index*parts/length);
+      char name[32];
+      snprintf(name, sizeof(name), "%d", index - (int)((long long)length*p/parts));
+      items[p]->addChild(name, link->var);
+    }
+    vector<future<string> > results;
+    CScriptException *error = 0;
+    for (int p=0;p<parts && !error;p++) {
+      string message;
+      try {
+        items[p]->serialize(message);
+      } catch (CScriptException *e) {
+        error = e;
+        break;
+      }
+      results.push_back(pool->submit([source, message, map](CTinyJS *js) { return runParallel(js, source, message, map); }));
+    }
+    for (int p=0;p<parts;p++)
+      items[p]->unref();
+
+    // put the results together in order, throwing the first error once they're all done
+    CScriptVar *result = c->getReturnVar();
+    if (map) result->setArray();
+    for (size_t p=0;p<results.size();p++) {
+      try {
+        string out = results[p].get();
+        if (!map || error) continue;
+        CScriptVar *part = CScriptVar::deserialize(out);
+        int start = (int)((long long)length*p/parts);
+        for (CScriptVarLink *link = part->firstChild; link; link = link->nextSibling) {
+          char name[32];
+          snprintf(name, sizeof(name), "%d", start + link->getIntName());
+          result->addChild(name, link->var);
+        }
+        part->unref();
+      } catch (CScriptException *e) {
+        if (error) delete e;
+        else error = e;
+      }
+    }
+    if (error) error->raise();
+}
+
+// ----------------------------------------------------------------------------------- CSCRIPTCHANNEL
+
+static void scChannelPostMessage(CScriptVar *c, void *userdata) {
+    CScriptChannel *channel = (CScriptChannel*)userdata;
+    c->getReturnVar()->setInt(channel->post(c->getParameter("message")));
+}
+
+static void scChannelReceiveMessage(CScriptVar *c, void *userdata) {
+    CScriptChannel *channel = (CScriptChannel*)userdata;
+    CScriptVar *message = channel->receive();
+    if (!message) return; // undefined
+    c->setReturnVar(message);
+    message->unref();
+}
+
+CScriptChannel::CScriptChannel(size_t capacity) : messages(capacity) {
+}
+
+CScriptChannel::~CScriptChannel() {
+    string *message;
+    while (messages.pop(message))
+      delete message;
+}
+
+bool CScriptChannel::post(CScriptVar *value) {
+    string *message = new string();
+    try {
+      value->serialize(*message);
+    } catch (CScriptException *e) {
+      delete message;
+      e->raise();
+    }
+    if (messages.push(message)) return true;
+    delete message;
+    return false;
+}
+
+CScriptVar *CScriptChannel::receive() {
+    string *message;
+    if (!messages.pop(message)) return 0;
+    CScriptVar *value = 0;
+    try {
+      value = CScriptVar::deserialize(*message);
+    } catch (CScriptException *e) {
+      delete message;
+      e->raise();
+    }
+    delete message;
+    return value;
+}
+
+void CScriptChannel::addTo(CTinyJS *engine, const string &name) {
+    engine->addNative("function " + name + ".postMessage(message)", scChannelPostMessage, this);
+    engine->addNative("function " + name + ".receiveMessage()", scChannelReceiveMessage, this);
+}
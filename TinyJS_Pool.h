@@ -0,0 +1,202 @@
+/*
+ * TinyJS
+ *
+ * A single-file Javascript-alike engine
+ *
+ * - A pool of engines that run jobs on worker threads, and channels to send messages between engines
+ *
+ * Authored By Gordon Williams <gw@pur3.co.uk>
+ *
+ * Copyright (C) 2009 Pur3 Ltd
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy of
+ * this software and associated documentation files (the "Software"), to deal in
+ * the Software without restriction, including without limitation the rights to
+ * use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies
+ * of the Software, and to permit persons to whom the Software is furnished to do
+ * so, subject to the following conditions:
+
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#ifndef TINYJS_POOL_H
+#define TINYJS_POOL_H
+
+#include "TinyJS.h"
+#include <functional>
+#include <future>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+
+/** A fixed-size queue that any number of threads can push to and pop from at once, without locking
+ * (Dmitry Vyukov's bounded MPMC queue). Each cell has a sequence number saying whether it is ready
+ * to be pushed to or popped from on the current trip around the queue. T must be cheap to copy. */
+template<typename T> class CScriptQueue {
+public:
+    CScriptQueue(size_t capacity); ///< capacity is rounded up to a power of 2
+    ~CScriptQueue() { delete[] cells; }
+    bool push(const T &item); ///< Add item to the back, or return false if we're full
+    bool pop(T &item); ///< Take the item at the front, or return false if we're empty
+protected:
+    struct Cell {
+      std::atomic<size_t> sequence;
+      T item;
+    };
+    Cell *cells;
+    size_t mask; ///< The number of cells minus one
+    // each on its own cache line, as threads pushing and threads popping each hammer one
+    char padding1[64];
+    std::atomic<size_t> pushPos;
+    char padding2[64];
+    std::atomic<size_t> popPos;
+    char padding3[64];
+
+    CScriptQueue(const CScriptQueue &); // not copyable
+    CScriptQueue &operator=(const CScriptQueue &);
+};
+
+template<typename T> CScriptQueue<T>::CScriptQueue(size_t capacity) : pushPos(0), popPos(0) {
+    size_t size = 2;
+    while (size < capacity) size <<= 1;
+    cells = new Cell[size];
+    mask = size-1;
+    for (size_t i=0;i<size;i++)
+      cells[i].sequence.store(i, std::memory_order_relaxed);
+}
+
+template<typename T> bool CScriptQueue<T>::push(const T &item) {
+    Cell *cell;
+    size_t pos = pushPos.load(std::memory_order_relaxed);
+    for (;;) {
+      cell = &cells[pos & mask];
+      size_t sequence = cell->sequence.load(std::memory_order_acquire);
+      intptr_t diff = (intptr_t)sequence - (intptr_t)pos;
+      if (diff==0) { // free on this trip - try and claim it
+        if (pushPos.compare_exchange_weak(pos, pos+1, std::memory_order_relaxed)) break;
+      } else if (diff<0) // still full from the last trip
+        return false;
+      else // someone else pushed here first
+        pos = pushPos.load(std::memory_order_relaxed);
+    }
+    cell->item = item;
+    cell->sequence.store(pos+1, std::memory_order_release);
+    return true;
+}
+
+template<typename T> bool CScriptQueue<T>::pop(T &item) {
+    Cell *cell;
+    size_t pos = popPos.load(std::memory_order_relaxed);
+    for (;;) {
+      cell = &cells[pos & mask];
+      size_t sequence = cell->sequence.load(std::memory_order_acquire);
+      intptr_t diff = (intptr_t)sequence - (intptr_t)(pos+1);
+      if (diff==0) { // pushed on this trip - try and claim it
+        if (popPos.compare_exchange_weak(pos, pos+1, std::memory_order_relaxed)) break;
+      } else if (diff<0) // nothing pushed here yet
+        return false;
+      else // someone else popped it first
+        pos = popPos.load(std::memory_order_relaxed);
+    }
+    item = cell->item;
+    // free for the next trip around
+    cell->sequence.store(pos+mask+1, std::memory_order_release);
+    return true;
+}
+
+/** Carries messages from one engine to another - which may be on different threads - through a lock-free
+ * CScriptQueue. Values are sent as the flat copy written by CScriptVar::serialize, so no variables are
+ * shared between engines. Use addTo to let scripts in an engine use it. */
+class CScriptChannel {
+public:
+    CScriptChannel(size_t capacity = 1024); ///< capacity is the most messages that can be waiting
+    ~CScriptChannel(); ///< Frees the messages that were never received
+
+    /// Send a copy of value, or return false if the channel is full. Throws a CScriptException if value can't be sent
+    bool post(CScriptVar *value);
+    /// Receive a copy of the oldest message (with a reference that the caller must remove), or return 0 if there are none
+    CScriptVar *receive();
+    /** Add 'name.postMessage(message)' and 'name.receiveMessage()' to engine. postMessage returns false if the
+     * channel is full, and receiveMessage returns undefined if it's empty. We must outlive engine and its copies. */
+    void addTo(CTinyJS *engine, const std::string &name);
+protected:
+    CScriptQueue<std::string*> messages;
+
+    CScriptChannel(const CScriptChannel &); // not copyable
+    CScriptChannel &operator=(const CScriptChannel &);
+};
+
+/// A job queued in a CTinyJSPool - it's run with a worker's CTinyJS, and returns a string
+struct CTinyJSPoolJob {
+    std::function<std::string(CTinyJS*)> run;
+    std::promise<std::string> result;
+};
+
+/** Runs jobs on a number of worker threads, each with its own copy of an engine. Each job is put in
+ * one worker's queue (taking turns), and a worker with nothing left in its queue takes jobs from the
+ * others'. After each job, a worker's engine is reset to how it was copied (see CTinyJS::resetToBaseline),
+ * so jobs can't see each other's changes.
+ *
+ * Results are returned as futures. If a job throws a CScriptException, so does the future's get() -
+ * as a CScriptException* that must be deleted, just like one thrown by CTinyJS. */
+class CTinyJSPool {
+public:
+    /** Start the given number of workers (or one per core if 0), each with a copy of engine (see
+     * CTinyJS(const CTinyJS&)). engine is only used while we're being constructed. Each worker's
+     * queue can hold queueSize jobs - if they are all full, submitting waits until one isn't. */
+    CTinyJSPool(const CTinyJS &engine, int threads = 0, size_t queueSize = 1024);
+    /// Wait for all the jobs that have been submitted to be done, then stop the workers
+    ~CTinyJSPool();
+
+    /// Queue code to be evaluated - the result is what CTinyJS::evaluate returns
+    std::future<std::string> evaluate(const std::string &code);
+    /** Queue a call to a function with the given arguments, which are JavaScript expressions (such as
+     * numbers, quoted strings or JSON). The result is the value it returns, as a string. */
+    std::future<std::string> call(const std::string &function, const std::vector<std::string> &args);
+    /// Queue a job that is given a worker's CTinyJS to do whatever it needs to
+    std::future<std::string> submit(const std::function<std::string(CTinyJS*)> &job);
+    /** Add 'Array.parallelMap(fn)' and 'Array.parallelForEach(fn)' to engine. They split the array into a
+     * part for each of our workers, which each get a copy of their part and of fn's source (see
+     * CScriptVar::serialize), parse it once and call fn on each element. parallelMap returns what it returned,
+     * in order. fn must be written in JavaScript. Any other name it uses is looked up in the worker's globals -
+     * which are those of the engine we were created from, not the caller's - so it can't see the caller's
+     * variables, or the variables of the function it was written in. These can't be used by our own jobs.
+     * We must outlive engine. */
+    void addTo(CTinyJS *engine);
+
+    int getThreadCount() { return (int)workers.size(); }
+protected:
+    struct Worker {
+      int index;
+      CTinyJS *engine;
+      CScriptQueue<CTinyJSPoolJob*> *queue;
+      std::thread thread;
+    };
+    static void scArrayParallelMap(CScriptVar *c, void *userdata) { scArrayParallel(c, userdata, true); }
+    static void scArrayParallelForEach(CScriptVar *c, void *userdata) { scArrayParallel(c, userdata, false); }
+    std::vector<Worker*> workers;
+    std::atomic<size_t> nextWorker; ///< Whose queue the next job goes in
+    std::atomic<int> pending; ///< Jobs that are queued (this can briefly be -1, as a job can be taken before it's counted)
+    std::atomic<int> sleeping; ///< Workers that are waiting for a job
+    std::atomic<bool> stopping; ///< Set when we're destroyed, so workers stop once there are no jobs left
+    std::mutex sleepMutex; ///< Only used to sleep and wake workers - queueing and taking jobs doesn't lock
+    std::condition_variable wake;
+
+    void run(Worker *worker); ///< What each worker's thread runs
+    static void scArrayParallel(CScriptVar *c, void *userdata, bool map); ///< Array.parallelMap/parallelForEach
+    CTinyJSPoolJob *take(Worker *worker); ///< Take a job from worker's queue, or another worker's, or return 0
+
+    CTinyJSPool(const CTinyJSPool &); // not copyable
+    CTinyJSPool &operator=(const CTinyJSPool &);
+};
+
+#endif
@@ -33,11 +33,24 @@
 #include "TinyJS.h"
 #include "TinyJS_Functions.h"
 #include "TinyJS_MathFunctions.h"
+#include "TinyJS_Pool.h"
 #include <assert.h>
 #include <sys/stat.h>
+#ifdef _WIN32
+#include <process.h>
+#define getpid _getpid
+#else
+#include <unistd.h>
+#endif
 #include <string>
 #include <sstream>
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <vector>
+#include <thread>
+#include <atomic>
+#include <chrono>
 
 #ifdef MTRACE
   #include <mcheck.h>
@@ -191,8 +204,202 @@ void memtracing_kill() {
 #endif // INSANE_MEMORY_DEBUG
 
 
-bool run_test(const char *filename) {
-  printf("TEST %s ", filename);
+/// Tests can send messages to themselves (or, when running on many threads, each other) through this
+CScriptChannel *testChannel = 0;
+/// The workers that Array.parallelMap/parallelForEach use
+CTinyJSPool *testPool = 0;
+
+/// What the last call to waitFor on this thread was given, for run_script to resume its task with
+thread_local CScriptVar *waitingFor = 0;
+
+/* waitFor(value) returns value - but when it's called in a CScriptTask, only once the task has been
+ * resumed with it. The 'task' pass runs tests in tasks, so this checks that code carries on properly */
+void scWaitFor(CScriptVar *c, void *) {
+  CScriptVar *value = c->getParameter("value");
+  if (!CScriptTask::getCurrent()) {
+    c->setReturnVar(value);
+    return;
+  }
+  waitingFor = value->ref();
+  c->setReturnVar(CScriptVar::constPending());
+}
+
+/// Create an engine the usual way, with the functions the tests use
+CTinyJS *create_engine() {
+  CTinyJS *js = new CTinyJS();
+  registerFunctions(js);
+  registerMathFunctions(js);
+  testChannel->addTo(js, "channel");
+  js->addNative("function waitFor(value)", scWaitFor, 0);
+  if (testPool) testPool->addTo(js);
+  return js;
+}
+
+/// Engines that tests are run in copies of (see the passes below)
+CTinyJS *templateEngine = 0;
+CTinyJS *frozenEngine = 0;
+/// The snapshot of templateEngine that the 'snapshot' pass loads - see create_template
+std::string snapshotFile;
+
+/// A file somewhere temporary (as the tests could be run from anywhere), unique to this process
+std::string temp_file(const char *suffix) {
+  const char *dir = getenv("TMPDIR");
+  if (!dir) dir = getenv("TEMP");
+  if (!dir) dir = "/tmp";
+  char name[64];
+  sprintf(name, "/tiny-js-tests-%d%s", (int)getpid(), suffix);
+  return std::string(dir) + name;
+}
+
+void create_template() {
+  testChannel = new CScriptChannel();
+  // its workers are copies from before parallelMap is added, so they can't use it (and wait for themselves)
+  CTinyJS *workerEngine = create_engine();
+  testPool = new CTinyJSPool(*workerEngine, 2);
+  delete workerEngine;
+  templateEngine = create_engine();
+  frozenEngine = create_engine();
+  frozenEngine->freezeBuiltins();
+  snapshotFile = temp_file(".snapshot");
+  // without it, the 'snapshot' pass can't test anything
+  try {
+    templateEngine->saveSnapshot(snapshotFile);
+  } catch (CScriptException *e) {
+    printf("ERROR: %s\n", e->text.c_str());
+    exit(1);
+  }
+}
+
+/// Tests run in the 'reset' pass in this, which is a copy of templateEngine that is reset after each test
+thread_local CTinyJS *resetEngine = 0;
+
+CTinyJS *get_reset_engine() {
+  if (!resetEngine) {
+    resetEngine = new CTinyJS(*templateEngine);
+    resetEngine->markBaseline();
+  }
+  return resetEngine;
+}
+
+void delete_reset_engine() {
+  delete resetEngine;
+  resetEngine = 0;
+}
+
+void delete_template() {
+  delete_reset_engine();
+  delete templateEngine;
+  delete frozenEngine;
+  delete testPool;
+  delete testChannel;
+  remove(snapshotFile.c_str());
+}
+
+/// Run code in s, returning whether it set 'result'. If it didn't, and failFile is given, write the symbols to it
+bool run_script(CTinyJS &s, const std::string &code, const char *failFile) {
+  s.root->addChild("result", new CScriptVar("0",SCRIPTVAR_INTEGER));
+  try {
+    if (CTinyJS::isPrecompiled(code))
+      s.executePrecompiled(code);
+    else
+      s.execute(code);
+  } catch (CScriptException *e) {
+    printf("ERROR: %s\n", e->text.c_str());
+    delete e;
+  }
+  bool pass = s.root->getParameter("result")->getBool();
+  if (!pass && failFile) {
+    FILE *f = fopen(failFile, "wt");
+    if (f) {
+      std::ostringstream symbols;
+      s.root->getJSON(symbols);
+      fprintf(f, "%s", symbols.str().c_str());
+      fclose(f);
+    }
+  }
+  return pass;
+}
+
+/* Each test is run in each of these ways. The first is how TinyJS is normally used, and each of the
+ * others checks one feature on its own - so if only one of them fails, that feature is broken */
+enum TestPass {
+  PASS_PLAIN,        ///< in a new engine
+  PASS_OPTIMISE,     ///< ... with setOptimise
+  PASS_COMPILE,      ///< ... with setCompileThreshold(1), so everything that can be compiled is
+  PASS_PRECOMPILED,  ///< ... from the result of precompile
+  PASS_TASK,         ///< ... in a CScriptTask, resuming it each time it waits for waitFor
+  PASS_COPY,         ///< in a copy of templateEngine
+  PASS_SNAPSHOT,     ///< in an engine loaded from a snapshot of templateEngine
+  PASS_FROZEN,       ///< in a copy of an engine whose built-in objects are frozen
+  PASS_RESET,        ///< twice in an engine that is reset to its baseline after each time
+  PASS_COUNT
+};
+const char *passNames[PASS_COUNT] = { "plain", "optimise", "compile", "precompiled", "task", "copy", "snapshot", "frozen", "reset" };
+
+bool run_pass(const std::string &code, TestPass pass, const char *failFile) {
+  if (pass==PASS_COPY || pass==PASS_FROZEN) {
+    CTinyJS s(pass==PASS_COPY ? *templateEngine : *frozenEngine);
+    return run_script(s, code, failFile);
+  }
+  if (pass==PASS_RESET) {
+    /* the second run checks that resetToBaseline put back everything the first one changed */
+    CTinyJS *s = get_reset_engine();
+    bool ok = run_script(*s, code, 0);
+    s->resetToBaseline();
+    ok = run_script(*s, code, failFile) && ok;
+    s->resetToBaseline();
+    if (s->root->findChild("result")) {
+      printf("ERROR: resetToBaseline didn't remove 'result'\n");
+      ok = false;
+    }
+    return ok;
+  }
+  CTinyJS *s = create_engine();
+  bool ok = false;
+  if (pass==PASS_SNAPSHOT) {
+    try {
+      s->loadSnapshot(snapshotFile);
+    } catch (CScriptException *e) {
+      printf("ERROR: %s\n", e->text.c_str());
+      delete e;
+      delete s;
+      return false;
+    }
+  }
+  if (pass==PASS_OPTIMISE) s->setOptimise(true);
+  if (pass==PASS_COMPILE) s->setCompileThreshold(1);
+  if (pass==PASS_PRECOMPILED) {
+    std::string precompiled;
+    try {
+      precompiled = s->precompile(code);
+    } catch (CScriptException *e) {
+      printf("ERROR: %s\n", e->text.c_str());
+      delete e;
+    }
+    ok = run_script(*s, precompiled, failFile);
+  } else if (pass==PASS_TASK) {
+    s->root->addChild("result", new CScriptVar("0",SCRIPTVAR_INTEGER));
+    try {
+      CScriptTask task(s, code);
+      bool finished = task.run();
+      while (!finished) {
+        CScriptVarLink value(waitingFor);
+        waitingFor->unref();
+        waitingFor = 0;
+        finished = task.resume(value.var);
+      }
+    } catch (CScriptException *e) {
+      printf("ERROR: %s\n", e->text.c_str());
+      delete e;
+    }
+    ok = s->root->getParameter("result")->getBool();
+  } else
+    ok = run_script(*s, code, failFile);
+  delete s;
+  return ok;
+}
+
+bool read_file(const char *filename, std::string &contents) {
   struct stat results;
   if (!stat(filename, &results) == 0) {
     printf("Cannot stat file! '%s'\n", filename);
@@ -210,38 +417,340 @@ bool run_test(const char *filename) {
   buffer[actualRead]=0;
   buffer[size]=0;
   fclose(file);
+  contents = buffer;
+  delete[] buffer;
+  return true;
+}
 
-  CTinyJS s;
-  registerFunctions(&s);
-  registerMathFunctions(&s);
-  s.root->addChild("result", new CScriptVar("0",SCRIPTVAR_INTEGER));
+/// Run a test in each way (see TestPass), returning how many of them passed
+int run_test(const char *filename, bool verbose = true) {
+  std::string code;
+  if (!read_file(filename, code)) return 0;
+  int passed = 0;
+  std::string failed;
+  for (int p=0;p<PASS_COUNT;p++) {
+    char fn[64];
+    sprintf(fn, "%s.%s.fail.js", filename, passNames[p]);
+    if (run_pass(code, (TestPass)p, verbose ? fn : 0))
+      passed++;
+    else
+      failed += std::string(failed.empty() ? "" : ", ") + passNames[p];
+  }
+  if (failed.empty()) {
+    if (verbose) printf("TEST %s PASS\n", filename);
+  } else if (verbose)
+    printf("TEST %s FAIL (%s) - symbols written to %s.*.fail.js\n", filename, failed.c_str(), filename);
+  else
+    printf("TEST %s FAIL (%s)\n", filename, failed.c_str());
+  return passed;
+}
+
+/* Tests of what the host sees when it uses the API, which scripts can't check for themselves */
+
+/// Run code in js, returning the CScriptLimitException it throws (or 0 if it doesn't throw one)
+CScriptLimitException *run_to_limit(CTinyJS *js, const std::string &code) {
   try {
-    s.execute(buffer);
+    js->execute(code);
+  } catch (CScriptLimitException *e) {
+    return e;
   } catch (CScriptException *e) {
     printf("ERROR: %s\n", e->text.c_str());
+    delete e;
   }
-  bool pass = s.root->getParameter("result")->getBool();
+  return 0;
+}
 
-  if (pass)
-    printf("PASS\n");
-  else {
-    char fn[64];
-    sprintf(fn, "%s.fail.js", filename);
-    FILE *f = fopen(fn, "wt");
-    if (f) {
-      std::ostringstream symbols;
-      s.root->getJSON(symbols);
-      fprintf(f, "%s", symbols.str().c_str());
-      fclose(f);
-    }
+bool test_fuel_limit() {
+  CTinyJS *js = create_engine();
+  js->setFuelLimit(1000);
+  // under the limit is fine, and each iteration uses fuel
+  js->execute("var n = 0; for (var i=0;i<100;i++) n++;");
+  bool pass = js->getFuelUsed()>=100 && js->getFuelUsed()<1000;
+  // going over it isn't, even when it's done by lots of loops and calls that are each short
+  CScriptLimitException *e = run_to_limit(js, "function f() { for (var i=0;i<10;i++) {} } for (var j=0;j<200;j++) f();");
+  pass = pass && e && e->text.find("Fuel limit")!=std::string::npos;
+  delete e;
+  // and the limit is for each call to execute
+  js->execute("n = 0; for (var i=0;i<500;i++) n++;");
+  pass = pass && js->evaluate("n")=="500";
+  delete js;
+  return pass;
+}
 
-    printf("FAIL - symbols written to %s\n", fn);
+bool test_time_limit() {
+  CTinyJS *js = create_engine();
+  js->setTimeLimit(50);
+  std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+  CScriptLimitException *e = run_to_limit(js, "while (true) {}");
+  long long ms = std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now()-start).count();
+  bool pass = e && e->text.find("Time limit")!=std::string::npos && ms>=50 && ms<5000;
+  delete e;
+  delete js;
+  return pass;
+}
+
+bool test_limit_exception_type() {
+  // raise() throws the exception as what it really is, so it can be rethrown without losing its type
+  CScriptException *limit = new CScriptLimitException("test");
+  bool pass = false;
+  try {
+    limit->raise();
+  } catch (CScriptLimitException *e) {
+    pass = e==limit;
+  } catch (CScriptException *e) {
   }
+  delete limit;
+  return pass;
+}
 
-  delete[] buffer;
+bool test_memory_limit() {
+  CTinyJS *js = create_engine();
+  size_t limit = js->getMemoryUsed() + 64*1024;
+  js->setMemoryLimit(limit);
+  CScriptLimitException *e = run_to_limit(js, "var a = []; for (var i=0;i<100000;i++) a.push('item '+i);");
+  // it's stopped soon after going over the limit
+  bool pass = e && e->text.find("Memory limit")!=std::string::npos &&
+              js->getMemoryPeak()>limit && js->getMemoryPeak()<limit+16*1024;
+  delete e;
+  // what was made can be freed, and then scripts can carry on
+  js->execute("a = 0;");
+  pass = pass && js->getMemoryUsed()<limit;
+  js->execute("var b = []; for (var i=0;i<10;i++) b.push('item '+i);");
+  pass = pass && js->evaluate("b.length")=="10" && js->getMemoryPeak()>limit;
+  delete js;
+  return pass;
+}
+
+/// Return the error that executing code (precompiled or not) in js gives, or "" if there isn't one
+std::string get_error(CTinyJS *js, const std::string &code, bool precompiled) {
+  std::string error;
+  try {
+    if (precompiled)
+      js->executePrecompiled(code);
+    else
+      js->execute(code);
+  } catch (CScriptException *e) {
+    error = e->text;
+    delete e;
+  }
+  return error;
+}
+
+/// Set the int at pos in precompiled code, and update its checksum so that only the checks after that can notice
+std::string damage_precompiled(std::string precompiled, size_t pos, int value) {
+  memcpy(&precompiled[pos], &value, sizeof(int32_t));
+  // FNV-1a of everything after the header, as loadPrecompiled checks
+  const size_t headerSize = 16;
+  uint32_t hash = 2166136261u;
+  for (size_t i=headerSize;i<precompiled.size();i++)
+    hash = (hash ^ (unsigned char)precompiled[i]) * 16777619u;
+  memcpy(&precompiled[headerSize-sizeof(int32_t)], &hash, sizeof(int32_t));
+  return precompiled;
+}
+
+int read_precompiled_int(const std::string &precompiled, size_t pos) {
+  int32_t value;
+  memcpy(&value, &precompiled[pos], sizeof(value));
+  return value;
+}
+
+bool test_precompiled() {
+  CTinyJS *js = create_engine();
+  std::string code = "var a = 1;\nvar b = 2;\nvar c = a + ;";
+  std::string precompiled = js->precompile(code);
+  // errors are reported at the same place as they are in the code
+  std::string error = get_error(js, precompiled, true);
+  bool pass = !error.empty() && error==get_error(js, code, false) && error.find("line: 3")!=std::string::npos;
+  pass = pass && get_error(js, js->precompile("var d = 3;"), true).empty() && js->evaluate("d")=="3";
+
+  // find the tokens and newlines: after the header, the code and strings
+  size_t pos = 16;
+  pos += sizeof(int32_t) + read_precompiled_int(precompiled, pos);
+  int strings = read_precompiled_int(precompiled, pos);
+  pos += sizeof(int32_t);
+  for (int i=0;i<strings;i++)
+    pos += sizeof(int32_t) + read_precompiled_int(precompiled, pos);
+  size_t tokensPos = pos;
+  size_t newlinesPos = tokensPos + sizeof(int32_t) + read_precompiled_int(precompiled, tokensPos)*4*sizeof(int32_t);
+  int newlines = read_precompiled_int(precompiled, newlinesPos);
+
+  std::string badMagic = precompiled;
+  badMagic[0] = 'X';
+  std::string badVersion = precompiled;
+  badVersion[4]++;
+  std::string badChecksum = precompiled;
+  badChecksum[precompiled.size()-1]++;
+  // the first token's end is past the end of the code
+  std::string badToken = damage_precompiled(precompiled, tokensPos + 3*sizeof(int32_t), 1<<20);
+  // the last newline is missing from the table
+  std::string missingNewline = damage_precompiled(precompiled.substr(0, precompiled.size()-sizeof(int32_t)), newlinesPos, newlines-1);
+  pass = pass && newlines==2 &&
+         get_error(js, badMagic, true).find("Not precompiled")!=std::string::npos &&
+         get_error(js, badVersion, true).find("different version")!=std::string::npos &&
+         get_error(js, badChecksum, true).find("corrupt")!=std::string::npos &&
+         get_error(js, badToken, true).find("corrupt")!=std::string::npos &&
+         get_error(js, missingNewline, true).find("corrupt")!=std::string::npos;
+  delete js;
   return pass;
 }
 
+/// Native functions that change a frozen array (see CTinyJS::freezeBuiltins) change the engine's own copy, as scripts do
+bool test_frozen_natives() {
+  CTinyJS *js = create_engine();
+  js->execute("var config = {list:[1,2]};");
+  js->freezeBuiltins();
+  CTinyJS *copy = js->clone();
+  bool pass = true;
+  try {
+    copy->execute("var list = config.list; config.list.push(3); list.push(4); config.list.remove(1);");
+    pass = copy->evaluate("config.list.length + ',' + config.list[0] + config.list[2] + ',' + (list==config.list)")=="3,24,1" &&
+           js->evaluate("config.list.length")=="2";
+  } catch (CScriptException *e) {
+    printf("ERROR: %s\n", e->text.c_str());
+    delete e;
+    pass = false;
+  }
+  delete copy;
+  delete js;
+  return pass;
+}
+
+/// callFunction returns what a call in JavaScript would, whatever kind of function it's given
+bool test_call_function() {
+  CTinyJS *js = create_engine();
+  js->execute("function pick(a, b) { return b==undefined ? a : b; } function add(a, b) { return a + b; }");
+  CScriptVar *pick = js->root->findChild("pick")->var;
+  CScriptVar *add = js->root->findChild("add")->var;
+  CScriptVarLink min = js->evaluateComplex("Math.min");
+  CScriptVarLink two(new CScriptVar(2));
+  CScriptVarLink three(new CScriptVar(3));
+  std::vector<CScriptVar*> args;
+  args.push_back(two.var);
+  // missing arguments are undefined
+  bool pass = js->callFunction(pick, args).var->getInt()==2;
+  args.push_back(three.var);
+  pass = pass && js->callFunction(pick, args).var->getInt()==3 && js->callFunction(min.var, args).var->getInt()==2;
+  // once it's compiled, too
+  js->setCompileThreshold(2);
+  for (int i=0;i<3;i++)
+    pass = pass && js->callFunction(add, args).var->getInt()==5;
+  std::string error;
+  try {
+    js->callFunction(two.var, args);
+  } catch (CScriptException *e) {
+    error = e->text;
+    delete e;
+  }
+  pass = pass && error.find("Expecting a function")!=std::string::npos;
+  delete js;
+  return pass;
+}
+
+/// Whether a snapshot saved by 'from' loads into 'to', and the native function it has still works
+bool snapshot_loads(CTinyJS *from, CTinyJS *to) {
+  std::string file = temp_file("-natives.snapshot");
+  bool pass = true;
+  try {
+    from->saveSnapshot(file);
+    to->loadSnapshot(file);
+    pass = to->evaluate("Test.waitFor(4)")=="4";
+  } catch (CScriptException *e) {
+    printf("ERROR: %s\n", e->text.c_str());
+    delete e;
+    pass = false;
+  }
+  remove(file.c_str());
+  return pass;
+}
+
+const CScriptNativeDesc testNatives[] = {
+  { "Test.waitFor", { "value" }, scWaitFor },
+};
+
+/// Snapshots find natives the same way whether they were added with addNative or a table, however they were spaced
+bool test_snapshot_natives() {
+  CTinyJS *added = new CTinyJS();
+  added->addNative("function Test.waitFor( value )", scWaitFor, 0);
+  CTinyJS *table = new CTinyJS();
+  table->addNatives(testNatives, 0);
+  bool pass = snapshot_loads(added, table) && snapshot_loads(table, added);
+  delete added;
+  delete table;
+  return pass;
+}
+
+struct HostTest {
+  const char *name;
+  bool (*run)();
+};
+HostTest hostTests[] = {
+  { "fuel limit", test_fuel_limit },
+  { "time limit", test_time_limit },
+  { "limit exception type", test_limit_exception_type },
+  { "memory limit", test_memory_limit },
+  { "precompiled code", test_precompiled },
+  { "snapshot natives", test_snapshot_natives },
+  { "call function", test_call_function },
+  { "frozen natives", test_frozen_natives },
+};
+
+/* Run every test (in each way) on each of the given number of threads at once. Each
+ * test has its own CTinyJS, so this checks that separate instances can run concurrently - build
+ * with -DTINYJS_TSAN=ON to have ThreadSanitizer check that they don't share anything */
+int run_threaded(const std::vector<std::string> &tests, int threadCount) {
+  std::atomic<int> passed(0);
+  std::vector<std::thread> threads;
+  for (int t=0;t<threadCount;t++) {
+    threads.push_back(std::thread([&tests, &passed]() {
+      for (size_t i=0;i<tests.size();i++) {
+        passed += run_test(tests[i].c_str(), false);
+      }
+      delete_reset_engine();
+    }));
+  }
+  for (size_t t=0;t<threads.size();t++)
+    threads[t].join();
+  int count = (int)tests.size()*PASS_COUNT*threadCount;
+  printf("Done. %d tests on %d threads, %d pass, %d fail\n", count, threadCount, (int)passed, count-passed);
+  return passed==count ? 0 : 1;
+}
+
+/* Run every test (as-is) the given number of times as jobs in a CTinyJSPool, which has that many threads.
+ * The jobs are all queued at once, so the workers' engines are reset between them and they take jobs
+ * from each other */
+int run_pool(const std::vector<std::string> &tests, int threadCount) {
+  CTinyJSPool pool(*templateEngine, threadCount);
+  std::vector<std::future<std::string> > results;
+  for (int t=0;t<threadCount;t++)
+    for (size_t i=0;i<tests.size();i++) {
+      std::string code;
+      read_file(tests[i].c_str(), code);
+      results.push_back(pool.submit([code](CTinyJS *js) {
+        js->root->addChild("result", new CScriptVar("0",SCRIPTVAR_INTEGER));
+        js->execute(code);
+        return std::string(js->root->getParameter("result")->getBool() ? "PASS" : "FAIL");
+      }));
+    }
+  // and as a function call
+  results.push_back(pool.call("charToInt", std::vector<std::string>(1, "'a'")));
+  int passed = 0;
+  for (size_t i=0;i<results.size();i++) {
+    std::string expected = i<results.size()-1 ? "PASS" : "97";
+    const char *test = i<results.size()-1 ? tests[i%tests.size()].c_str() : "call";
+    try {
+      std::string result = results[i].get();
+      if (result == expected) passed++;
+      else printf("TEST %s FAIL\n", test);
+    } catch (CScriptException *e) {
+      printf("TEST %s ERROR: %s\n", test, e->text.c_str());
+      delete e;
+    }
+  }
+  int count = (int)results.size();
+  printf("Done. %d tests in a pool of %d threads, %d pass, %d fail\n", count, threadCount, passed, count-passed);
+  return passed==count ? 0 : 1;
+}
+
 int main(int argc, char **argv)
 {
 #ifdef MTRACE
@@ -254,8 +763,27 @@ int main(int argc, char **argv)
   printf("USAGE:\n");
   printf("   ./run_tests test.js       : run just one test\n");
   printf("   ./run_tests               : run all tests\n");
+  printf("   ./run_tests -threads N    : run all tests on N threads at once\n");
+  printf("   ./run_tests -pool N       : run all tests N times in a pool of N threads\n");
+  create_template();
+  if (argc==3 && (!strcmp(argv[1], "-threads") || !strcmp(argv[1], "-pool"))) {
+    std::vector<std::string> tests;
+    for (int test_num=1;test_num<1000;test_num++) {
+      char fn[32];
+      sprintf(fn, "tests/test%03d.js", test_num);
+      FILE *f = fopen(fn,"r");
+      if (!f) break;
+      fclose(f);
+      tests.push_back(fn);
+    }
+    int result = !strcmp(argv[1], "-pool") ? run_pool(tests, atoi(argv[2])) : run_threaded(tests, atoi(argv[2]));
+    delete_template();
+    return result;
+  }
   if (argc==2) {
-    return !run_test(argv[1]);
+    bool pass = run_test(argv[1])==PASS_COUNT;
+    delete_template();
+    return !pass;
   }
 
   int test_num = 1;
@@ -270,13 +798,21 @@ int main(int argc, char **argv)
     if (!f) break;
     fclose(f);
 
-    if (run_test(fn))
-      passed++;
-    count++;
+    // each way of running it counts as a test
+    passed += run_test(fn);
+    count += PASS_COUNT;
     test_num++;
   }
 
+  for (size_t i=0;i<sizeof(hostTests)/sizeof(hostTests[0]);i++) {
+    bool pass = hostTests[i].run();
+    printf("TEST %s %s\n", hostTests[i].name, pass ? "PASS" : "FAIL");
+    if (pass) passed++;
+    count++;
+  }
+
   printf("Done. %d tests, %d pass, %d fail\n", count, passed, count-passed);
+  delete_template();
 #ifdef INSANE_MEMORY_DEBUG
     memtracing_kill();
 #endif
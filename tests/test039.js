@@ -0,0 +1,13 @@
+// functions share the source they came from - check cloned methods still work
+var proto = {
+  value : 3,
+  get : function() { return this.value; },
+  twice : function(x) { return x*2; }
+};
+var copy = proto.clone();
+copy.value = 5;
+exec("function later(a) { return a+1; }");
+var body = JSON.stringify(copy.twice, undefined);
+
+result = copy.get()==5 && proto.get()==3 && copy.twice(4)==8 && later(1)==2 &&
+         body.indexOf("return x*2;")>=0;
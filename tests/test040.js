@@ -0,0 +1,15 @@
+// true/false/null/undefined and small ints are shared constants - make sure writing to them doesn't leak
+var u = undefined;
+u.a = 5;
+var v = undefined;
+var w = undefined;
+var t = true;
+t.x = 2;
+var t2 = true;
+var a = 1;
+var b = a << 2;
+var arr = [1,2];
+var missing = arr[5];
+
+result = u.a==5 && v.a==undefined && t2.x==undefined && t==1 && a==1 && b==4 &&
+         (5>3)==true && (1+2)==3 && missing==undefined && w==undefined;
@@ -0,0 +1,16 @@
+// maths on each pair of types, and ints that overflow becoming doubles
+var big = 2147483647;
+var over = big + 1;
+var under = -big - 2;
+var mul = 65536 * 65536;
+var mixed = 1 + 0.5;
+var s1 = "abc";
+var s2 = "abd";
+// literals too big for an int are doubles too
+var v = 3000000000;
+var bigLiterals = v * 1.0 > 0 && v == 3000000000.0 && (v + 0.5) == 3000000000.5 && over == 2147483648 &&
+                  -2147483647 - 1 == -2147483648;
+
+result = over == 2147483648.0 && over > big && under == -2147483649.0 && mul == 4294967296.0 &&
+         mixed == 1.5 && (7/2)==3 && (7%3)==1 && (s1 < s2) && s1 != s2 && (s1+s2) == "abcabd" &&
+         ("x"+1) == "x1" && (null+1) == 1 && (big+0) == big && bigLiterals;
@@ -0,0 +1,20 @@
+// in-place += and ++ must not change other variables that share the value
+var s = "";
+for (var i=0;i<100;i++) s += "ab";
+var t = s;
+t += "c";
+var a = 5;
+var b = a;
+a += 2;
+b -= 1;
+var c = 10;
+var d = c++;
+var e = c;
+c++;
+var f = 1.5;
+f += 1;
+var g = 2147483647;
+g++;
+
+result = s.length==200 && t.length==201 && a==7 && b==4 && c==12 && d==10 && e==11 &&
+         f==2.5 && g==2147483648.0;
@@ -0,0 +1,18 @@
+// cached method lookups must notice when classes change
+var Animal = { speak : function() { return 1; } };
+var Dog = { prototype : Animal };
+var d = new Dog();
+var first = d.speak();
+Animal.speak = function() { return 2; };
+var second = d.speak();
+Dog.speak = function() { return 3; };
+var third = d.speak();
+Dog.prototype = { speak : function() { return 4; } };
+var fourth = d.speak();
+String.shout = function() { return this + "!"; };
+var hi = "hi";
+var s = hi.shout();
+var hello = "hello";
+var idx = hello.indexOf("l");
+
+result = first==1 && second==2 && third==3 && fourth==4 && s=="hi!" && idx==2;
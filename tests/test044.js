@@ -0,0 +1,11 @@
+// Math functions are intrinsics, and Math.PI/Math.E are properties
+var s = Math.sin(Math.PI/2);
+var c = Math.cos(0);
+var m = Math.max(3, Math.min(10, 7));
+var a = Math.abs(-4);
+var r = Math.range(15, 0, 10);
+var total = 0;
+for (var i=0;i<10;i++) total += Math.sqr(i);
+
+result = s==1 && c==1 && m==7 && a==4 && r==10 && total==285 &&
+         Math.PI > 3.14159 && Math.PI < 3.1416 && Math.E > 2.718 && Math.E < 2.719;
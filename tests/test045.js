@@ -0,0 +1,11 @@
+// constant folding and dead branch removal must not change what code does
+var secs = 60*60*24;
+var half = (1.0/2);
+var mixed = (2+3)*secs;
+var branch = 0;
+if (0) branch = 1; else branch = 2;
+if (1) { if (false) branch += 10; else branch += 20; }
+while (0) branch = 99;
+function scale(x) { return x * (10-8); }
+
+result = secs==86400 && half==0.5 && mixed==432000 && branch==22 && scale(4)==8 && (7/2)==3;
@@ -0,0 +1,58 @@
+// functions that only use numbers can be compiled (see setCompileThreshold) - check they behave the same
+
+function sum(n) {
+  var total = 0;
+  for (var i=0;i<n;i++) {
+    var sq = i*i;
+    total += sq;
+  }
+  return total;
+}
+
+function collatz(n) {
+  var steps = 0;
+  while (n != 1) {
+    if (n % 2 == 0) n = n / 2; else n = 3*n + 1;
+    steps++;
+  }
+  return steps;
+}
+
+function logic(a, b) {
+  return (a && b) + (a || b)*10 + (!a)*100 + (a > b ? 1000 : 2000);
+}
+
+function mixed(a, b) {
+  var x = a / b;
+  var y = -a*b + 2147483647;
+  x -= 0.5;
+  return x + y;
+}
+
+function noReturn(a) {
+  a++;
+}
+
+function notNumeric(s) {
+  return s + 1;
+}
+
+var results = [];
+for (var t=0;t<3;t++) {
+  results.push(sum(100) == 328350);
+  results.push(collatz(27) == 111);
+  results.push(logic(3, 0) == 1030 && logic(0, 5) == 2110);
+  results.push(mixed(7, 2) == 2147483635.5 && mixed(1, 0) > 1000000);
+  results.push(mixed(-3, 1) === 2147483646.5);
+  results.push(noReturn(1) === undefined);
+  results.push(notNumeric(5) == 6 && notNumeric("a") == "a1");
+  results.push(sum("3") == 5 && sum(undefined) == 0);
+}
+
+// adding a property to a function adds a parameter
+sum.extra = 1;
+results.push(sum(4, 2) == 14);
+
+result = 1;
+for (var i=0;i<results.length;i++)
+  if (!results[i]) result = 0;
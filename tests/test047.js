@@ -0,0 +1,33 @@
+// simple counted for loops have a fast path - check it still behaves if the body changes things
+
+var a = 0;
+for (var i=0;i<2000;i++) a += i;
+
+var b = 0;
+for (var i=10;i>=0;i--) b = b*2 + i;
+
+// body changes the counter
+var c = 0;
+for (var i=0;i<20;i++) { c++; i += 2; }
+
+// body makes the counter a string (then "3"++ isn't an int)
+var d = 0;
+for (var i=0;i<10;i++) { d++; if (i==3) i = "8"; }
+
+// bound changes inside the loop
+var arr = [1,2,3];
+for (var i=0;i<arr.length;i++) if (arr.length<6) arr.push(i);
+
+// counter is stored elsewhere and must not change with it
+var saved = [];
+for (var i=0;i<1030;i++) if (i%500==0) saved.push(i);
+var n = 5;
+var kept = [];
+for (var j=1;j<=n;j++) kept[j] = j;
+
+// bound isn't a number
+var e = 0;
+for (var i=0;i<undefined;i++) e++;
+
+result = a==1999000 && b==18434 && c==7 && d==4 && arr.length==6 &&
+         saved[0]==0 && saved[1]==500 && saved[2]==1000 && kept[1]==1 && kept[5]==5 && e==0;
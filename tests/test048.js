@@ -0,0 +1,45 @@
+// break, continue and do...while
+
+var arr = [5, 8, 13, 21, 34];
+var found = -1;
+for (var i=0;i<arr.length;i++) {
+  if (arr[i]==13) { found = i; break; }
+}
+
+var odd = 0;
+for (var i=0;i<10;i++) {
+  if (i%2==0) continue;
+  odd += i;
+}
+
+var w = 0;
+while (true) {
+  w++;
+  if (w<5) continue;
+  break;
+}
+
+// break only leaves the inner loop
+var pairs = 0;
+for (var a=0;a<4;a++) {
+  for (var b=0;b<4;b++) {
+    if (b>a) break;
+    pairs++;
+  }
+}
+
+var d = 0;
+do { d++; } while (d<10);
+var once = 0;
+do { once++; } while (0);
+var dc = 0;
+do { dc++; if (dc<3) continue; break; } while (true);
+
+function firstOver(n) {
+  for (var i=0;i<arr.length;i++)
+    if (arr[i]>n) return arr[i];
+  return 0;
+}
+
+result = found==2 && odd==25 && w==5 && pairs==10 && d==10 && once==1 && dc==3 &&
+         firstOver(10)==13 && firstOver(100)==0;
@@ -0,0 +1,63 @@
+// switch statements
+
+function name(n) {
+  switch (n) {
+    case 1: return "one";
+    case 2: return "two";
+    case -3: return "minus three";
+    case "1": return "string one";
+    default: return "other";
+  }
+}
+
+function fall(n) {
+  var s = "";
+  switch (n) {
+    case 0: s += "a";
+    case 1: s += "b"; break;
+    default: s += "d";
+    case 2: s += "c";
+  }
+  return s;
+}
+
+// cases that aren't constants are evaluated in order until one matches
+var evaluated = 0;
+function count(v) { evaluated++; return v; }
+var picked = 0;
+switch (5) {
+  case count(4): picked = 4; break;
+  case count(5): picked = 5; break;
+  case count(6): picked = 6; break;
+}
+
+// 'continue' is for the loop, 'break' in a loop inside a case is for that loop
+var total = 0;
+for (var i=0;i<6;i++) {
+  switch (i % 3) {
+    case 0: continue;
+    case 1:
+      for (var j=0;j<10;j++) { if (j==2) break; total += 10; }
+      break;
+    case 2: total += 1;
+  }
+  total += 100;
+}
+
+var dup = 0;
+switch (1) { case 1: dup = 1; break; case 1: dup = 2; break; }
+var nothing = 0;
+switch (7) { case 1: nothing = 1; }
+var nested = "";
+switch ("x") {
+  case "x":
+    switch (2) { case 2: nested += "inner"; break; }
+    nested += "outer";
+    break;
+}
+
+result = name(1)=="one" && name(2)=="two" && name(-3)=="minus three" && name("1")=="string one" &&
+         name(1.0)=="other" && name(4)=="other" &&
+         fall(0)=="ab" && fall(1)=="b" && fall(2)=="c" && fall(9)=="dc" &&
+         picked==5 && evaluated==2 && total==(20+100)*2+(1+100)*2 && dup==1 && nothing==0 &&
+         nested=="innerouter";
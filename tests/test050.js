@@ -0,0 +1,15 @@
+// loops are no longer limited to a fixed number of iterations (see CTinyJS::setFuelLimit)
+var n = 0;
+for (var i=0;i<20000;i++) n++;
+var w = 0;
+while (w<10000) w++;
+var d = 0;
+do { d++; } while (d<10000);
+
+function spin(count) {
+  var c = 0;
+  while (c<count) c++;
+  return c;
+}
+
+result = n==20000 && w==10000 && d==10000 && spin(30000)==30000;
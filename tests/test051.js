@@ -0,0 +1,23 @@
+// built-in functions are only created when first looked up - check they behave as if they were always there
+
+// first used from inside a function
+function angle() {
+  Math.extra = 2;
+  return Math.round(Math.sin(Math.PI/2)*10) + Math.extra;
+}
+var a = angle();
+
+// replacing one before it is used means we get ours
+var Integer = { parseInt : function(s) { return 42; } };
+var b = Integer.parseInt("7");
+
+// and these were already in String/Array
+var str = "hello";
+var chr = String.fromCharCode(65);
+var c = str.indexOf("l") + chr.charCodeAt(0);
+var arr = [1,2,3];
+var d = arr.contains(2);
+
+var json = JSON.stringify(arr, undefined);
+
+result = a==12 && b==42 && c==67 && d && json.indexOf("3")>0 && eval("charToInt('a')")==97;
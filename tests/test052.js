@@ -0,0 +1,21 @@
+// built-in objects may be shared between engines (see CTinyJS::freezeBuiltins) - changing them only changes ours
+// however an object is reached, a change to it is seen every other way
+var m = Math;
+var arr = [Math];
+function f(o) { o.y = 2; }
+m.x = 1;
+f(Math);
+arr[0].z = 3;
+Math.q = 5;
+var aliased = Math.x==1 && Math.y==2 && Math.z==3 && m.q==5 && arr[0].q==5 && m==Math;
+
+var before = String.shout==undefined && Math.half==undefined;
+
+String.shout = function() { return this + "!"; };
+Math.half = function(x) { return x/2; };
+Math.PI = 3;
+Math.PI++;
+
+var s = "hi";
+var shouted = s.shout();
+result = before && aliased && shouted=="hi!" && Math.half(8)==4 && Math.PI==4 && Math.floor(2.5)==2 && s.indexOf("i")==1;
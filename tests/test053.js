@@ -0,0 +1,16 @@
+// tests run twice in an engine that is reset in between (see CTinyJS::resetToBaseline) - check nothing the first run changes is still there
+var s = "abc";
+var a = [1,2];
+var before = leftover==undefined && String.trimmed==undefined && Object.extra==undefined &&
+             Math.PI>3.14 && s.indexOf("c")==2 && JSON.stringify(a, undefined)!="none";
+
+var leftover = [1,2,3];
+leftover.remove(2);
+String.trimmed = function() { return "t"; };
+String.indexOf = function(c) { return 42; };
+Object.extra = 1;
+Math.PI = 3;
+JSON.stringify = function(a, b) { return "none"; };
+
+result = before && leftover.length==2 && s.trimmed()=="t" && s.indexOf("c")==42 &&
+         Math.PI==3 && JSON.stringify(a, undefined)=="none";
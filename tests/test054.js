@@ -0,0 +1,13 @@
+// messages sent through a channel (see CScriptChannel) arrive as copies - with objects shared just as they were
+// (and no loops, as TinyJS can't free them)
+var shared = { n : 1 };
+var msg = { i : 42, big : 123456789, d : 1.5, s : "hello", nul : null, arr : [1, "two", [3]], a : shared, b : shared };
+
+// many threads may be sending the same message, so we can only check that we get one of them
+var sent = channel.postMessage(msg);
+var got = channel.receiveMessage();
+got.a.n = 2;
+
+result = sent && got.i==42 && got.big==123456789 && got.d==1.5 && got.s=="hello" && got.nul==null &&
+         got.arr.length==3 && got.arr[1]=="two" && got.arr[2][0]==3 &&
+         got.b.n==2 && shared.n==1;
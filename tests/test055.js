@@ -0,0 +1,19 @@
+// Array.parallelMap/parallelForEach call a function on each element on worker engines (see CTinyJSPool::addTo)
+var nums = [];
+for (var i=0;i<100;i++) nums.push(i);
+var squares = nums.parallelMap(function (x) { return x*x; });
+var ok = squares.length==100;
+for (var i=0;i<100;i++) if (squares[i]!=i*i) ok = false;
+
+var objs = [{a:1},{a:2},{a:3}];
+var names = objs.parallelMap(function (o) { return { name : "n" + o.a, list : [o.a] }; });
+
+// the function runs on copies, in other engines - so it can't change anything here
+var count = 0;
+objs.parallelForEach(function (o) { o.a = 0; count++; });
+
+var empty = [];
+var none = empty.parallelMap(function (x) { return x; });
+
+result = ok && names.length==3 && names[2].name=="n3" && names[0].list[0]==1 &&
+         count==0 && objs[1].a==2 && none.length==0;
@@ -0,0 +1,30 @@
+// waitFor gives its result later when the test is run in a CScriptTask, so check the code carries on properly
+
+function add(a, b) { return waitFor(a) + waitFor(b); }
+function fact(n) {
+  if (n<=1) return waitFor(1);
+  return n*fact(waitFor(n-1));
+}
+
+var sum = 0;
+for (var i=0;i<10;i++) {
+  if (i==5) continue;
+  sum += add(i, waitFor(1));
+}
+var count = 0;
+while (waitFor(true)) {
+  count++;
+  if (waitFor(count)==3) break;
+}
+var obj = { name : "x", get : function() { return waitFor(this.name); } };
+var str = obj.get() + waitFor("y");
+var arr = waitFor([1,2,3]);
+var o = waitFor({a:4});
+var kind = "";
+switch (waitFor(2)) {
+  case 1: kind = "one"; break;
+  case 2: kind = waitFor("two"); break;
+}
+
+result = sum==49 && count==3 && fact(6)==720 && str=="xy" && arr.length==3 && o.a==4 &&
+         kind=="two" && waitFor(waitFor(7))==7;
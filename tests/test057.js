@@ -0,0 +1,10 @@
+// Other children given to an intrinsic function aren't taken as its arguments
+
+Math.min.c = 1;
+Math.min.d = 1;
+Math.min.e = 1;
+Math.min.f = 1;
+var a = Math.min(3, 2);
+var b = Math.abs(-4);
+
+result = a==2 && b==4 && Math.min.f==1;